@@ -37,11 +37,14 @@
 #include <cstdlib>
 #include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include <driver_settings.h>
 #include <keyboard_mouse_driver.h>
@@ -61,6 +64,7 @@
 #endif
 
 #define FILE_UPDATED 'fiUp'
+#define TRACE_DRAIN 'trDr'
 
 static status_t
 our_image(image_info& image)
@@ -77,6 +81,7 @@ our_image(image_info& image)
 
 
 const static uint32 kBarrierThreadPriority = B_FIRST_REAL_TIME_PRIORITY + 4;
+const static bigtime_t kTraceDrainInterval = 250000;
 
 
 // Static hook functions for uBarrier
@@ -97,6 +102,14 @@ uSend(uBarrierCookie cookie, const uint8* buffer, int length)
 }
 
 
+static uBarrierBool
+uSendVector(uBarrierCookie cookie, const uBarrierIOVec* vectors, int count)
+{
+	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
+	return device->SendVector(vectors, count);
+}
+
+
 static uBarrierBool
 uReceive(uBarrierCookie cookie, uint8* buffer, int maxLength, int* outLength) {
 	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
@@ -120,6 +133,13 @@ uGetTime()
 }
 
 
+static uint64_t
+uGetTimeNs()
+{
+	return system_time() * 1000;
+}
+
+
 static void
 uTrace(uBarrierCookie cookie, const char* text) {
 	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
@@ -145,12 +165,20 @@ uMouseCallback(uBarrierCookie cookie, uint16 x, uint16 y,
 }
 
 
+static void
+uMouseRelativeCallback(uBarrierCookie cookie, int32_t dx, int32_t dy)
+{
+	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
+	device->MouseRelativeCallback(dx, dy);
+}
+
+
 static void
 uKeyboardCallback(uBarrierCookie cookie, uint16 key, uint16 modifiers,
-	uBarrierBool isKeyDown, uBarrierBool isKeyRepeat)
+	uBarrierBool isKeyDown, uint16 repeat)
 {
 	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
-	device->KeyboardCallback(key, modifiers, isKeyDown, isKeyRepeat);
+	device->KeyboardCallback(key, modifiers, isKeyDown, repeat);
 }
 
 
@@ -173,6 +201,24 @@ uClipboardCallback(uBarrierCookie cookie, enum uBarrierClipboardFormat format,
 }
 
 
+static void
+uClipboardChunkCallback(uBarrierCookie cookie,
+	enum uBarrierClipboardChunk chunk, enum uBarrierClipboardFormat format,
+	const uint8_t* data, uint32_t size, uint32_t totalSize)
+{
+	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
+	device->ClipboardChunkCallback(chunk, format, data, size, totalSize);
+}
+
+
+static void
+uClipboardSent(uBarrierCookie cookie, void* userData, uBarrierBool sent)
+{
+	uBarrierInputServerDevice* device = (uBarrierInputServerDevice*)cookie;
+	device->ClipboardSent(userData, sent);
+}
+
+
 uBarrierInputServerDevice::uBarrierInputServerDevice()
 	:
 	BHandler("uBarrier Handler"),
@@ -185,22 +231,39 @@ uBarrierInputServerDevice::uBarrierInputServerDevice()
 	fClientName(DEFAULT_NAME),
 	fEnableClipboard(false),
 	fUpdateSettings(false),
-	fKeymapLock("barrier keymap lock")
+	fKeymapLock("barrier keymap lock"),
+	fTraceRunner(NULL),
+	fTraceIcon(NULL),
+	fTraceIconLoaded(false),
+	fKeyRepeatCount(1)
 {
 	fContext = (uBarrierContext*)malloc(sizeof(uBarrierContext));
 	uBarrierInit(fContext);
 
+	// Wakes the input thread from poll() when a clipboard is queued
+	if (pipe(fWakePipe) == 0)
+		fcntl(fWakePipe[1], F_SETFL, O_NONBLOCK);
+	else
+		fWakePipe[0] = fWakePipe[1] = -1;
+
 	fContext->m_connectFunc				= uConnect;
 	fContext->m_receiveFunc				= uReceive;
 	fContext->m_sendFunc				= uSend;
+	fContext->m_sendVectorFunc			= uSendVector;
 	fContext->m_getTimeFunc				= uGetTime;
+	fContext->m_getTimeNsFunc			= uGetTimeNs;
 	fContext->m_screenActiveCallback	= uScreenActive;
 	fContext->m_mouseCallback			= uMouseCallback;
+	fContext->m_mouseRelativeCallback	= uMouseRelativeCallback;
 	fContext->m_keyboardCallback		= uKeyboardCallback;
 	fContext->m_sleepFunc				= uSleep;
 	fContext->m_traceFunc				= uTrace;
 	fContext->m_joystickCallback		= uJoystickCallback;
 	fContext->m_clipboardCallback		= uClipboardCallback;
+	fContext->m_clipboardChunkCallback	= uClipboardChunkCallback;
+	fContext->m_batchReplies			= UBARRIER_TRUE;
+	fContext->m_deferTrace				= UBARRIER_TRUE;
+	fContext->m_coalesceMouseMoves		= UBARRIER_TRUE;
 	fContext->m_clientName				= fClientName;
 	fContext->m_cookie					= (uBarrierCookie)this;
 
@@ -236,7 +299,13 @@ uBarrierInputServerDevice::~uBarrierInputServerDevice()
 		be_app->Unlock();
 	}
 
+	delete fTraceRunner;
+	delete fTraceIcon;
 	free(fContext);
+	if (fWakePipe[0] >= 0) {
+		close(fWakePipe[0]);
+		close(fWakePipe[1]);
+	}
 }
 
 
@@ -282,28 +351,48 @@ uBarrierInputServerDevice::MessageReceived(BMessage* message)
 			Start(NULL, NULL);
 			break;
 		}
+		case TRACE_DRAIN:
+			// Notifications are built here, never on the input thread
+			uBarrierDrainTrace(fContext);
+			break;
 		case B_CLIPBOARD_CHANGED:
 		{
-			// BUG, returns "ERROR: invalid message from client: DCLP".
 			// Disabled by default.
 			if(fEnableClipboard == true)
 			{
 				const char *text = NULL;
 				ssize_t len = 0;
 				BMessage *clip = NULL;
+				uBarrierClipboardData* data = NULL;
 				if (be_clipboard->Lock()) {
 					clip = be_clipboard->Data();
 					if (clip != NULL) {
 						clip->FindData("text/plain", B_MIME_TYPE,
 							(const void **)&text, &len);
 					}
+					// The data belongs to the clipboard, copy it while it is
+					// still locked. The copy is freed by ClipboardSent().
+					if (len > 0 && text != NULL) {
+						data = (uBarrierClipboardData*)malloc(
+							sizeof(uBarrierClipboardData) + len);
+					}
+					if (data != NULL) {
+						memcpy(data + 1, text, len);
+						data->m_format = UBARRIER_CLIPBOARD_FORMAT_TEXT;
+						data->m_data = (const uint8_t*)(data + 1);
+						data->m_size = len;
+					}
 					be_clipboard->Unlock();
 				}
-				if (len > 0 && text != NULL) {
-					uBarrierSendClipboard(fContext, text);
-					TRACE("barrier: data added to clipboard\n");
-				} else
-					TRACE("barrier: couldn't add data to clipboard\n");
+				// The input thread owns the connection, it sends the data
+				// between its own replies
+				if (data != NULL && uBarrierQueueClipboard(fContext, data, 1,
+						uClipboardSent, data)) {
+					_WakeInputThread();
+				} else if (data != NULL) {
+					free(data);
+					TRACE("barrier: clipboard queue full\n");
+				}
 			}
 		}
 		default:
@@ -340,6 +429,10 @@ uBarrierInputServerDevice::Start(const char* name, void* cookie)
 		TRACE("barrier: spawn thread failed: %" B_PRIx32 "\n", status);
 	} else {
 		be_clipboard->StartWatching(this);
+		BMessage drain(TRACE_DRAIN);
+		delete fTraceRunner;
+		fTraceRunner = new BMessageRunner(BMessenger(this), &drain,
+			kTraceDrainInterval);
 		status = resume_thread(uBarrierThread);
 	}
 
@@ -362,6 +455,11 @@ uBarrierInputServerDevice::Stop(const char* name, void* cookie)
 		wait_for_thread(uBarrierThread, &dummy);
 	}
 
+	// Deliver what the thread traced last from the looper, like the rest
+	delete fTraceRunner;
+	fTraceRunner = NULL;
+	BMessenger(this).SendMessage(TRACE_DRAIN);
+
 	return B_OK;
 }
 
@@ -405,6 +503,13 @@ uBarrierInputServerDevice::_MainLoop(void* arg)
 	close(inputDevice->fSocket);
 	inputDevice->fSocket = -1;
 
+#ifdef TRACE_BARRIER_DEVICE
+	char histograms[512];
+	uBarrierFormatHistograms(inputDevice->fContext, histograms,
+		sizeof(histograms));
+	TRACE("barrier: latency histograms\n%s", histograms);
+#endif
+
 	return B_OK;
 }
 
@@ -418,6 +523,17 @@ uBarrierInputServerDevice::_UpdateSettings()
 	fControlKey = fKeymap.KeyForModifier(B_LEFT_CONTROL_KEY);
 	fCommandKey = fKeymap.KeyForModifier(B_LEFT_COMMAND_KEY);
 
+	// Held keys can repeat locally at the system's rate, which is in tenths
+	// of repeats per second. Off unless the settings ask for it, the server's
+	// repeats are used by default
+	bigtime_t repeatDelay;
+	int32 repeatRate;
+	if (get_key_repeat_delay(&repeatDelay) == B_OK)
+		fContext->m_keyRepeatDelay = repeatDelay / 1000;
+	if (get_key_repeat_rate(&repeatRate) == B_OK && repeatRate > 0)
+		fContext->m_keyRepeatInterval = 10000 / repeatRate;
+	fContext->m_localKeyRepeat = UBARRIER_FALSE;
+
 	void* handle = load_driver_settings(fFilename);
 	if (handle == NULL)
 		return;
@@ -427,6 +543,8 @@ uBarrierInputServerDevice::_UpdateSettings()
 	fServerAddress = get_driver_parameter(handle, "server", NULL, NULL);
 	fClientName = get_driver_parameter(handle, "client_name", DEFAULT_NAME, DEFAULT_NAME);
 	fEnableClipboard = get_driver_boolean_parameter(handle, "enableClipboard", false, false); //Get the config variable and set the value. Default is false!
+	fContext->m_localKeyRepeat = get_driver_boolean_parameter(handle,
+		"local_key_repeat", false, true) ? UBARRIER_TRUE : UBARRIER_FALSE;
 
 	unload_driver_settings(handle);
 }
@@ -446,6 +564,8 @@ uBarrierInputServerDevice::Connect()
 
 	TRACE("barrier: connecting to %s:%d\n", fServerAddress.String(), 24800);
 
+	if (fSocket >= 0)
+		close(fSocket);
 	fSocket = socket(PF_INET, SOCK_STREAM, 0);
 	if (fSocket < 0) {
 		TRACE("barrier: socket couldn't be created\n");
@@ -462,7 +582,7 @@ uBarrierInputServerDevice::Connect()
 		return true;
 
 exit:
-	snooze(1000000);
+	// uBarrier schedules the next attempt
 	return false;
 }
 
@@ -470,8 +590,49 @@ exit:
 bool
 uBarrierInputServerDevice::Send(const uint8_t* buffer, int32_t length)
 {
-	if (send(fSocket, buffer, length, 0) != length)
-		return false;
+	// send() may take only part of the buffer, keep going with the rest
+	while (length > 0) {
+		ssize_t sent = send(fSocket, buffer, length, 0);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buffer += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+
+bool
+uBarrierInputServerDevice::SendVector(const uBarrierIOVec* vectors, int count)
+{
+	struct iovec iov[UBARRIER_MAX_SEND_VECTORS];
+	for (int i = 0; i < count; i++) {
+		iov[i].iov_base = (void*)vectors[i].m_data;
+		iov[i].iov_len = vectors[i].m_size;
+	}
+
+	// writev() may stop anywhere, skip what was written and continue
+	struct iovec* next = iov;
+	while (count > 0) {
+		ssize_t sent = writev(fSocket, next, count);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		while (count > 0 && (size_t)sent >= next->iov_len) {
+			sent -= next->iov_len;
+			next++;
+			count--;
+		}
+		if (count > 0) {
+			next->iov_base = (uint8_t*)next->iov_base + sent;
+			next->iov_len -= sent;
+		}
+	}
 	return true;
 }
 
@@ -479,7 +640,29 @@ uBarrierInputServerDevice::Send(const uint8_t* buffer, int32_t length)
 bool
 uBarrierInputServerDevice::Receive(uint8_t *buffer, int maxLength, int* outLength)
 {
-	if ((*outLength = recv(fSocket, buffer, maxLength, 0)) == -1)
+	// Return without data when a uBarrier timer expires, so held keys repeat
+	// and a silent server times out, or when a clipboard was queued
+	struct pollfd fds[2];
+	fds[0].fd = fSocket;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	fds[1].fd = fWakePipe[0];
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+	int ready = poll(fds, fWakePipe[0] >= 0 ? 2 : 1,
+		uBarrierNextTimeout(fContext));
+	*outLength = 0;
+	if (ready < 0)
+		return errno == EINTR;
+	if ((fds[1].revents & POLLIN) != 0) {
+		char wake[16];
+		read(fWakePipe[0], wake, sizeof(wake));
+	}
+	if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+		return true;
+
+	// recv() only returns 0 when the server closed the connection
+	if ((*outLength = recv(fSocket, buffer, maxLength, 0)) <= 0)
 		return false;
 	return true;
 }
@@ -495,13 +678,28 @@ uBarrierInputServerDevice::Trace(const char *text)
 	notify.SetGroup(group);
 	notify.SetContent(content);
 
+	// Decode the icon once, a flood of traces shouldn't reload the add-on
+	if (!fTraceIconLoaded) {
+		fTraceIconLoaded = true;
+		fTraceIcon = _LoadTraceIcon();
+	}
+	if (fTraceIcon != NULL)
+		notify.SetIcon(fTraceIcon);
+
+	notify.Send();
+}
+
+
+BBitmap*
+uBarrierInputServerDevice::_LoadTraceIcon() const
+{
 	image_info info;
 	if (our_image(info) != B_OK)
-		return;
+		return NULL;
 
 	BFile file(info.name, B_READ_ONLY);
 	if (file.InitCheck() < B_OK)
-		return;
+		return NULL;
 
 	BResources res(&file);
 	size_t size;
@@ -509,17 +707,15 @@ uBarrierInputServerDevice::Trace(const char *text)
 
 	if (!data) {
 		TRACE("Unable to load resource for notification!");
-		notify.Send();
-		return;
+		return NULL;
 	}
 
 	BBitmap* bitmap = new BBitmap(BRect(0, 0, 32, 32), B_RGBA32);
-	status_t status = BIconUtils::GetVectorIcon((uint8*)data, size, bitmap);
-	if (status == B_OK)
-		notify.SetIcon(bitmap);
-
-	notify.Send();
-	delete bitmap;
+	if (BIconUtils::GetVectorIcon((uint8*)data, size, bitmap) != B_OK) {
+		delete bitmap;
+		return NULL;
+	}
+	return bitmap;
 }
 
 
@@ -529,6 +725,16 @@ uBarrierInputServerDevice::ScreenActive(bool active)
 }
 
 
+// The time the server's data arrived, so queuing inside the client doesn't
+// shift the "when" of the events it carried
+bigtime_t
+uBarrierInputServerDevice::_EventTime() const
+{
+	uint64_t when = uBarrierGetEventTime(fContext);
+	return when != 0 ? (bigtime_t)(when / 1000) : system_time();
+}
+
+
 BMessage*
 uBarrierInputServerDevice::_BuildMouseMessage(uint32 what, uint64 when,
 	uint32 buttons, float x, float y) const
@@ -562,7 +768,7 @@ uBarrierInputServerDevice::MouseCallback(uint16_t x, uint16_t y, int16_t wheelX,
 	float				 xVal = (float)x / (float)fContext->m_clientWidth;
 	float				 yVal = (float)y / (float)fContext->m_clientHeight;
 
-	int64 timestamp = system_time();
+	int64 timestamp = _EventTime();
 
 	if (buttonLeft == UBARRIER_TRUE) {
 		buttons |= 1 << 0;
@@ -621,15 +827,41 @@ uBarrierInputServerDevice::MouseCallback(uint16_t x, uint16_t y, int16_t wheelX,
 }
 
 
+void
+uBarrierInputServerDevice::MouseRelativeCallback(int32_t dx, int32_t dy)
+{
+	uint32 buttons = 0;
+	if (fContext->m_mouseButtonLeft == UBARRIER_TRUE)
+		buttons |= 1 << 0;
+	if (fContext->m_mouseButtonRight == UBARRIER_TRUE)
+		buttons |= 1 << 1;
+	if (fContext->m_mouseButtonMiddle == UBARRIER_TRUE)
+		buttons |= 1 << 2;
+
+	// Integer deltas are taken as relative by the input_server, which counts
+	// y upwards like a mouse driver does
+	BMessage* message = new BMessage(B_MOUSE_MOVED);
+	if (message == NULL)
+		return;
+	if (message->AddInt64("when", _EventTime()) < B_OK
+		|| message->AddInt32("buttons", buttons) < B_OK
+		|| message->AddInt32("x", dx) < B_OK
+		|| message->AddInt32("y", -dy) < B_OK) {
+		delete message;
+		return;
+	}
+	EnqueueMessage(message);
+}
+
+
 void
 uBarrierInputServerDevice::KeyboardCallback(uint16_t scancode,
-	uint16_t _modifiers, bool isKeyDown, bool isKeyRepeat)
+	uint16_t _modifiers, bool isKeyDown, uint16_t repeat)
 {
 	static uint32 lastScanCode = 0;
-	static uint32 repeatCount = 1;
 	static uint8 states[16];
 
-	int64 timestamp = system_time();
+	int64 timestamp = _EventTime();
 
 	uint32_t keycode = 0;
 
@@ -693,7 +925,7 @@ uBarrierInputServerDevice::KeyboardCallback(uint16_t scancode,
 
 	//bool isLock
 	//	= (modifiers & (B_CAPS_LOCK | B_NUM_LOCK | B_SCROLL_LOCK)) != 0;
-	if (!isKeyRepeat) {
+	if (repeat == 0) {
 		if (fModifiers != modifiers) {
 			BMessage* message = new BMessage(B_MODIFIERS_CHANGED);
 			if (message == NULL)
@@ -759,11 +991,12 @@ uBarrierInputServerDevice::KeyboardCallback(uint16_t scancode,
 		} else
 			delete[] string;
 
-		if (isKeyDown && isKeyRepeat) {
-			repeatCount++;
-			msg->AddInt32("be:key_repeat", repeatCount);
+		// Several repeats that came due at once go out as one message
+		if (isKeyDown && repeat != 0) {
+			fKeyRepeatCount += repeat;
+			msg->AddInt32("be:key_repeat", fKeyRepeatCount);
 		} else
-			repeatCount = 1;
+			fKeyRepeatCount = 1;
 	} else
 		delete[] string;
 
@@ -809,6 +1042,55 @@ uBarrierInputServerDevice::ClipboardCallback(enum uBarrierClipboardFormat format
 }
 
 
+void
+uBarrierInputServerDevice::ClipboardChunkCallback(
+	enum uBarrierClipboardChunk chunk, enum uBarrierClipboardFormat format,
+	const uint8_t* data, uint32_t size, uint32_t totalSize)
+{
+	if (format != UBARRIER_CLIPBOARD_FORMAT_TEXT)
+		return;
+
+	switch (chunk) {
+		case UBARRIER_CLIPBOARD_CHUNK_BEGIN:
+			fClipboardData.SetSize(totalSize);
+			fClipboardData.Seek(0, SEEK_SET);
+			break;
+		case UBARRIER_CLIPBOARD_CHUNK_DATA:
+			fClipboardData.Write(data, size);
+			break;
+		case UBARRIER_CLIPBOARD_CHUNK_END:
+			ClipboardCallback(format, (const uint8_t*)fClipboardData.Buffer(),
+				fClipboardData.Position());
+			fClipboardData.SetSize(0);
+			break;
+		case UBARRIER_CLIPBOARD_CHUNK_ABORT:
+			TRACE("barrier: clipboard transfer aborted\n");
+			fClipboardData.SetSize(0);
+			break;
+	}
+}
+
+
+void
+uBarrierInputServerDevice::ClipboardSent(void* userData, bool sent)
+{
+	if (sent)
+		TRACE("barrier: data added to clipboard\n");
+	else
+		TRACE("barrier: couldn't add data to clipboard\n");
+	free(userData);
+}
+
+
+void
+uBarrierInputServerDevice::_WakeInputThread()
+{
+	// A full pipe already wakes the thread
+	if (fWakePipe[1] >= 0)
+		write(fWakePipe[1], "", 1);
+}
+
+
 extern "C" BInputServerDevice*
 instantiate_input_device()
 {
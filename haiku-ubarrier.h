@@ -22,9 +22,12 @@
 #ifndef UBARRIER_H
 #define UBARRIER_H
 
+#include <Bitmap.h>
+#include <DataIO.h>
 #include <InputServerDevice.h>
 #include <InterfaceDefs.h>
 #include <Locker.h>
+#include <MessageRunner.h>
 
 #include <ObjectList.h>
 
@@ -53,6 +56,8 @@ class uBarrierInputServerDevice : public BHandler, public BInputServerDevice {
 	// Barrier Hooks
 		bool				Connect();
 		bool				Send(const uint8_t* buffer, int32_t length);
+		bool				SendVector(const uBarrierIOVec* vectors,
+								int count);
 		bool				Receive(uint8_t* buffer, int maxLength,
 								int* outLength);
 		void				Trace(const char* text);
@@ -62,25 +67,36 @@ class uBarrierInputServerDevice : public BHandler, public BInputServerDevice {
 								uBarrierBool buttonLeft,
 								uBarrierBool buttonRight,
 								uBarrierBool buttonMiddle);
+		void				MouseRelativeCallback(int32_t dx, int32_t dy);
 		void				KeyboardCallback(uint16_t key, uint16_t modifiers,
-								bool isKeyDown, bool isKeyRepeat);
+								bool isKeyDown, uint16_t repeat);
 		void				JoystickCallback(uint8_t joyNum, uint16_t buttons,
 								int8_t leftStickX, int8_t leftStickY,
 								int8_t rightStickX, int8_t rightStickY);
 		void				ClipboardCallback(enum uBarrierClipboardFormat format,
 								const uint8_t* data, uint32_t size);
+		void				ClipboardChunkCallback(
+								enum uBarrierClipboardChunk chunk,
+								enum uBarrierClipboardFormat format,
+								const uint8_t* data, uint32_t size,
+								uint32_t totalSize);
+		void				ClipboardSent(void* userData, bool sent);
 
 	private:
 
 		BMessage*		_BuildMouseMessage(uint32 what, uint64 when,
 							uint32 buttons, float x, float y) const;
+		bigtime_t		_EventTime() const;
 		void			_UpdateSettings();
+		BBitmap*		_LoadTraceIcon() const;
+		void			_WakeInputThread();
 	static status_t		_MainLoop(void* arg);
 
 		bool				threadActive;
 		thread_id			uBarrierThread;
 		uBarrierContext*	fContext;
 		int					fSocket;
+		int					fWakePipe[2];
 
 		uint32				fModifiers;
 		uint32				fCommandKey;
@@ -91,11 +107,18 @@ class uBarrierInputServerDevice : public BHandler, public BInputServerDevice {
 		BString				fServerAddress;
 		BString				fClientName;
 		bool				fEnableClipboard;
+		BMallocIO			fClipboardData;
 
 	volatile bool			fUpdateSettings;
 
 		Keymap				fKeymap;
 		BLocker				fKeymapLock;
+
+		BMessageRunner*		fTraceRunner;
+		BBitmap*			fTraceIcon;
+		bool				fTraceIconLoaded;
+
+		uint32				fKeyRepeatCount;
 };
 
 
@@ -0,0 +1,339 @@
+/*
+uBarrier epoll client -- Linux sample client driving uBarrier from an epoll loop
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+
+Build and run from the repository root:
+
+	cc -O2 -I. -o epoll-client linux/epoll-client.c uBarrier.c
+	./epoll-client <server> [port] [name] [width] [height]
+
+The client connects to a Barrier server (SSL disabled) and prints the input it receives. The socket is
+non-blocking and uBarrier never sleeps: the loop waits in epoll_wait for either data or the deadline
+reported by uBarrierNextTimeout, then calls uBarrierPoll.
+*/
+#include "uBarrier.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Transport
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Client state
+**/
+typedef struct
+{
+	const char*		m_server;			/* Server host name or address */
+	const char*		m_port;				/* Server port */
+	int				m_socket;			/* Connected socket, or -1 */
+} sClient;
+
+
+
+static uBarrierBool sConnect(uBarrierCookie cookie)
+{
+	sClient *client = (sClient*)cookie;
+	struct addrinfo hints, *result, *info;
+	int one = 1;
+
+	/* Drop the old connection, if any */
+	if (client->m_socket >= 0)
+	{
+		close(client->m_socket);
+		client->m_socket = -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family		= AF_UNSPEC;
+	hints.ai_socktype	= SOCK_STREAM;
+	if (getaddrinfo(client->m_server, client->m_port, &hints, &result) != 0)
+		return UBARRIER_FALSE;
+	for (info = result; info != 0L; info = info->ai_next)
+	{
+		int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, info->ai_addr, info->ai_addrlen) == 0)
+		{
+			client->m_socket = fd;
+			break;
+		}
+		close(fd);
+	}
+	freeaddrinfo(result);
+	if (client->m_socket < 0)
+		return UBARRIER_FALSE;
+
+	/* Small packets should go out right away, receiving must never block */
+	setsockopt(client->m_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(client->m_socket, F_SETFL, fcntl(client->m_socket, F_GETFL) | O_NONBLOCK);
+	printf("connected to %s:%s\n", client->m_server, client->m_port);
+	return UBARRIER_TRUE;
+}
+
+
+
+/**
+@brief Wait until the socket accepts more data
+
+Sends are rare and small, so they simply wait for the socket instead of queuing.
+**/
+static uBarrierBool sWaitWritable(sClient *client)
+{
+	struct pollfd fd;
+	fd.fd		= client->m_socket;
+	fd.events	= POLLOUT;
+	return poll(&fd, 1, -1) == 1 && (fd.revents & POLLOUT) ? UBARRIER_TRUE : UBARRIER_FALSE;
+}
+
+
+
+static uBarrierBool sSendVector(uBarrierCookie cookie, const uBarrierIOVec *vectors, int count)
+{
+	sClient *client = (sClient*)cookie;
+	struct iovec iov[UBARRIER_MAX_SEND_VECTORS];
+	int first = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		iov[i].iov_base	= (void*)vectors[i].m_data;
+		iov[i].iov_len	= vectors[i].m_size;
+	}
+	while (first < count)
+	{
+		ssize_t sent = writev(client->m_socket, iov + first, count - first);
+		if (sent < 0)
+		{
+			if ((errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || !sWaitWritable(client))
+				return UBARRIER_FALSE;
+			continue;
+		}
+
+		/* Skip what was written, continue with the rest */
+		while (first < count && (size_t)sent >= iov[first].iov_len)
+			sent -= iov[first++].iov_len;
+		if (first < count)
+		{
+			iov[first].iov_base	= (uint8_t*)iov[first].iov_base + sent;
+			iov[first].iov_len	-= sent;
+		}
+	}
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sSend(uBarrierCookie cookie, const uint8_t *buffer, int length)
+{
+	uBarrierIOVec vector;
+	vector.m_data	= buffer;
+	vector.m_size	= (uint32_t)length;
+	return sSendVector(cookie, &vector, 1);
+}
+
+
+
+static uBarrierBool sReceive(uBarrierCookie cookie, uint8_t *buffer, int maxLength, int *outLength)
+{
+	sClient *client = (sClient*)cookie;
+	ssize_t received = recv(client->m_socket, buffer, maxLength, 0);
+	*outLength = 0;
+	if (received > 0)
+		*outLength = (int)received;
+	else if (received == 0)
+		return UBARRIER_FALSE;
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		return UBARRIER_FALSE;
+	return UBARRIER_TRUE;
+}
+
+
+
+static int sGetFd(uBarrierCookie cookie)
+{
+	return ((sClient*)cookie)->m_socket;
+}
+
+
+
+static void sSleep(uBarrierCookie cookie, int timeMs)
+{
+	/* Never called by uBarrierPoll */
+	(void)cookie; (void)timeMs;
+}
+
+
+
+static uint32_t sGetTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Callbacks
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+static void sTrace(uBarrierCookie cookie, const char *text)
+{
+	(void)cookie;
+	printf("trace: %s\n", text);
+}
+
+
+
+static void sScreenActiveCallback(uBarrierCookie cookie, uBarrierBool active)
+{
+	(void)cookie;
+	printf("screen %s\n", active ? "entered" : "left");
+}
+
+
+
+static void sMouseCallback(uBarrierCookie cookie, uint16_t x, uint16_t y, int16_t wheelX, int16_t wheelY, uBarrierBool buttonLeft, uBarrierBool buttonRight, uBarrierBool buttonMiddle)
+{
+	(void)cookie;
+	printf("mouse %u,%u wheel %d,%d buttons %d%d%d\n", x, y, wheelX, wheelY, buttonLeft, buttonMiddle, buttonRight);
+}
+
+
+
+static void sKeyboardCallback(uBarrierCookie cookie, uint16_t key, uint16_t modifiers, uBarrierBool down, uint16_t repeat)
+{
+	(void)cookie;
+	if (repeat != 0)
+		printf("key %u modifiers 0x%04x repeat x%u\n", key, modifiers, repeat);
+	else
+		printf("key %u modifiers 0x%04x %s\n", key, modifiers, down ? "down" : "up");
+}
+
+
+
+static void sClipboardCallback(uBarrierCookie cookie, enum uBarrierClipboardFormat format, const uint8_t *data, uint32_t size)
+{
+	(void)cookie; (void)data;
+	printf("clipboard format %d, %u bytes\n", (int)format, size);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Event loop
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+int main(int argc, char **argv)
+{
+	static uBarrierContext context;
+	sClient client;
+	int epoll_fd, registered_fd = -1;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <server> [port] [name] [width] [height]\n", argv[0]);
+		return 1;
+	}
+	client.m_server	= argv[1];
+	client.m_port	= argc > 2 ? argv[2] : "24800";
+	client.m_socket	= -1;
+
+	uBarrierInit(&context);
+	context.m_connectFunc			= sConnect;
+	context.m_sendFunc				= sSend;
+	context.m_sendVectorFunc		= sSendVector;
+	context.m_receiveFunc			= sReceive;
+	context.m_getFdFunc				= sGetFd;
+	context.m_sleepFunc				= sSleep;
+	context.m_getTimeFunc			= sGetTime;
+	context.m_clientName			= argc > 3 ? argv[3] : "linux";
+	context.m_clientWidth			= (uint16_t)(argc > 4 ? atoi(argv[4]) : 1920);
+	context.m_clientHeight			= (uint16_t)(argc > 5 ? atoi(argv[5]) : 1080);
+	context.m_cookie				= (uBarrierCookie)&client;
+	context.m_traceFunc				= sTrace;
+	context.m_screenActiveCallback	= sScreenActiveCallback;
+	context.m_mouseCallback			= sMouseCallback;
+	context.m_keyboardCallback		= sKeyboardCallback;
+	context.m_clipboardCallback		= sClipboardCallback;
+	context.m_batchReplies			= UBARRIER_TRUE;
+	context.m_localKeyRepeat		= UBARRIER_TRUE;
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0)
+	{
+		perror("epoll_create1");
+		return 1;
+	}
+
+	for (;;)
+	{
+		struct epoll_event event;
+		int fd;
+
+		/* The descriptor changes on every reconnect; a closed descriptor leaves the epoll set by itself */
+		fd = uBarrierGetFd(&context);
+		if (fd != registered_fd)
+		{
+			if (registered_fd >= 0)
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, registered_fd, 0L);
+			if (fd >= 0)
+			{
+				memset(&event, 0, sizeof(event));
+				event.events	= EPOLLIN;
+				event.data.fd	= fd;
+				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+			}
+			registered_fd = fd;
+		}
+
+		/* Sleep until data arrives or a uBarrier timer expires */
+		if (epoll_wait(epoll_fd, &event, 1, uBarrierNextTimeout(&context)) < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			return 1;
+		}
+		uBarrierPoll(&context);
+	}
+}
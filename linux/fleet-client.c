@@ -0,0 +1,306 @@
+/*
+uBarrier fleet client -- Linux sample running many uBarrier clients on one thread
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+
+Build and run from the repository root:
+
+	cc -O2 -I. -DUBARRIER_DEFAULT_STORAGE=0 -o fleet-client linux/fleet-client.c uBarrierMux.c uBarrier.c
+	./fleet-client <server> [port] [count] [name prefix]
+
+Connects <count> clients (16 by default) named <prefix>-1 ... <prefix>-<count> to a Barrier server (SSL
+disabled), each one a separate screen, all serviced by one uBarrierMux on the main thread. Once a second
+it prints how many are connected and what they received. Connecting blocks, which is fine for a server on
+the local network.
+
+The clients don't take clipboards, so they get small buffers from an arena in their client state instead of
+the default ones; building with UBARRIER_DEFAULT_STORAGE=0 leaves those out of every context.
+*/
+#include "uBarrierMux.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Transport
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Buffer sizes, large enough for every packet but clipboards
+**/
+#define FLEET_RECEIVE_BUFFER_SIZE	512
+#define FLEET_REPLY_BUFFER_SIZE		256
+
+
+
+/**
+@brief Client state
+**/
+typedef struct
+{
+	uBarrierContext	m_context;			/* Barrier client */
+	const char*		m_server;			/* Server host name or address */
+	const char*		m_port;				/* Server port */
+	int				m_socket;			/* Connected socket, or -1 */
+	char			m_name[64];			/* Screen name */
+	uint64_t		m_numEvents;		/* Input callbacks so far */
+	uint8_t			m_arena[UBARRIER_ARENA_SIZE(FLEET_RECEIVE_BUFFER_SIZE, FLEET_REPLY_BUFFER_SIZE)];	/* Receive and reply buffers */
+} sClient;
+
+
+
+static uBarrierBool sConnect(uBarrierCookie cookie)
+{
+	sClient *client = (sClient*)cookie;
+	struct addrinfo hints, *result, *info;
+	int one = 1;
+
+	if (client->m_socket >= 0)
+	{
+		close(client->m_socket);
+		client->m_socket = -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family		= AF_UNSPEC;
+	hints.ai_socktype	= SOCK_STREAM;
+	if (getaddrinfo(client->m_server, client->m_port, &hints, &result) != 0)
+		return UBARRIER_FALSE;
+	for (info = result; info != 0L; info = info->ai_next)
+	{
+		int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, info->ai_addr, info->ai_addrlen) == 0)
+		{
+			client->m_socket = fd;
+			break;
+		}
+		close(fd);
+	}
+	freeaddrinfo(result);
+	if (client->m_socket < 0)
+		return UBARRIER_FALSE;
+
+	setsockopt(client->m_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(client->m_socket, F_SETFL, fcntl(client->m_socket, F_GETFL) | O_NONBLOCK);
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sSend(uBarrierCookie cookie, const uint8_t *buffer, int length)
+{
+	sClient *client = (sClient*)cookie;
+	while (length > 0)
+	{
+		ssize_t sent = send(client->m_socket, buffer, (size_t)length, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			/* Replies are tiny, waiting for room is rare */
+			struct pollfd fd;
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return UBARRIER_FALSE;
+			fd.fd		= client->m_socket;
+			fd.events	= POLLOUT;
+			poll(&fd, 1, -1);
+			continue;
+		}
+		buffer += sent;
+		length -= (int)sent;
+	}
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sReceive(uBarrierCookie cookie, uint8_t *buffer, int maxLength, int *outLength)
+{
+	sClient *client = (sClient*)cookie;
+	ssize_t received = recv(client->m_socket, buffer, maxLength, 0);
+	*outLength = 0;
+	if (received > 0)
+		*outLength = (int)received;
+	else if (received == 0)
+		return UBARRIER_FALSE;
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		return UBARRIER_FALSE;
+	return UBARRIER_TRUE;
+}
+
+
+
+static int sGetFd(uBarrierCookie cookie)
+{
+	return ((sClient*)cookie)->m_socket;
+}
+
+
+
+static void sSleep(uBarrierCookie cookie, int timeMs)
+{
+	/* Never called by uBarrierPoll */
+	(void)cookie; (void)timeMs;
+}
+
+
+
+static uint32_t sGetTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Callbacks
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+static void sTrace(uBarrierCookie cookie, const char *text)
+{
+	printf("%s: %s\n", ((sClient*)cookie)->m_name, text);
+}
+
+
+
+static void sMouseCallback(uBarrierCookie cookie, uint16_t x, uint16_t y, int16_t wheelX, int16_t wheelY, uBarrierBool buttonLeft, uBarrierBool buttonRight, uBarrierBool buttonMiddle)
+{
+	(void)x; (void)y; (void)wheelX; (void)wheelY; (void)buttonLeft; (void)buttonRight; (void)buttonMiddle;
+	((sClient*)cookie)->m_numEvents++;
+}
+
+
+
+static void sKeyboardCallback(uBarrierCookie cookie, uint16_t key, uint16_t modifiers, uBarrierBool down, uint16_t repeat)
+{
+	(void)key; (void)modifiers; (void)down; (void)repeat;
+	((sClient*)cookie)->m_numEvents++;
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Event loop
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+int main(int argc, char **argv)
+{
+	uBarrierMux mux;
+	uBarrierMuxSlot *slots;
+	struct pollfd *poll_fds;
+	sClient *clients;
+	uint32_t next_report;
+	int count, i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <server> [port] [count] [name prefix]\n", argv[0]);
+		return 1;
+	}
+	count		= argc > 3 ? atoi(argv[3]) : 16;
+	clients		= (sClient*)calloc((size_t)count, sizeof(sClient));
+	slots		= (uBarrierMuxSlot*)calloc((size_t)count, sizeof(uBarrierMuxSlot));
+	poll_fds	= (struct pollfd*)calloc((size_t)count, sizeof(struct pollfd));
+	if (count <= 0 || clients == 0L || slots == 0L || poll_fds == 0L)
+	{
+		fprintf(stderr, "can't run %d clients\n", count);
+		return 1;
+	}
+
+	uBarrierMuxInit(&mux, slots, poll_fds, count, sGetTime);
+	for (i = 0; i < count; i++)
+	{
+		sClient *client = &clients[i];
+		uBarrierContext *context = &client->m_context;
+		client->m_server	= argv[1];
+		client->m_port		= argc > 2 ? argv[2] : "24800";
+		client->m_socket	= -1;
+		snprintf(client->m_name, sizeof(client->m_name), "%s-%d", argc > 4 ? argv[4] : "fleet", i+1);
+
+		uBarrierInitArena(context, client->m_arena, sizeof(client->m_arena), FLEET_RECEIVE_BUFFER_SIZE, FLEET_REPLY_BUFFER_SIZE);
+		context->m_connectFunc			= sConnect;
+		context->m_sendFunc				= sSend;
+		context->m_receiveFunc			= sReceive;
+		context->m_getFdFunc			= sGetFd;
+		context->m_sleepFunc			= sSleep;
+		context->m_getTimeFunc			= sGetTime;
+		context->m_clientName			= client->m_name;
+		context->m_clientWidth			= 1920;
+		context->m_clientHeight			= 1080;
+		context->m_cookie				= (uBarrierCookie)client;
+		context->m_traceFunc			= sTrace;
+		context->m_mouseCallback		= sMouseCallback;
+		context->m_keyboardCallback		= sKeyboardCallback;
+		context->m_batchReplies			= UBARRIER_TRUE;
+		context->m_coalesceMouseMoves	= UBARRIER_TRUE;
+		uBarrierMuxAdd(&mux, context);
+	}
+
+	next_report = sGetTime() + 1000;
+	for (;;)
+	{
+		int32_t left = (int32_t)(next_report - sGetTime());
+		if (uBarrierMuxRun(&mux, left > 0 ? (int)left : 0) < 0)
+		{
+			perror("poll");
+			return 1;
+		}
+
+		/* Summary of the whole fleet */
+		if ((int32_t)(next_report - sGetTime()) <= 0)
+		{
+			uint64_t packets = 0, events = 0, disconnects = 0;
+			int connected = 0;
+			for (i = 0; i < count; i++)
+			{
+				uBarrierStats stats;
+				int type;
+				uBarrierGetStats(&clients[i].m_context, &stats);
+				for (type = 0; type < UBARRIER_NUM_MESSAGE_TYPES; type++)
+					packets += stats.m_numPackets[type];
+				disconnects += stats.m_numDisconnects;
+				events += clients[i].m_numEvents;
+				connected += clients[i].m_context.m_hasReceivedHello ? 1 : 0;
+			}
+			printf("%d of %d connected, %llu packets, %llu input events, %llu disconnects\n", connected, count,
+				(unsigned long long)packets, (unsigned long long)events, (unsigned long long)disconnects);
+			next_report += 1000;
+		}
+	}
+}
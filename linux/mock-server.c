@@ -0,0 +1,1123 @@
+/*
+uBarrier mock server -- Scriptable loopback Barrier server for end-to-end latency and throughput tests
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+
+Build and run from the repository root:
+
+	cc -O2 -I. -pthread -o mock-server linux/mock-server.c uBarrier.c
+	./mock-server [-p port] [-c] [-b] [-e] [-u] [script]
+
+The server listens on 127.0.0.1 (port 24800 by default) and runs a script against the first client that
+connects. The script is a file with one command per line, or '-' for stdin; without a script a built-in
+scenario runs. With -c the server starts an in-process uBarrier client, which also lets it measure the
+time until the client callback fires. -b makes that client batch its replies. -e makes it write events to an
+event ring instead of calling callbacks, a second thread takes them out and counts as the callback. -u drives
+the client with uBarrierUpdate and a receive that blocks until data arrives or a uBarrier timer expires, the
+way the Haiku add-on does, instead of uBarrierPoll.
+
+Commands, '#' starts a comment:
+
+	accept					Wait for a client to connect, reports the time since the last disconnect
+	hello					Handshake, sends Hello and waits for the reply
+	qinf					Query screen info, waits for DINF and acknowledges it with CIAK
+	enter / leave			Send CINN / COUT
+	move <count> <rate>		Send mouse moves at <rate> per second, 0 for as fast as possible
+	keys <count> <rate>		Send key downs at <rate> per second
+	clipboard <size>		Send a text clipboard of <size> bytes, chunked if the client speaks 1.6
+	keepalive <count> <ms>	Send keep alives every <ms> milliseconds, with -c reports the client's link estimates
+	heartbeat <ms>			Set the heartbeat option (DSOP HART), the client times out after three missed ones
+	busy					Send EBSY and close the connection, like a server that has a client of that name
+	stall <ms>				Send nothing for <ms> milliseconds, reports if the client disconnects
+	idle <ms> <max us>		Stall for <ms> milliseconds, then send a mouse move; the server exits with status 1
+							unless its CNOP, and with -c its callback, is back within <max us> microseconds
+	disconnect				Close the connection
+
+Each burst reports the round trip from sending a message until its CNOP comes back and, with -c, the time
+until the client callback fired: minimum, median, 99th percentile and maximum in microseconds. The client
+receives with SO_TIMESTAMPNS, so -c also splits that time into the time until the kernel had the message
+(arrival) and the time from there until the callback (in client). At the end the client prints its own
+per-stage latency histograms.
+*/
+#include "uBarrier.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Helpers
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+#define MAX_TRACKED		(1 << 20)		/* Messages per burst that are timed */
+#define MAX_IN_FLIGHT	4096			/* Messages sent without their CNOP back before the server waits */
+#define REPLY_TIMEOUT	2000			/* Milliseconds to wait for replies at the end of a burst */
+#define EVENT_RING_SIZE	4096			/* Events the in-process client queues with -e, a power of two */
+#define EVENT_BATCH		256				/* Events the consuming thread takes at once */
+
+
+
+static uint64_t sMicroseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+
+
+static uint64_t sNanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+
+static uint32_t sMilliseconds()
+{
+	return (uint32_t)(sMicroseconds() / 1000);
+}
+
+
+
+static int sCompare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+
+
+/**
+@brief Print min, median, 99th percentile and max of @a count samples, sorts @a samples
+**/
+static void sPrintLatency(const char *what, uint64_t *samples, uint32_t count)
+{
+	if (count == 0)
+	{
+		printf("  %-9s no samples\n", what);
+		return;
+	}
+	qsort(samples, count, sizeof(uint64_t), sCompare);
+	printf("  %-9s %7u samples  min %6llu  p50 %6llu  p99 %6llu  max %6llu us\n", what, count,
+		(unsigned long long)samples[0], (unsigned long long)samples[count/2],
+		(unsigned long long)samples[(uint64_t)count*99/100], (unsigned long long)samples[count-1]);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	In-process client
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief In-process client, driven by uBarrierPoll on its own thread
+**/
+typedef struct
+{
+	uBarrierContext		m_context;					/* uBarrier context */
+	int					m_port;						/* Server port */
+	int					m_socket;					/* Connection to the server, or -1 */
+	volatile int		m_quit;						/* Set to stop the thread */
+	uint64_t*			m_callbackTimes;			/* Callback time per message tag, 0 if not called yet */
+	uint64_t*			m_arrivalTimes;				/* Arrival time per message tag, from uBarrierGetEventTime */
+	uint64_t			m_clipboardEndTime;			/* Time the last clipboard format completed */
+	uBarrierEvent*		m_events;					/* Event ring with -e, or 0L */
+	sem_t				m_eventsReady;				/* Posted when events were queued */
+} sClient;
+
+
+
+static uBarrierBool sClientConnect(uBarrierCookie cookie)
+{
+	sClient *client = (sClient*)cookie;
+	struct sockaddr_in addr;
+	int one = 1;
+
+	if (client->m_socket >= 0)
+		close(client->m_socket);
+	client->m_socket = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family			= AF_INET;
+	addr.sin_port			= htons((uint16_t)client->m_port);
+	addr.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	if (connect(client->m_socket, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(client->m_socket);
+		client->m_socket = -1;
+		return UBARRIER_FALSE;
+	}
+	setsockopt(client->m_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(client->m_socket, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sClientSend(uBarrierCookie cookie, const uint8_t *buffer, int length)
+{
+	sClient *client = (sClient*)cookie;
+	while (length > 0)
+	{
+		ssize_t sent = send(client->m_socket, buffer, length, MSG_NOSIGNAL);
+		if (sent <= 0)
+			return UBARRIER_FALSE;
+		buffer += sent;
+		length -= (int)sent;
+	}
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sClientReceive(uBarrierCookie cookie, uint8_t *buffer, int maxLength, int *outLength, uint64_t *outTimeNs)
+{
+	sClient *client = (sClient*)cookie;
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct iovec vector;
+	struct msghdr header;
+	struct cmsghdr *message;
+	ssize_t received;
+
+	vector.iov_base			= buffer;
+	vector.iov_len			= (size_t)maxLength;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov			= &vector;
+	header.msg_iovlen		= 1;
+	header.msg_control		= control;
+	header.msg_controllen	= sizeof(control);
+	received = recvmsg(client->m_socket, &header, MSG_DONTWAIT);
+	*outLength = 0;
+	if (received > 0)
+		*outLength = (int)received;
+	else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		return UBARRIER_FALSE;
+
+	/* The kernel stamps with CLOCK_REALTIME, move that to the monotonic clock uBarrier times with */
+	for (message = CMSG_FIRSTHDR(&header); message != 0L; message = CMSG_NXTHDR(&header, message))
+	{
+		if (message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec arrival, now;
+			int64_t age;
+			memcpy(&arrival, CMSG_DATA(message), sizeof(arrival));
+			clock_gettime(CLOCK_REALTIME, &now);
+			age = (int64_t)(now.tv_sec - arrival.tv_sec) * 1000000000 + (now.tv_nsec - arrival.tv_nsec);
+			*outTimeNs = sNanoseconds() - (uint64_t)(age > 0 ? age : 0);
+		}
+	}
+	return UBARRIER_TRUE;
+}
+
+
+
+/**
+@brief Receive for -u, blocks until data arrives or the next uBarrier timer expires like the Haiku add-on
+**/
+static uBarrierBool sClientReceiveBlocking(uBarrierCookie cookie, uint8_t *buffer, int maxLength, int *outLength, uint64_t *outTimeNs)
+{
+	sClient *client = (sClient*)cookie;
+	int timeout = uBarrierNextTimeout(&client->m_context);
+	uint32_t start = sMilliseconds();
+	struct pollfd fd;
+	fd.fd		= client->m_socket;
+	fd.events	= POLLIN;
+
+	/* Wait in slices to notice m_quit, but only return early for data */
+	while (!client->m_quit)
+	{
+		int left = timeout < 0 ? 100 : timeout - (int)(sMilliseconds() - start);
+		if (left <= 0 || poll(&fd, 1, left < 100 ? left : 100) > 0)
+			break;
+	}
+	return sClientReceive(cookie, buffer, maxLength, outLength, outTimeNs);
+}
+
+
+
+static int sClientGetFd(uBarrierCookie cookie)
+{
+	return ((sClient*)cookie)->m_socket;
+}
+
+
+
+static void sClientSleep(uBarrierCookie cookie, int timeMs)
+{
+	/* Sleep in slices to notice m_quit */
+	sClient *client = (sClient*)cookie;
+	while (timeMs > 0 && !client->m_quit)
+	{
+		usleep((timeMs < 10 ? timeMs : 10) * 1000);
+		timeMs -= 10;
+	}
+}
+
+
+
+static void sClientTrace(uBarrierCookie cookie, const char *text)
+{
+	(void)cookie;
+	printf("  client: %s\n", text);
+}
+
+
+
+/**
+@brief Record that the message tagged @a tag, which arrived at @a arrivalNs, reached the application
+**/
+static void sClientDelivered(sClient *client, uint32_t tag, uint64_t arrivalNs)
+{
+	if (tag < MAX_TRACKED)
+	{
+		client->m_arrivalTimes[tag] = arrivalNs / 1000;
+		__atomic_store_n(&client->m_callbackTimes[tag], sMicroseconds(), __ATOMIC_RELEASE);
+	}
+}
+
+
+
+static void sClientMouse(uBarrierCookie cookie, uint16_t x, uint16_t y, int16_t wheelX, int16_t wheelY, uBarrierBool buttonLeft, uBarrierBool buttonRight, uBarrierBool buttonMiddle)
+{
+	sClient *client = (sClient*)cookie;
+	(void)wheelX; (void)wheelY; (void)buttonLeft; (void)buttonRight; (void)buttonMiddle;
+	sClientDelivered(client, (uint32_t)y * 4096 + x, uBarrierGetEventTime(&client->m_context));
+}
+
+
+
+static void sClientKeyboard(uBarrierCookie cookie, uint16_t key, uint16_t modifiers, uBarrierBool down, uint16_t repeat)
+{
+	sClient *client = (sClient*)cookie;
+	(void)down; (void)repeat;
+	sClientDelivered(client, ((uint32_t)modifiers << 16) | key, uBarrierGetEventTime(&client->m_context));
+}
+
+
+
+static void sClientEventsReady(uBarrierCookie cookie)
+{
+	sClient *client = (sClient*)cookie;
+	sem_post(&client->m_eventsReady);
+}
+
+
+
+/**
+@brief Thread taking events out of the client's event ring with -e, in batches
+**/
+static void *sClientEventThread(void *arg)
+{
+	sClient *client = (sClient*)arg;
+	uBarrierEvent events[EVENT_BATCH];
+	while (!client->m_quit)
+	{
+		struct timespec until;
+		int count, i;
+
+		/* Wake up regularly to notice m_quit */
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += 100000000;
+		if (until.tv_nsec >= 1000000000)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		sem_timedwait(&client->m_eventsReady, &until);
+		while ((count = uBarrierDrainEvents(&client->m_context, events, EVENT_BATCH)) != 0)
+		{
+			for (i = 0; i < count; i++)
+			{
+				const uBarrierEvent *event = &events[i];
+				if (event->m_type == UBARRIER_EVENT_MOUSE_MOVE)
+					sClientDelivered(client, (uint32_t)event->m_data.m_move.m_y * 4096 + event->m_data.m_move.m_x, event->m_time);
+				else if (event->m_type == UBARRIER_EVENT_KEY)
+					sClientDelivered(client, ((uint32_t)event->m_data.m_key.m_modifiers << 16) | event->m_data.m_key.m_key, event->m_time);
+			}
+		}
+	}
+	return 0L;
+}
+
+
+
+static void sClientClipboardChunk(uBarrierCookie cookie, enum uBarrierClipboardChunk chunk, enum uBarrierClipboardFormat format, const uint8_t *data, uint32_t size, uint32_t totalSize)
+{
+	sClient *client = (sClient*)cookie;
+	(void)format; (void)data; (void)size; (void)totalSize;
+	if (chunk == UBARRIER_CLIPBOARD_CHUNK_END)
+		__atomic_store_n(&client->m_clipboardEndTime, sMicroseconds(), __ATOMIC_RELEASE);
+}
+
+
+
+static void *sClientThread(void *arg)
+{
+	sClient *client = (sClient*)arg;
+	while (!client->m_quit)
+	{
+		struct pollfd fd;
+		int timeout = uBarrierNextTimeout(&client->m_context);
+		fd.fd		= uBarrierGetFd(&client->m_context);
+		fd.events	= POLLIN;
+
+		/* Wake up regularly to notice m_quit */
+		if (timeout < 0 || timeout > 100)
+			timeout = 100;
+		poll(&fd, fd.fd >= 0 ? 1 : 0, timeout);
+		uBarrierPoll(&client->m_context);
+	}
+	if (client->m_socket >= 0)
+		close(client->m_socket);
+	return 0L;
+}
+
+
+
+/**
+@brief Client thread for -u, every update blocks in the receive function
+**/
+static void *sClientUpdateThread(void *arg)
+{
+	sClient *client = (sClient*)arg;
+	while (!client->m_quit)
+		uBarrierUpdate(&client->m_context);
+	if (client->m_socket >= 0)
+		close(client->m_socket);
+	return 0L;
+}
+
+
+
+static void sStartClient(sClient *client, int port, uBarrierBool batchReplies, uBarrierBool useEvents, int blocking, pthread_t *thread, pthread_t *eventThread)
+{
+	uBarrierContext *context = &client->m_context;
+	memset(client, 0, sizeof(*client));
+	client->m_port			= port;
+	client->m_socket		= -1;
+	client->m_callbackTimes	= (uint64_t*)calloc(MAX_TRACKED, sizeof(uint64_t));
+	client->m_arrivalTimes	= (uint64_t*)calloc(MAX_TRACKED, sizeof(uint64_t));
+
+	uBarrierInit(context);
+	context->m_connectFunc				= sClientConnect;
+	context->m_sendFunc					= sClientSend;
+	context->m_receiveTimedFunc			= blocking ? sClientReceiveBlocking : sClientReceive;
+	context->m_getFdFunc				= sClientGetFd;
+	context->m_sleepFunc				= sClientSleep;
+	context->m_getTimeFunc				= sMilliseconds;
+	context->m_getTimeNsFunc			= sNanoseconds;
+	context->m_traceFunc				= sClientTrace;
+	context->m_mouseCallback			= sClientMouse;
+	context->m_keyboardCallback			= sClientKeyboard;
+	context->m_clipboardChunkCallback	= sClientClipboardChunk;
+	context->m_clientName				= "mock-client";
+	context->m_clientWidth				= 4096;
+	context->m_clientHeight				= 4096;
+	context->m_cookie					= (uBarrierCookie)client;
+	context->m_batchReplies				= batchReplies;
+	if (useEvents)
+	{
+		client->m_events				= (uBarrierEvent*)calloc(EVENT_RING_SIZE, sizeof(uBarrierEvent));
+		context->m_eventRing			= client->m_events;
+		context->m_eventRingSize		= EVENT_RING_SIZE;
+		context->m_eventsReadyCallback	= sClientEventsReady;
+		sem_init(&client->m_eventsReady, 0, 0);
+		pthread_create(eventThread, 0L, sClientEventThread, client);
+	}
+	pthread_create(thread, 0L, blocking ? sClientUpdateThread : sClientThread, client);
+}
+
+
+
+
+/**
+@brief Print one of the client's link estimates in microseconds
+**/
+static void sPrintEstimate(const char *what, const uBarrierEstimate *estimate)
+{
+	if (estimate->m_count == 0)
+	{
+		printf("  %-9s no samples\n", what);
+		return;
+	}
+	printf("  %-9s %7llu samples  avg %6llu  dev %6llu  min %6llu  max %6llu us\n", what,
+		(unsigned long long)estimate->m_count, (unsigned long long)(estimate->m_average / 1000),
+		(unsigned long long)(estimate->m_deviation / 1000), (unsigned long long)(estimate->m_min / 1000),
+		(unsigned long long)(estimate->m_max / 1000));
+}
+
+
+
+/**
+@brief Print the link estimates of the client, as published by its last update
+**/
+static void sPrintLink(const sClient *client)
+{
+	uBarrierLinkStats link;
+	uBarrierGetLinkStats(&client->m_context, &link);
+	sPrintEstimate("interval", &link.m_keepAliveInterval);
+	sPrintEstimate("reply", &link.m_keepAliveReply);
+	sPrintEstimate("qinf rtt", &link.m_roundTrip);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Server connection
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Server state
+**/
+typedef struct
+{
+	int				m_listen;					/* Listening socket */
+	int				m_socket;					/* Client connection, or -1 */
+	uint64_t		m_disconnectTime;			/* Time the last connection went away */
+	uint16_t		m_protocolMinor;			/* Minor protocol version agreed with the client */
+	uint8_t			m_receive[65536];			/* Bytes received from the client */
+	uint32_t		m_receiveFill;				/* Bytes in m_receive */
+	uint8_t			m_send[65536];				/* Packet being built */
+	uint32_t		m_sendFill;					/* Bytes in m_send */
+	uint64_t*		m_sendTimes;				/* Send time per message sent in the current burst */
+	uint32_t		m_numSent;					/* Messages of the current burst sent */
+	uint32_t		m_numAcked;					/* Messages of the current burst whose CNOP came back */
+	uint64_t*		m_roundTrips;				/* Round trip per acknowledged message */
+	uint32_t		m_numTracked;				/* Sent messages that expect a CNOP */
+	int				m_gotReply;					/* Non-CNOP reply seen, see sWaitFor */
+	char			m_replyId[5];				/* ID of the last non-CNOP reply */
+	sClient*		m_client;					/* In-process client, or 0L */
+	int				m_failed;					/* A check in the script failed */
+} sServer;
+
+
+
+static void sClose(sServer *server, const char *why)
+{
+	if (server->m_socket < 0)
+		return;
+	close(server->m_socket);
+	server->m_socket			= -1;
+	server->m_receiveFill		= 0;
+	server->m_disconnectTime	= sMicroseconds();
+	printf("  connection closed (%s)\n", why);
+}
+
+
+
+static void sPut8(sServer *server, uint8_t value)
+{
+	server->m_send[server->m_sendFill++] = value;
+}
+
+
+
+static void sPut16(sServer *server, uint16_t value)
+{
+	sPut8(server, (uint8_t)(value >> 8));
+	sPut8(server, (uint8_t)value);
+}
+
+
+
+static void sPut32(sServer *server, uint32_t value)
+{
+	sPut16(server, (uint16_t)(value >> 16));
+	sPut16(server, (uint16_t)value);
+}
+
+
+
+static void sBegin(sServer *server, const char *id)
+{
+	server->m_sendFill = 4;
+	while (*id)
+		sPut8(server, (uint8_t)*id++);
+}
+
+
+
+/**
+@brief Send the packet built since sBegin, @a tracked if the client answers it with a CNOP
+**/
+static int sSendPacket(sServer *server, int tracked, const uint8_t *payload, uint32_t payloadSize)
+{
+	uint32_t length = server->m_sendFill - 4 + payloadSize;
+	struct
+	{
+		const void*	base;
+		size_t		size;
+	} parts[2];
+	int i;
+
+	if (server->m_socket < 0)
+		return 0;
+	server->m_send[0] = (uint8_t)(length >> 24);
+	server->m_send[1] = (uint8_t)(length >> 16);
+	server->m_send[2] = (uint8_t)(length >> 8);
+	server->m_send[3] = (uint8_t)length;
+	parts[0].base = server->m_send;
+	parts[0].size = server->m_sendFill;
+	parts[1].base = payload;
+	parts[1].size = payloadSize;
+
+	if (tracked && server->m_numSent < MAX_TRACKED)
+		server->m_sendTimes[server->m_numSent] = sMicroseconds();
+	for (i = 0; i < 2; i++)
+	{
+		const uint8_t *data = (const uint8_t*)parts[i].base;
+		size_t left = parts[i].size;
+		while (left > 0)
+		{
+			ssize_t sent = send(server->m_socket, data, left, MSG_NOSIGNAL);
+			if (sent <= 0)
+			{
+				sClose(server, "send failed");
+				return 0;
+			}
+			data += sent;
+			left -= (size_t)sent;
+		}
+	}
+	if (tracked)
+		server->m_numSent++;
+	return 1;
+}
+
+
+
+/**
+@brief Read and parse replies, waiting at most @a timeoutMs for data
+**/
+static void sReceiveReplies(sServer *server, int timeoutMs)
+{
+	struct pollfd fd;
+	ssize_t received;
+	uint32_t ofs = 0;
+
+	if (server->m_socket < 0)
+		return;
+	fd.fd		= server->m_socket;
+	fd.events	= POLLIN;
+	if (poll(&fd, 1, timeoutMs) <= 0)
+		return;
+	received = recv(server->m_socket, server->m_receive + server->m_receiveFill, sizeof(server->m_receive) - server->m_receiveFill, 0);
+	if (received <= 0)
+	{
+		sClose(server, received == 0 ? "client disconnected" : "receive failed");
+		return;
+	}
+	server->m_receiveFill += (uint32_t)received;
+
+	while (server->m_receiveFill - ofs >= 8)
+	{
+		const uint8_t *packet = server->m_receive + ofs;
+		uint32_t length = ((uint32_t)packet[0] << 24) | ((uint32_t)packet[1] << 16) | ((uint32_t)packet[2] << 8) | packet[3];
+		if (length + 4 > sizeof(server->m_receive))
+		{
+			sClose(server, "oversized reply");
+			return;
+		}
+		if (server->m_receiveFill - ofs < length + 4)
+			break;
+		if (memcmp(packet+4, "CNOP", 4) == 0)
+		{
+			/* Replies come back in order, so the oldest unacknowledged message is the one answered */
+			uint64_t now = sMicroseconds();
+			if (server->m_numAcked < server->m_numSent && server->m_numAcked < MAX_TRACKED)
+				server->m_roundTrips[server->m_numAcked] = now - server->m_sendTimes[server->m_numAcked];
+			server->m_numAcked++;
+		}
+		else
+		{
+			memcpy(server->m_replyId, packet+4, 4);
+			server->m_replyId[4] = 0;
+			server->m_gotReply = 1;
+			if (memcmp(packet+4, "Barrier", 7) == 0 && length >= 11)
+				server->m_protocolMinor = (uint16_t)((packet[13] << 8) | packet[14]);
+		}
+		ofs += length + 4;
+	}
+	memmove(server->m_receive, server->m_receive + ofs, server->m_receiveFill - ofs);
+	server->m_receiveFill -= ofs;
+}
+
+
+
+/**
+@brief Wait for a reply with an ID starting with @a id
+**/
+static int sWaitFor(sServer *server, const char *id)
+{
+	uint64_t deadline = sMicroseconds() + REPLY_TIMEOUT * 1000;
+	server->m_gotReply = 0;
+	while (server->m_socket >= 0 && sMicroseconds() < deadline)
+	{
+		sReceiveReplies(server, 10);
+		if (server->m_gotReply && strncmp(server->m_replyId, id, 4) == 0)
+			return 1;
+		server->m_gotReply = 0;
+	}
+	printf("  no %s reply\n", id);
+	return 0;
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Commands
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+static void sBeginBurst(sServer *server)
+{
+	server->m_numSent	= 0;
+	server->m_numAcked	= 0;
+	if (server->m_client != 0L)
+		memset(server->m_client->m_callbackTimes, 0, MAX_TRACKED * sizeof(uint64_t));
+}
+
+
+
+/**
+@brief Wait for the CNOPs of a burst and report its latencies
+**/
+static void sEndBurst(sServer *server, const char *what, uint64_t start)
+{
+	uint64_t deadline = sMicroseconds() + REPLY_TIMEOUT * 1000;
+	uint64_t elapsed;
+	uint32_t tracked = server->m_numSent < MAX_TRACKED ? server->m_numSent : MAX_TRACKED;
+	uint32_t acked;
+	while (server->m_socket >= 0 && server->m_numAcked < server->m_numSent && sMicroseconds() < deadline)
+		sReceiveReplies(server, 10);
+	elapsed = sMicroseconds() - start;
+	acked = server->m_numAcked < tracked ? server->m_numAcked : tracked;
+
+	printf("  %s: %u sent, %u acknowledged in %.1f ms, %.0f messages/s\n", what, server->m_numSent, server->m_numAcked,
+		(double)elapsed / 1000.0, (double)server->m_numAcked * 1000000.0 / (double)(elapsed ? elapsed : 1));
+	sPrintLatency("round trip", server->m_roundTrips, acked);
+
+	if (server->m_client != 0L)
+	{
+		/* Callback times are indexed by the tag carried in the message, which is its index in the burst */
+		uint32_t i, count = 0;
+		for (i = 0; i < tracked; i++)
+		{
+			uint64_t callback = __atomic_load_n(&server->m_client->m_callbackTimes[i], __ATOMIC_ACQUIRE);
+			if (callback != 0)
+				server->m_roundTrips[count++] = callback - server->m_sendTimes[i];
+		}
+		sPrintLatency("callback", server->m_roundTrips, count);
+
+		/* Split at the arrival time the client saw, the clocks are the same */
+		count = 0;
+		for (i = 0; i < tracked; i++)
+			if (__atomic_load_n(&server->m_client->m_callbackTimes[i], __ATOMIC_ACQUIRE) != 0)
+				server->m_roundTrips[count++] = server->m_client->m_arrivalTimes[i] - server->m_sendTimes[i];
+		sPrintLatency("arrival", server->m_roundTrips, count);
+		count = 0;
+		for (i = 0; i < tracked; i++)
+		{
+			uint64_t callback = __atomic_load_n(&server->m_client->m_callbackTimes[i], __ATOMIC_ACQUIRE);
+			if (callback != 0)
+				server->m_roundTrips[count++] = callback - server->m_client->m_arrivalTimes[i];
+		}
+		sPrintLatency("in client", server->m_roundTrips, count);
+	}
+}
+
+
+
+/**
+@brief Send @a count messages at @a rate per second, built by @a build from the message index
+**/
+static void sBurst(sServer *server, const char *what, uint32_t count, uint32_t rate, void (*build)(sServer *server, uint32_t index))
+{
+	uint64_t start = sMicroseconds();
+	uint32_t i;
+	sBeginBurst(server);
+	for (i = 0; i < count && server->m_socket >= 0; i++)
+	{
+		/* Pace the burst, reading replies while waiting */
+		uint64_t due = rate != 0 ? start + (uint64_t)i * 1000000 / rate : 0;
+		while (server->m_socket >= 0 && (sMicroseconds() < due || server->m_numSent - server->m_numAcked >= MAX_IN_FLIGHT))
+		{
+			int64_t wait = (int64_t)(due - sMicroseconds()) / 1000;
+			sReceiveReplies(server, wait > 0 ? (int)wait : 0);
+		}
+		build(server, i);
+		sSendPacket(server, 1, 0L, 0);
+	}
+	sEndBurst(server, what, start);
+}
+
+
+
+static void sBuildMove(sServer *server, uint32_t index)
+{
+	sBegin(server, "DMMV");
+	sPut16(server, (uint16_t)(index % 4096));
+	sPut16(server, (uint16_t)(index / 4096));
+}
+
+
+
+static void sBuildKey(sServer *server, uint32_t index)
+{
+	sBegin(server, "DKDN");
+	sPut16(server, (uint16_t)index);
+	sPut16(server, (uint16_t)(index >> 16));
+	sPut16(server, (uint16_t)index);
+}
+
+
+
+static void sHello(sServer *server)
+{
+	sBegin(server, "Barrier");
+	sPut16(server, UBARRIER_PROTOCOL_MAJOR);
+	sPut16(server, 6);
+	sSendPacket(server, 0, 0L, 0);
+	if (sWaitFor(server, "Barr"))
+		printf("  client speaks 1.%u\n", server->m_protocolMinor);
+}
+
+
+
+static void sClipboard(sServer *server, uint32_t size)
+{
+	uint32_t marshalled_size = 4+4+4+size;
+	uint8_t *marshalled = (uint8_t*)malloc(marshalled_size);
+	uint64_t start;
+	uint32_t i;
+
+	marshalled[0] = 0; marshalled[1] = 0; marshalled[2] = 0; marshalled[3] = 1;
+	memset(marshalled+4, 0, 4);
+	marshalled[8] = (uint8_t)(size >> 24); marshalled[9] = (uint8_t)(size >> 16);
+	marshalled[10] = (uint8_t)(size >> 8); marshalled[11] = (uint8_t)size;
+	for (i = 0; i < size; i++)
+		marshalled[12+i] = (uint8_t)('a' + i % 26);
+	if (server->m_client != 0L)
+		server->m_client->m_clipboardEndTime = 0;
+
+	sBeginBurst(server);
+	start = sMicroseconds();
+	if (server->m_protocolMinor >= 6)
+	{
+		char decimal[16];
+		uint32_t ofs;
+		sBegin(server, "DCLP"); sPut8(server, 0); sPut32(server, 0); sPut8(server, 1);
+		sprintf(decimal, "%u", marshalled_size);
+		sPut32(server, (uint32_t)strlen(decimal));
+		sSendPacket(server, 1, (const uint8_t*)decimal, (uint32_t)strlen(decimal));
+		for (ofs = 0; ofs < marshalled_size; ofs += UBARRIER_CLIPBOARD_CHUNK_SIZE)
+		{
+			uint32_t chunk = marshalled_size - ofs < UBARRIER_CLIPBOARD_CHUNK_SIZE ? marshalled_size - ofs : UBARRIER_CLIPBOARD_CHUNK_SIZE;
+			sBegin(server, "DCLP"); sPut8(server, 0); sPut32(server, 0); sPut8(server, 2); sPut32(server, chunk);
+			sSendPacket(server, 1, marshalled + ofs, chunk);
+			sReceiveReplies(server, 0);
+		}
+		sBegin(server, "DCLP"); sPut8(server, 0); sPut32(server, 0); sPut8(server, 3); sPut32(server, 0);
+		sSendPacket(server, 1, 0L, 0);
+	}
+	else
+	{
+		sBegin(server, "DCLP"); sPut8(server, 0); sPut32(server, 0); sPut32(server, marshalled_size);
+		sSendPacket(server, 1, marshalled, marshalled_size);
+	}
+	sEndBurst(server, "clipboard", start);
+	printf("  clipboard: %.1f MB/s until the last CNOP", (double)size / (double)(sMicroseconds() - start));
+	if (server->m_client != 0L && server->m_client->m_clipboardEndTime != 0)
+		printf(", %llu us until the client had it all", (unsigned long long)(server->m_client->m_clipboardEndTime - start));
+	printf("\n");
+	free(marshalled);
+}
+
+
+
+static void sAccept(sServer *server)
+{
+	struct pollfd fd;
+	int one = 1;
+
+	if (server->m_socket >= 0)
+		sClose(server, "accepting a new client");
+	fd.fd		= server->m_listen;
+	fd.events	= POLLIN;
+	if (poll(&fd, 1, 30000) <= 0)
+	{
+		printf("  no client within 30 s\n");
+		return;
+	}
+	server->m_socket = accept(server->m_listen, 0L, 0L);
+	if (server->m_socket < 0)
+		return;
+	setsockopt(server->m_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	server->m_protocolMinor = 0;
+	if (server->m_disconnectTime != 0)
+		printf("  client connected %.1f ms after the last disconnect\n", (double)(sMicroseconds() - server->m_disconnectTime) / 1000.0);
+	else
+		printf("  client connected\n");
+}
+
+
+
+static void sStall(sServer *server, uint32_t ms)
+{
+	uint64_t start = sMicroseconds();
+	uint64_t end = start + (uint64_t)ms * 1000;
+	while (server->m_socket >= 0 && sMicroseconds() < end)
+		sReceiveReplies(server, 10);
+	if (server->m_socket < 0)
+		printf("  client gave up after %.1f ms\n", (double)(server->m_disconnectTime - start) / 1000.0);
+	else
+		printf("  client stayed connected\n");
+}
+
+
+
+/**
+@brief Check that the client answers right away after a quiet @a ms, a client that went to sleep answers late
+**/
+static void sIdle(sServer *server, uint32_t ms, uint32_t maxUs)
+{
+	uint64_t start;
+	sStall(server, ms);
+	start = sMicroseconds();
+	sBurst(server, "after idle", 1, 0, sBuildMove);
+	if (server->m_numAcked < 1 || server->m_roundTrips[0] > maxUs)
+	{
+		printf("  FAILED: no answer within %u us, took %llu us\n", maxUs, (unsigned long long)(sMicroseconds() - start));
+		server->m_failed = 1;
+	}
+}
+
+
+
+/**
+@brief Run one script line, returns 0 for unknown commands
+**/
+static int sRunCommand(sServer *server, const char *line)
+{
+	char command[32];
+	unsigned a = 0, b = 0;
+	int n = sscanf(line, "%31s %u %u", command, &a, &b);
+	if (n <= 0 || command[0] == '#')
+		return 1;
+	printf("> %s", line);
+	if (line[strlen(line)-1] != '\n')
+		printf("\n");
+
+	if (strcmp(command, "accept") == 0)
+		sAccept(server);
+	else if (strcmp(command, "hello") == 0)
+		sHello(server);
+	else if (strcmp(command, "qinf") == 0)
+	{
+		sBegin(server, "QINF");
+		sSendPacket(server, 0, 0L, 0);
+		if (sWaitFor(server, "DINF"))
+		{
+			sBegin(server, "CIAK");
+			sSendPacket(server, 0, 0L, 0);
+		}
+	}
+	else if (strcmp(command, "enter") == 0)
+	{
+		sBeginBurst(server);
+		sBegin(server, "CINN");
+		sPut16(server, 0); sPut16(server, 0); sPut32(server, 1); sPut16(server, 0);
+		sSendPacket(server, 1, 0L, 0);
+		sEndBurst(server, "enter", sMicroseconds());
+	}
+	else if (strcmp(command, "leave") == 0)
+	{
+		sBeginBurst(server);
+		sBegin(server, "COUT");
+		sSendPacket(server, 1, 0L, 0);
+		sEndBurst(server, "leave", sMicroseconds());
+	}
+	else if (strcmp(command, "move") == 0)
+		sBurst(server, "move", a, b, sBuildMove);
+	else if (strcmp(command, "keys") == 0)
+		sBurst(server, "keys", a, b, sBuildKey);
+	else if (strcmp(command, "clipboard") == 0)
+		sClipboard(server, a);
+	else if (strcmp(command, "keepalive") == 0)
+	{
+		uint32_t i;
+		for (i = 0; i < a && server->m_socket >= 0; i++)
+		{
+			sBegin(server, "CALV");
+			sSendPacket(server, 0, 0L, 0);
+			if (!sWaitFor(server, "CALV"))
+				break;
+			sStall(server, b);
+		}
+		if (server->m_client != 0L)
+			sPrintLink(server->m_client);
+	}
+	else if (strcmp(command, "heartbeat") == 0)
+	{
+		sBeginBurst(server);
+		sBegin(server, "DSOP");
+		sPut32(server, 2);
+		sPut32(server, ((uint32_t)'H' << 24) | ((uint32_t)'A' << 16) | ((uint32_t)'R' << 8) | (uint32_t)'T');
+		sPut32(server, a);
+		sSendPacket(server, 1, 0L, 0);
+		sEndBurst(server, "heartbeat", sMicroseconds());
+	}
+	else if (strcmp(command, "busy") == 0)
+	{
+		sBegin(server, "EBSY");
+		sSendPacket(server, 0, 0L, 0);
+		sClose(server, "client name busy");
+	}
+	else if (strcmp(command, "stall") == 0)
+		sStall(server, a);
+	else if (strcmp(command, "idle") == 0)
+		sIdle(server, a, b);
+	else if (strcmp(command, "disconnect") == 0)
+		sClose(server, "disconnect command");
+	else
+	{
+		printf("  unknown command\n");
+		return 0;
+	}
+	return 1;
+}
+
+
+
+int main(int argc, char **argv)
+{
+	static const char *default_script[] =
+	{
+		"accept", "hello", "qinf", "enter",
+		"move 10000 2000", "move 100000 0", "keys 1000 500", "clipboard 1048576",
+		"keepalive 4 500", "move 100 1000", "idle 300 50000", "leave",
+		"disconnect", "accept", "hello", "busy", "accept", "hello",
+		0L
+	};
+	static sServer server;
+	static sClient client;
+	pthread_t client_thread;
+	struct sockaddr_in addr;
+	const char *script = 0L;
+	pthread_t event_thread;
+	int port = 24800, start_client = 0, batch_replies = 0, use_events = 0, blocking = 0, one = 1, i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-p") == 0 && i+1 < argc)
+			port = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0)
+			start_client = 1;
+		else if (strcmp(argv[i], "-b") == 0)
+			batch_replies = 1;
+		else if (strcmp(argv[i], "-e") == 0)
+			use_events = 1;
+		else if (strcmp(argv[i], "-u") == 0)
+			blocking = 1;
+		else
+			script = argv[i];
+	}
+
+	server.m_socket		= -1;
+	server.m_sendTimes	= (uint64_t*)calloc(MAX_TRACKED, sizeof(uint64_t));
+	server.m_roundTrips	= (uint64_t*)calloc(MAX_TRACKED, sizeof(uint64_t));
+	server.m_listen		= socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(server.m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family			= AF_INET;
+	addr.sin_port			= htons((uint16_t)port);
+	addr.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	if (bind(server.m_listen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server.m_listen, 1) != 0)
+	{
+		perror("mock-server: bind");
+		return 1;
+	}
+	printf("listening on 127.0.0.1:%d\n", port);
+
+	if (start_client)
+	{
+		sStartClient(&client, port, batch_replies ? UBARRIER_TRUE : UBARRIER_FALSE, use_events ? UBARRIER_TRUE : UBARRIER_FALSE, blocking, &client_thread, &event_thread);
+		server.m_client = &client;
+	}
+
+	if (script == 0L)
+	{
+		for (i = 0; default_script[i] != 0L; i++)
+			sRunCommand(&server, default_script[i]);
+	}
+	else
+	{
+		char line[256];
+		FILE *file = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+		if (file == 0L)
+		{
+			perror(script);
+			return 1;
+		}
+		while (fgets(line, sizeof(line), file) != 0L)
+			sRunCommand(&server, line);
+		if (file != stdin)
+			fclose(file);
+	}
+
+	sClose(&server, "script done");
+	if (start_client)
+	{
+		char histograms[512];
+		client.m_quit = 1;
+		pthread_join(client_thread, 0L);
+		uBarrierPublishStats(&client.m_context);
+		if (use_events)
+		{
+			uBarrierStats stats;
+			pthread_join(event_thread, 0L);
+			uBarrierGetStats(&client.m_context, &stats);
+			printf("client events: %llu queued, %llu dropped\n", (unsigned long long)stats.m_numEventsQueued, (unsigned long long)stats.m_numEventsDropped);
+		}
+		uBarrierFormatHistograms(&client.m_context, histograms, sizeof(histograms));
+		printf("client latency:\n%s", histograms);
+	}
+	return server.m_failed;
+}
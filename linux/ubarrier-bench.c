@@ -0,0 +1,700 @@
+/*
+uBarrier benchmark -- Linux-native microbenchmark for the uBarrier protocol decoder
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+
+Build and run from the repository root:
+
+	cc -O2 -I. -o ubarrier-bench linux/ubarrier-bench.c uBarrier.c
+	./ubarrier-bench [packets] [contexts]
+
+uBarrierUpdate is driven through an in-memory transport: the receive function hands out a pre-built
+packet stream in reads of up to the size uBarrier asks for, and the send function only counts replies.
+
+Every message type is measured on its own, followed by traffic scenarios: mouse move floods, key storms,
+mixed desktop traffic, keep alives only and large clipboards in both the 1.6 chunked and the older
+single packet format. For each run the benchmark reports the decode time per packet, replies and
+callbacks per packet, the bytes uBarrier copied around in its receive buffer per packet and the
+throughput of the stream.
+
+The last table spreads mouse moves over many contexts, one packet per context in turn, like a server
+process driving a fleet of clients from one thread. Once the contexts outgrow the caches every update
+starts with cache misses on the context, so this shows how compact the state touched per packet is.
+Pass a context count to run only that size.
+*/
+#include "uBarrier.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	In-memory transport
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Benchmark transport state
+**/
+typedef struct
+{
+	const uint8_t*	m_stream;			/* Packet stream, replayed cyclically */
+	int				m_streamSize;		/* Size of packet stream in bytes */
+	int				m_streamOfs;		/* Read offset into the stream */
+	uint64_t		m_bytesLeft;		/* Bytes left to deliver before the run ends */
+	uint64_t		m_numSends;			/* Number of send function calls */
+	uint64_t		m_numCallbacks;		/* Number of input callbacks */
+	uint64_t		m_numClipboardBytes;	/* Clipboard data delivered to the chunk callback */
+} sTransport;
+
+
+
+static uBarrierBool sConnect(uBarrierCookie cookie)
+{
+	(void)cookie;
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sSend(uBarrierCookie cookie, const uint8_t *buffer, int length)
+{
+	(void)buffer; (void)length;
+	((sTransport*)cookie)->m_numSends++;
+	return UBARRIER_TRUE;
+}
+
+
+
+static uBarrierBool sReceive(uBarrierCookie cookie, uint8_t *buffer, int maxLength, int *outLength)
+{
+	sTransport *transport = (sTransport*)cookie;
+	int written = 0;
+	while (written < maxLength && transport->m_bytesLeft != 0)
+	{
+		int chunk = transport->m_streamSize - transport->m_streamOfs;
+		if (chunk > maxLength - written)
+			chunk = maxLength - written;
+		if ((uint64_t)chunk > transport->m_bytesLeft)
+			chunk = (int)transport->m_bytesLeft;
+		memcpy(buffer + written, transport->m_stream + transport->m_streamOfs, chunk);
+		written += chunk;
+		transport->m_bytesLeft -= chunk;
+		transport->m_streamOfs += chunk;
+		if (transport->m_streamOfs == transport->m_streamSize)
+			transport->m_streamOfs = 0;
+	}
+	*outLength = written;
+	return UBARRIER_TRUE;
+}
+
+
+
+static void sSleep(uBarrierCookie cookie, int timeMs)
+{
+	(void)cookie; (void)timeMs;
+}
+
+
+
+static uint32_t sGetTime()
+{
+	return 0;
+}
+
+
+
+static void sMouseCallback(uBarrierCookie cookie, uint16_t x, uint16_t y, int16_t wheelX, int16_t wheelY, uBarrierBool buttonLeft, uBarrierBool buttonRight, uBarrierBool buttonMiddle)
+{
+	(void)x; (void)y; (void)wheelX; (void)wheelY; (void)buttonLeft; (void)buttonRight; (void)buttonMiddle;
+	((sTransport*)cookie)->m_numCallbacks++;
+}
+
+
+
+static void sMouseRelativeCallback(uBarrierCookie cookie, int32_t dx, int32_t dy)
+{
+	(void)dx; (void)dy;
+	((sTransport*)cookie)->m_numCallbacks++;
+}
+
+
+
+static void sKeyboardCallback(uBarrierCookie cookie, uint16_t key, uint16_t modifiers, uBarrierBool down, uint16_t repeat)
+{
+	(void)key; (void)modifiers; (void)down; (void)repeat;
+	((sTransport*)cookie)->m_numCallbacks++;
+}
+
+
+
+static void sJoystickCallback(uBarrierCookie cookie, uint8_t joyNum, uint16_t buttons, int8_t leftStickX, int8_t leftStickY, int8_t rightStickX, int8_t rightStickY)
+{
+	(void)joyNum; (void)buttons; (void)leftStickX; (void)leftStickY; (void)rightStickX; (void)rightStickY;
+	((sTransport*)cookie)->m_numCallbacks++;
+}
+
+
+
+static void sScreenActiveCallback(uBarrierCookie cookie, uBarrierBool active)
+{
+	(void)active;
+	((sTransport*)cookie)->m_numCallbacks++;
+}
+
+
+
+static void sClipboardChunkCallback(uBarrierCookie cookie, enum uBarrierClipboardChunk chunk, enum uBarrierClipboardFormat format, const uint8_t *data, uint32_t size, uint32_t totalSize)
+{
+	(void)chunk; (void)format; (void)data; (void)totalSize;
+	((sTransport*)cookie)->m_numCallbacks++;
+	((sTransport*)cookie)->m_numClipboardBytes += size;
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Packet builder
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Packet stream under construction
+**/
+typedef struct
+{
+	uint8_t*		m_data;				/* Stream data */
+	int				m_size;				/* Bytes written */
+	int				m_capacity;			/* Allocated bytes */
+	int				m_packetStart;		/* Offset of the packet being built */
+	int				m_numPackets;		/* Number of complete packets */
+} sStream;
+
+
+
+static void sStreamReserve(sStream *stream, int size)
+{
+	if (stream->m_size + size <= stream->m_capacity)
+		return;
+	while (stream->m_size + size > stream->m_capacity)
+		stream->m_capacity = stream->m_capacity ? stream->m_capacity*2 : 4096;
+	stream->m_data = (uint8_t*)realloc(stream->m_data, stream->m_capacity);
+}
+
+
+
+static void sPutUInt8(sStream *stream, uint8_t value)
+{
+	sStreamReserve(stream, 1);
+	stream->m_data[stream->m_size++] = value;
+}
+
+
+
+static void sPutUInt16(sStream *stream, uint16_t value)
+{
+	sPutUInt8(stream, (uint8_t)(value >> 8));
+	sPutUInt8(stream, (uint8_t)value);
+}
+
+
+
+static void sPutUInt32(sStream *stream, uint32_t value)
+{
+	sPutUInt16(stream, (uint16_t)(value >> 16));
+	sPutUInt16(stream, (uint16_t)value);
+}
+
+
+
+static void sPutString(sStream *stream, const uint8_t *data, uint32_t size)
+{
+	sPutUInt32(stream, size);
+	sStreamReserve(stream, (int)size);
+	memcpy(stream->m_data + stream->m_size, data, size);
+	stream->m_size += (int)size;
+}
+
+
+
+static void sBeginPacket(sStream *stream, const char *id)
+{
+	stream->m_packetStart = stream->m_size;
+	sPutUInt32(stream, 0);
+	while (*id)
+		sPutUInt8(stream, (uint8_t)*id++);
+}
+
+
+
+static void sEndPacket(sStream *stream)
+{
+	uint32_t length = (uint32_t)(stream->m_size - stream->m_packetStart - 4);
+	uint8_t *header = stream->m_data + stream->m_packetStart;
+	header[0] = (uint8_t)(length >> 24);
+	header[1] = (uint8_t)(length >> 16);
+	header[2] = (uint8_t)(length >> 8);
+	header[3] = (uint8_t)length;
+	stream->m_numPackets++;
+}
+
+
+
+/**
+@brief Append one packet of the given type, with payload derived from @a index
+**/
+static void sAddPacket(sStream *stream, const char *id, int index)
+{
+	sBeginPacket(stream, id);
+	if (strcmp(id, "DMMV") == 0)
+	{
+		sPutUInt16(stream, (uint16_t)(index & 1023));
+		sPutUInt16(stream, (uint16_t)((index * 7) & 767));
+	}
+	else if (strcmp(id, "DMRM") == 0)
+	{
+		sPutUInt16(stream, (uint16_t)((index & 7) - 3));
+		sPutUInt16(stream, (uint16_t)(((index >> 3) & 7) - 3));
+	}
+	else if (strcmp(id, "DMDN") == 0 || strcmp(id, "DMUP") == 0)
+		sPutUInt8(stream, 1);
+	else if (strcmp(id, "DMWM") == 0)
+	{
+		sPutUInt16(stream, 0);
+		sPutUInt16(stream, 120);
+	}
+	else if (strcmp(id, "DKDN") == 0 || strcmp(id, "DKUP") == 0)
+	{
+		sPutUInt16(stream, (uint16_t)(0x61 + (index % 26)));
+		sPutUInt16(stream, 0);
+		sPutUInt16(stream, (uint16_t)(0x26 + (index % 26)));
+	}
+	else if (strcmp(id, "DKRP") == 0)
+	{
+		sPutUInt16(stream, 0x61);
+		sPutUInt16(stream, 0);
+		sPutUInt16(stream, 1);
+		sPutUInt16(stream, 0x26);
+	}
+	else if (strcmp(id, "CINN") == 0)
+	{
+		sPutUInt16(stream, 0);
+		sPutUInt16(stream, 0);
+		sPutUInt32(stream, (uint32_t)index);
+		sPutUInt16(stream, 0);
+	}
+	else if (strcmp(id, "DGST") == 0)
+	{
+		sPutUInt8(stream, 0);
+		sPutUInt8(stream, (uint8_t)index);
+		sPutUInt8(stream, 0);
+		sPutUInt8(stream, 0);
+		sPutUInt8(stream, 0);
+	}
+	else if (strcmp(id, "DGBT") == 0)
+	{
+		sPutUInt8(stream, 0);
+		sPutUInt16(stream, (uint16_t)index);
+	}
+	sEndPacket(stream);
+}
+
+
+
+/**
+@brief Append a key press with @a repeats auto repeats, wrapped in a shift press
+**/
+static void sAddKeyStroke(sStream *stream, uint16_t key, uint16_t button, int repeats)
+{
+	sBeginPacket(stream, "DKDN");
+	sPutUInt16(stream, 0xffe1);
+	sPutUInt16(stream, 0);
+	sPutUInt16(stream, 0x32);
+	sEndPacket(stream);
+	sBeginPacket(stream, "DKDN");
+	sPutUInt16(stream, key);
+	sPutUInt16(stream, 0x0001);
+	sPutUInt16(stream, button);
+	sEndPacket(stream);
+	while (repeats-- > 0)
+	{
+		sBeginPacket(stream, "DKRP");
+		sPutUInt16(stream, key);
+		sPutUInt16(stream, 0x0001);
+		sPutUInt16(stream, 1);
+		sPutUInt16(stream, button);
+		sEndPacket(stream);
+	}
+	sBeginPacket(stream, "DKUP");
+	sPutUInt16(stream, key);
+	sPutUInt16(stream, 0x0001);
+	sPutUInt16(stream, button);
+	sEndPacket(stream);
+	sBeginPacket(stream, "DKUP");
+	sPutUInt16(stream, 0xffe1);
+	sPutUInt16(stream, 0);
+	sPutUInt16(stream, 0x32);
+	sEndPacket(stream);
+}
+
+
+
+/**
+@brief Append a clipboard of @a size bytes of text, chunked for protocol 1.6 or as a single packet before
+**/
+static void sAddClipboard(sStream *stream, int protocolMinor, uint32_t size)
+{
+	uint32_t marshalled_size = 4+4+4+size;
+	uint8_t *marshalled = (uint8_t*)malloc(marshalled_size);
+	uint32_t i;
+
+	/* One text format */
+	marshalled[0] = 0; marshalled[1] = 0; marshalled[2] = 0; marshalled[3] = 1;
+	memset(marshalled+4, 0, 4);
+	marshalled[8] = (uint8_t)(size >> 24); marshalled[9] = (uint8_t)(size >> 16);
+	marshalled[10] = (uint8_t)(size >> 8); marshalled[11] = (uint8_t)size;
+	for (i = 0; i < size; i++)
+		marshalled[12+i] = (uint8_t)('a' + i % 26);
+
+	if (protocolMinor < 6)
+	{
+		sBeginPacket(stream, "DCLP");
+		sPutUInt8(stream, 0);
+		sPutUInt32(stream, 0);
+		sPutString(stream, marshalled, marshalled_size);
+		sEndPacket(stream);
+	}
+	else
+	{
+		char decimal[16];
+		uint32_t ofs;
+
+		sBeginPacket(stream, "DCLP");
+		sPutUInt8(stream, 0);
+		sPutUInt32(stream, 0);
+		sPutUInt8(stream, 1);
+		sprintf(decimal, "%u", marshalled_size);
+		sPutString(stream, (const uint8_t*)decimal, (uint32_t)strlen(decimal));
+		sEndPacket(stream);
+		for (ofs = 0; ofs < marshalled_size; ofs += UBARRIER_CLIPBOARD_CHUNK_SIZE)
+		{
+			uint32_t chunk = marshalled_size - ofs;
+			if (chunk > UBARRIER_CLIPBOARD_CHUNK_SIZE)
+				chunk = UBARRIER_CLIPBOARD_CHUNK_SIZE;
+			sBeginPacket(stream, "DCLP");
+			sPutUInt8(stream, 0);
+			sPutUInt32(stream, 0);
+			sPutUInt8(stream, 2);
+			sPutString(stream, marshalled+ofs, chunk);
+			sEndPacket(stream);
+		}
+		sBeginPacket(stream, "DCLP");
+		sPutUInt8(stream, 0);
+		sPutUInt32(stream, 0);
+		sPutUInt8(stream, 3);
+		sPutUInt32(stream, 0);
+		sEndPacket(stream);
+	}
+	free(marshalled);
+}
+
+
+
+/**
+@brief Scenario: a long fast mouse sweep across the screen
+**/
+static void sBuildMouseFlood(sStream *stream)
+{
+	int i;
+	for (i = 0; i < 4096; i++)
+		sAddPacket(stream, "DMMV", i);
+}
+
+
+
+/**
+@brief Scenario: typing with held keys, every stroke wrapped in shift and followed by auto repeats
+**/
+static void sBuildKeyStorm(sStream *stream)
+{
+	int i;
+	for (i = 0; i < 256; i++)
+		sAddKeyStroke(stream, (uint16_t)(0x61 + i % 26), (uint16_t)(0x26 + i % 26), i % 8);
+}
+
+
+
+/**
+@brief Scenario: ordinary desktop use, entering the screen, moving, clicking, scrolling and typing
+**/
+static void sBuildMixed(sStream *stream)
+{
+	int i, j;
+	sAddPacket(stream, "CINN", 0);
+	for (i = 0; i < 128; i++)
+	{
+		for (j = 0; j < 12; j++)
+			sAddPacket(stream, "DMMV", i*12 + j);
+		if (i % 4 == 0)
+		{
+			sAddPacket(stream, "DMDN", i);
+			sAddPacket(stream, "DMUP", i);
+		}
+		if (i % 4 == 2)
+			sAddPacket(stream, "DMWM", i);
+		sAddPacket(stream, "DKDN", i);
+		sAddPacket(stream, "DKUP", i);
+		if (i % 32 == 31)
+			sAddPacket(stream, "CALV", i);
+	}
+	sAddPacket(stream, "COUT", 0);
+}
+
+
+
+/**
+@brief Scenario: an idle session, only keep alives
+**/
+static void sBuildKeepAlive(sStream *stream)
+{
+	int i;
+	for (i = 0; i < 1024; i++)
+		sAddPacket(stream, "CALV", i);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Benchmark driver
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+static uint64_t sNanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+
+/**
+@brief Set up @a context to read from @a transport
+**/
+static void sInitContext(uBarrierContext *context, sTransport *transport)
+{
+	uBarrierInit(context);
+	context->m_connectFunc				= sConnect;
+	context->m_sendFunc					= sSend;
+	context->m_receiveFunc				= sReceive;
+	context->m_sleepFunc				= sSleep;
+	context->m_getTimeFunc				= sGetTime;
+	context->m_clientName				= "bench";
+	context->m_clientWidth				= 1024;
+	context->m_clientHeight				= 768;
+	context->m_cookie					= (uBarrierCookie)transport;
+	context->m_mouseCallback			= sMouseCallback;
+	context->m_mouseRelativeCallback	= sMouseRelativeCallback;
+	context->m_keyboardCallback			= sKeyboardCallback;
+	context->m_joystickCallback			= sJoystickCallback;
+	context->m_screenActiveCallback		= sScreenActiveCallback;
+	context->m_clipboardChunkCallback	= sClipboardChunkCallback;
+}
+
+
+
+/**
+@brief Replay @a stream through a fresh context until @a numPackets packets have been delivered
+**/
+static void sRun(const char *name, const sStream *stream, uint64_t numPackets, uBarrierBool batchReplies, uBarrierBool coalesceMouseMoves, int protocolMinor)
+{
+	static uBarrierContext context;
+	uBarrierStats stats;
+	sTransport transport;
+	uint64_t start, elapsed;
+
+	memset(&transport, 0, sizeof(transport));
+	transport.m_stream		= stream->m_data;
+	transport.m_streamSize	= stream->m_size;
+	if (numPackets < (uint64_t)stream->m_numPackets)
+		numPackets = stream->m_numPackets;
+	numPackets				= (numPackets / stream->m_numPackets) * stream->m_numPackets;
+	transport.m_bytesLeft	= (uint64_t)stream->m_size * (numPackets / stream->m_numPackets);
+
+	sInitContext(&context, &transport);
+	context.m_batchReplies			= batchReplies;
+	context.m_coalesceMouseMoves	= coalesceMouseMoves;
+
+	/* Connect, then drain the stream. There is no handshake, so set the protocol version by hand */
+	uBarrierUpdate(&context);
+	context.m_protocolMinor = (uint16_t)protocolMinor;
+	start = sNanoseconds();
+	while (transport.m_bytesLeft != 0)
+		uBarrierUpdate(&context);
+	elapsed = sNanoseconds() - start;
+	uBarrierPublishStats(&context);
+	uBarrierGetStats(&context, &stats);
+
+	printf("%-14s %10.2f ns/packet %8.3f replies/packet %8.3f callbacks/packet %9.2f copied B/packet %9.1f MB/s\n", name,
+		(double)elapsed / (double)numPackets,
+		(double)transport.m_numSends / (double)numPackets,
+		(double)transport.m_numCallbacks / (double)numPackets,
+		(double)stats.m_numBytesCompacted / (double)numPackets,
+		(double)stream->m_size * (double)(numPackets / stream->m_numPackets) * 1000.0 / (double)elapsed);
+}
+
+
+
+/**
+@brief Deliver @a numPackets mouse moves round robin to @a numContexts contexts, one packet per update
+**/
+static void sRunMany(const sStream *stream, int numContexts, uint64_t numPackets)
+{
+	uBarrierContext *contexts = (uBarrierContext*)malloc(sizeof(uBarrierContext) * (size_t)numContexts);
+	sTransport *transports = (sTransport*)calloc((size_t)numContexts, sizeof(sTransport));
+	uint32_t packet_size = (uint32_t)(stream->m_size / stream->m_numPackets);
+	uint64_t rounds = numPackets / (uint64_t)numContexts;
+	uint64_t start, elapsed, r;
+	int i;
+
+	if (rounds == 0)
+		rounds = 1;
+	for (i = 0; i < numContexts; i++)
+	{
+		transports[i].m_stream		= stream->m_data;
+		transports[i].m_streamSize	= stream->m_size;
+		sInitContext(&contexts[i], &transports[i]);
+		uBarrierUpdate(&contexts[i]);
+	}
+
+	start = sNanoseconds();
+	for (r = 0; r < rounds; r++)
+	{
+		for (i = 0; i < numContexts; i++)
+		{
+			transports[i].m_bytesLeft = packet_size;
+			uBarrierUpdate(&contexts[i]);
+		}
+	}
+	elapsed = sNanoseconds() - start;
+
+	printf("%8d contexts %10.2f ns/packet %9.1f MB of contexts\n", numContexts,
+		(double)elapsed / (double)(rounds * (uint64_t)numContexts),
+		(double)sizeof(uBarrierContext) * (double)numContexts / (1024.0*1024.0));
+	free(transports);
+	free(contexts);
+}
+
+
+
+int main(int argc, char **argv)
+{
+	static const char *types[] =
+	{
+		"DMMV", "DMRM", "DMDN", "DMUP", "DMWM", "DKDN", "DKUP", "DKRP", "DGBT", "DGST", "CINN", "COUT", "CALV", "CNOP"
+	};
+	static const struct
+	{
+		const char*		m_name;
+		void			(*m_build)(sStream *stream);
+	} scenarios[] =
+	{
+		{ "mouse-flood",	sBuildMouseFlood },
+		{ "key-storm",		sBuildKeyStorm },
+		{ "mixed",			sBuildMixed },
+		{ "keepalive",		sBuildKeepAlive },
+	};
+	static const struct
+	{
+		const char*		m_name;
+		int				m_protocolMinor;
+		uint32_t		m_size;
+	} clipboards[] =
+	{
+		{ "clip-1.6-4K",	6,	4096 },
+		{ "clip-1.6-1M",	6,	1024*1024 },
+		{ "clip-1.4-1M",	4,	1024*1024 },
+	};
+	static const int context_counts[] = { 1, 16, 256, 4096, 32768 };
+	uint64_t num_packets = argc > 1 ? strtoull(argv[1], 0L, 10) : 4000000;
+	int num_contexts = argc > 2 ? atoi(argv[2]) : 0;
+	sStream moves;
+	static const char *modes[] =
+	{
+		"replies sent per packet", "replies batched", "replies batched, mouse moves coalesced"
+	};
+	int mode;
+	size_t t;
+
+	memset(&moves, 0, sizeof(moves));
+	for (t = 0; t < 1024; t++)
+		sAddPacket(&moves, "DMMV", (int)t);
+	if (num_contexts > 0)
+	{
+		sRunMany(&moves, num_contexts, num_packets);
+		return 0;
+	}
+
+	for (mode = 0; mode < 3; mode++)
+	{
+		printf("uBarrier per-message decode benchmark, %llu packets per type, %s\n", (unsigned long long)num_packets, modes[mode]);
+		for (t = 0; t < sizeof(types)/sizeof(types[0]); t++)
+		{
+			sStream stream;
+			int i;
+			memset(&stream, 0, sizeof(stream));
+			for (i = 0; i < 1024; i++)
+				sAddPacket(&stream, types[t], i);
+			sRun(types[t], &stream, num_packets, mode >= 1, mode >= 2, 6);
+			free(stream.m_data);
+		}
+
+		printf("uBarrier scenario benchmark, %s\n", modes[mode]);
+		for (t = 0; t < sizeof(scenarios)/sizeof(scenarios[0]); t++)
+		{
+			sStream stream;
+			memset(&stream, 0, sizeof(stream));
+			scenarios[t].m_build(&stream);
+			sRun(scenarios[t].m_name, &stream, num_packets, mode >= 1, mode >= 2, 6);
+			free(stream.m_data);
+		}
+
+		/* Clipboard packets carry a lot more data, so replay fewer of them */
+		for (t = 0; t < sizeof(clipboards)/sizeof(clipboards[0]); t++)
+		{
+			sStream stream;
+			memset(&stream, 0, sizeof(stream));
+			sAddClipboard(&stream, clipboards[t].m_protocolMinor, clipboards[t].m_size);
+			sRun(clipboards[t].m_name, &stream, num_packets / 1000, mode >= 1, mode >= 2, clipboards[t].m_protocolMinor);
+			free(stream.m_data);
+		}
+	}
+
+	printf("uBarrier many-context benchmark, DMMV, %zu bytes per context\n", sizeof(uBarrierContext));
+	for (t = 0; t < sizeof(context_counts)/sizeof(context_counts[0]); t++)
+		sRunMany(&moves, context_counts[t], num_packets);
+	free(moves.m_data);
+	return 0;
+}
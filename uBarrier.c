@@ -24,623 +24,2903 @@ freely, subject to the following restrictions:
    distribution.
 */
 #include "uBarrier.h"
+#include "uBarrierProtocol.h"
 #include <stdio.h>
 #include <string.h>
 
 
 
+/**
+@brief Space kept free in the reply buffer for the next batched reply, the largest batched reply is DINF (22 bytes)
+**/
+#define UBARRIER_REPLY_BATCH_RESERVE	64
+
+
+
+/**
+@brief Full memory barrier, for the compiler and the CPU. Used by the sequence lock that publishes the traffic
+counters and by the trace, send and event rings
+**/
+#if !defined(UBARRIER_MEMORY_BARRIER)
+	#if defined(__GNUC__)
+		#define UBARRIER_MEMORY_BARRIER()	__sync_synchronize()
+	#elif defined(_MSC_VER)
+		/* What MemoryBarrier() in winnt.h expands to, _ReadWriteBarrier alone only stops the compiler */
+		#include <intrin.h>
+		#if defined(_M_ARM64) || defined(_M_ARM64EC)
+			#define UBARRIER_MEMORY_BARRIER()	__dmb(_ARM64_BARRIER_SY)
+		#elif defined(_M_ARM)
+			#define UBARRIER_MEMORY_BARRIER()	__dmb(_ARM_BARRIER_SY)
+		#elif defined(_M_X64)
+			#define UBARRIER_MEMORY_BARRIER()	__faststorefence()
+		#else
+			#define UBARRIER_MEMORY_BARRIER()	do { long fence = 0; _InterlockedOr(&fence, 0); } while (0)
+		#endif
+	#else
+		#error "Please define UBARRIER_MEMORY_BARRIER() for your compiler"
+	#endif
+#endif
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Internal helpers
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Record a trace for uBarrierDrainTrace
+
+Only stores the kind and raw arguments, formatting is left to the draining thread. Each kind is limited to
+UBARRIER_TRACE_RATE_LIMIT traces per UBARRIER_TRACE_RATE_WINDOW, so a server flooding us with packets we
+can't handle costs a few compares per packet.
+**/
+static void sTrace(uBarrierContext *context, enum uBarrierTraceEvent event, uint32_t arg0, uint32_t arg1)
+{
+	uBarrierTraceRecord *record;
+	uint32_t head, cur_time;
+
+	// Don't trace if we don't have a trace function
+	if (context->m_traceFunc == 0L)
+		return;
+
+	// Rate limit per kind of trace
+	cur_time = context->m_getTimeFunc();
+	if (cur_time - context->m_traceWindowStart[event] >= UBARRIER_TRACE_RATE_WINDOW)
+	{
+		context->m_traceWindowStart[event] = cur_time;
+		context->m_traceWindowCount[event] = 0;
+	}
+	if (context->m_traceWindowCount[event] >= UBARRIER_TRACE_RATE_LIMIT)
+	{
+		if (context->m_traceSuppressed[event] != 0xFFFF)
+			context->m_traceSuppressed[event]++;
+		return;
+	}
+	context->m_traceWindowCount[event]++;
+
+	// Drop the trace if the ring is full, the draining thread reports how many were lost
+	head = context->m_traceHead;
+	if (head - context->m_traceTail >= UBARRIER_TRACE_RING_SIZE)
+	{
+		context->m_traceLost++;
+		return;
+	}
+	record = &context->m_traceRing[head & (UBARRIER_TRACE_RING_SIZE-1)];
+	record->m_time			= cur_time;
+	record->m_event			= (uint16_t)event;
+	record->m_suppressed	= context->m_traceSuppressed[event];
+	record->m_args[0]		= arg0;
+	record->m_args[1]		= arg1;
+	context->m_traceSuppressed[event] = 0;
+
+	// Publish the record after its contents
+	UBARRIER_MEMORY_BARRIER();
+	context->m_traceHead = head+1;
+}
+
+
+
+/**
+@brief Packet type of a message as a trace argument, 0 if the @a length bytes behind the length prefix don't hold one
+**/
+static uint32_t sTraceType(const uint8_t *message, uint32_t length)
+{
+	return length >= 4 ? sWireRead4(message+4) : 0;
+}
+
+
+
+/**
+@brief Count and trace a packet that failed validation, the caller skips its contents
+**/
+static void sMalformedPacket(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	context->m_stats.m_numMalformedPackets++;
+	sTrace(context, UBARRIER_TRACE_MALFORMED_PACKET, sTraceType(message, length), length);
+}
+
+
+
+/**
+@brief Current time in nanoseconds, 0 if latency histograms are off
+**/
+static uint64_t sTimeNs(const uBarrierContext *context)
+{
+	return context->m_getTimeNsFunc != 0L ? context->m_getTimeNsFunc() : 0;
+}
+
+
+
+/**
+@brief Histogram bucket of @a value, 8 buckets per power of two
+**/
+static uint32_t sHistogramBucket(uint64_t value)
+{
+	uint32_t exponent = 3;
+	uint32_t bucket;
+	if (value < 8)
+		return (uint32_t)value;
+	while ((value >> exponent) > 1)
+		exponent++;
+	bucket = (exponent-2)*8 + (uint32_t)((value >> (exponent-3)) & 7);
+	return bucket < UBARRIER_HISTOGRAM_BUCKETS ? bucket : UBARRIER_HISTOGRAM_BUCKETS-1;
+}
+
+
+
+/**
+@brief Record the time passed since @a start in the histogram of @a stage
+**/
+static void sRecordLatency(uBarrierContext *context, enum uBarrierHistogramStage stage, uint64_t start)
+{
+	uBarrierHistogram *histogram;
+	uint64_t value;
+	if (context->m_getTimeNsFunc == 0L)
+		return;
+	histogram	= &context->m_histograms[stage];
+	value		= context->m_getTimeNsFunc() - start;
+	histogram->m_buckets[sHistogramBucket(value)]++;
+	histogram->m_count++;
+	histogram->m_sum += value;
+	if (value > histogram->m_max)
+		histogram->m_max = value;
+}
+
+
+
+/**
+@brief Add @a sample to a smoothed estimate, the first sample starts it with no deviation
+**/
+static void sUpdateEstimate(uBarrierEstimate *estimate, uint64_t sample)
+{
+	int64_t error = (int64_t)(sample - estimate->m_average);
+	uint64_t distance = error < 0 ? (uint64_t)-error : (uint64_t)error;
+	estimate->m_last = sample;
+	if (estimate->m_count++ == 0)
+	{
+		estimate->m_average	= sample;
+		estimate->m_min		= sample;
+		estimate->m_max		= sample;
+		return;
+	}
+	estimate->m_deviation	= estimate->m_deviation - estimate->m_deviation/4 + distance/4;
+	estimate->m_average		= (uint64_t)((int64_t)estimate->m_average + error/8);
+	if (sample < estimate->m_min)
+		estimate->m_min = sample;
+	if (sample > estimate->m_max)
+		estimate->m_max = sample;
+}
+
+
+
+/**
+@brief Next pseudo random number, used to jitter reconnect delays
+**/
+static uint32_t sRandom(uBarrierContext *context)
+{
+	/* xorshift32, seeded on first use since the time function isn't set up in uBarrierInit */
+	uint32_t x = context->m_randomState;
+	if (x == 0)
+		x = (context->m_getTimeFunc() ^ (uint32_t)(uintptr_t)context) | 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	context->m_randomState = x;
+	return x;
+}
+
+
+
+/**
+@brief Schedule the next connection attempt
+
+The first attempt after a working connection is made right away. Every further failed attempt doubles
+the delay, starting at m_reconnectDelayMin and capped at m_reconnectDelayMax. Half of the delay is
+randomized so a room full of clients doesn't hit a restarted server in lockstep. The delay is never
+shorter than @a minDelay.
+**/
+static void sScheduleReconnect(uBarrierContext *context, uint32_t minDelay)
+{
+	uint32_t delay_min = context->m_reconnectDelayMin != 0 ? context->m_reconnectDelayMin : UBARRIER_RECONNECT_DELAY_MIN;
+	uint32_t delay_max = context->m_reconnectDelayMax != 0 ? context->m_reconnectDelayMax : UBARRIER_RECONNECT_DELAY_MAX;
+	uint32_t delay = 0;
+	if (context->m_reconnectAttempts != 0)
+	{
+		uint32_t shift = context->m_reconnectAttempts - 1;
+		if (shift > 16)
+			shift = 16;
+		delay = delay_min << shift;
+		if (delay > delay_max || (delay >> shift) != delay_min)
+			delay = delay_max;
+		delay = delay/2 + sRandom(context) % (delay/2 + 1);
+	}
+	if (delay < minDelay)
+		delay = minDelay;
+
+	context->m_reconnectAttempts++;
+	context->m_reconnectDelayed	= UBARRIER_TRUE;
+	context->m_reconnectTime	= context->m_getTimeFunc() + delay;
+}
+
+
+
+/**
+@brief Drop the connection from within a message handler
+
+Packet parsing stops after the current message and the context is disconnected once it returns.
+**/
+static void sDropConnection(uBarrierContext *context, uint32_t minDelay)
+{
+	context->m_stats.m_numDisconnects++;
+	context->m_statsChanged = UBARRIER_TRUE;
+	context->m_connected = UBARRIER_FALSE;
+	sScheduleReconnect(context, minDelay);
+}
+
+
+
+/**
+@brief Add raw data to reply packet
+**/
+static void sAddData(uBarrierContext *context, const void *data, uint32_t size)
+{
+	memcpy(context->m_replyCur, data, size);
+	context->m_replyCur += size;
+}
+
+
+
+/**
+@brief Add uint32 to reply packet
+**/
+static void sAddUInt32(uBarrierContext *context, uint32_t value)
+{
+	sWireWrite4(context->m_replyCur, value);
+	context->m_replyCur += 4;
+}
+
+
+
+/**
+@brief Time the replies that just went out, @a start is when their send began
+**/
+static void sRepliesSent(uBarrierContext *context, uint64_t start)
+{
+	if (context->m_keepAliveReplyTime != 0)
+	{
+		sUpdateEstimate(&context->m_link.m_keepAliveReply, sTimeNs(context) - context->m_keepAliveReplyTime);
+		context->m_keepAliveReplyTime	= 0;
+		context->m_linkChanged			= UBARRIER_TRUE;
+	}
+	if (context->m_infoReplyPending)
+	{
+		context->m_infoSentTime		= start;
+		context->m_infoReplyPending	= UBARRIER_FALSE;
+	}
+}
+
+
+
+/**
+@brief Send all reply packets that have been built so far
+**/
+static uBarrierBool sFlushReplies(uBarrierContext *context)
+{
+	uint32_t	reply_len	= (uint32_t)(context->m_replyPacket - context->m_replyBuffer);	/* Total size of finished replies */
+	uBarrierBool ret		= UBARRIER_TRUE;
+
+	// Send replies
+	if (reply_len != 0)
+	{
+		uint64_t start = sTimeNs(context);
+		ret = context->m_sendFunc(context->m_cookie, context->m_replyBuffer, reply_len);
+		sRecordLatency(context, UBARRIER_HISTOGRAM_SEND, start);
+		context->m_stats.m_numSends++;
+		context->m_stats.m_numBytesSent += reply_len;
+		context->m_statsChanged = UBARRIER_TRUE;
+		if (ret)
+			sRepliesSent(context, start);
+	}
+
+	// Reset reply buffer write pointer
+	context->m_replyPacket	= context->m_replyBuffer;
+	context->m_replyCur		= context->m_replyBuffer+4;
+	return ret;
+}
+
+
+
+/**
+@brief Send reply packet
+
+When replies are batched the packet is only finished and stays in the reply buffer until the end of the
+receive batch, unless the buffer is running out of space.
+**/
+static uBarrierBool sSendReply(uBarrierContext *context)
+{
+	// Set header size
+	uint8_t		*reply_buf	= context->m_replyPacket;
+	uint32_t	reply_len	= (uint32_t)(context->m_replyCur - reply_buf);				/* Total size of reply */
+	uint32_t	body_len	= reply_len - 4;											/* Size of body */
+	reply_buf[0] = (uint8_t)(body_len >> 24);
+	reply_buf[1] = (uint8_t)(body_len >> 16);
+	reply_buf[2] = (uint8_t)(body_len >> 8);
+	reply_buf[3] = (uint8_t)body_len;
+	context->m_stats.m_numReplies++;
+
+	// Start the next reply behind this one
+	context->m_replyPacket	= context->m_replyCur;
+	context->m_replyCur		+= 4;
+
+	// Send now unless there's room left to batch another reply
+	if (context->m_batchReplies && context->m_replyBuffer + context->m_replyBufferSize - context->m_replyPacket >= UBARRIER_REPLY_BATCH_RESERVE)
+		return UBARRIER_TRUE;
+	return sFlushReplies(context);
+}
+
+
+
+/**
+@brief Claim the next slot of the event ring, 0L if the ring is full and the event is dropped
+**/
+static uBarrierEvent *sBeginEvent(uBarrierContext *context, enum uBarrierEventType type)
+{
+	uBarrierEvent *event;
+	uint32_t head = context->m_eventHead;
+	if (head - context->m_eventTail >= context->m_eventRingSize)
+	{
+		context->m_stats.m_numEventsDropped++;
+		context->m_statsChanged = UBARRIER_TRUE;
+		return 0L;
+	}
+	event = &context->m_eventRing[head & (context->m_eventRingSize-1)];
+	event->m_time	= context->m_eventTime;
+	event->m_type	= (uint32_t)type;
+	return event;
+}
+
+
+
+/**
+@brief Publish the event claimed with sBeginEvent
+**/
+static void sEndEvent(uBarrierContext *context)
+{
+	// Publish the event after its contents
+	UBARRIER_MEMORY_BARRIER();
+	context->m_eventHead = context->m_eventHead+1;
+	context->m_eventsPending = UBARRIER_TRUE;
+	context->m_stats.m_numEventsQueued++;
+	context->m_statsChanged = UBARRIER_TRUE;
+}
+
+
+
+/**
+@brief Call mouse callback after a mouse event
+**/
+static void sSendMouseCallback(uBarrierContext *context)
+{
+	uint64_t start;
+
+	// Skip if no callback is installed
+	if (context->m_mouseCallback == 0L)
+		return;
+
+	// Send callback
+	start = sTimeNs(context);
+	context->m_mouseCallback(context->m_cookie, context->m_mouseX, context->m_mouseY, context->m_mouseWheelX,
+		context->m_mouseWheelY, context->m_mouseButtonLeft, context->m_mouseButtonRight, context->m_mouseButtonMiddle);
+	sRecordLatency(context, UBARRIER_HISTOGRAM_CALLBACK, start);
+}
+
+
+
+/**
+@brief Tell the consumer of the event ring about the events written since the last call
+**/
+static void sEventsReady(uBarrierContext *context)
+{
+	if (!context->m_eventsPending)
+		return;
+	context->m_eventsPending = UBARRIER_FALSE;
+	if (context->m_eventsReadyCallback != 0L)
+		context->m_eventsReadyCallback(context->m_cookie);
+}
+
+
+
+/**
+@brief Deliver the mouse position after a move
+**/
+static void sSendMouseMove(uBarrierContext *context)
+{
+	uBarrierEvent *event;
+	if (context->m_eventRing == 0L)
+	{
+		sSendMouseCallback(context);
+		return;
+	}
+	if ((event = sBeginEvent(context, UBARRIER_EVENT_MOUSE_MOVE)) == 0L)
+		return;
+	event->m_data.m_move.m_x = context->m_mouseX;
+	event->m_data.m_move.m_y = context->m_mouseY;
+	sEndEvent(context);
+}
+
+
+
+/**
+@brief Deliver a mouse move that was held back for coalescing
+**/
+static void sFlushMouseMove(uBarrierContext *context)
+{
+	context->m_mouseMovePending = UBARRIER_FALSE;
+	sSendMouseMove(context);
+}
+
+
+
+/**
+@brief Deliver the whole pixels of the summed relative mouse moves, keeping the fraction for later
+**/
+static void sFlushMouseRelative(uBarrierContext *context)
+{
+	// Arithmetic shifts round towards negative infinity, so the kept fraction is never negative
+	int32_t dx = (int32_t)(context->m_mouseRelativeX >> 16);
+	int32_t dy = (int32_t)(context->m_mouseRelativeY >> 16);
+	context->m_mouseRelativeX -= (int64_t)dx * 65536;
+	context->m_mouseRelativeY -= (int64_t)dy * 65536;
+	context->m_mouseRelativePending = UBARRIER_FALSE;
+	if (dx == 0 && dy == 0)
+		return;
+
+	if (context->m_eventRing != 0L)
+	{
+		uBarrierEvent *event = sBeginEvent(context, UBARRIER_EVENT_MOUSE_RELATIVE);
+		if (event == 0L)
+			return;
+		event->m_data.m_relative.m_dx = dx;
+		event->m_data.m_relative.m_dy = dy;
+		sEndEvent(context);
+	}
+	else if (context->m_mouseRelativeCallback != 0L)
+	{
+		uint64_t start = sTimeNs(context);
+		context->m_mouseRelativeCallback(context->m_cookie, dx, dy);
+		sRecordLatency(context, UBARRIER_HISTOGRAM_CALLBACK, start);
+	}
+	else
+	{
+		// Move the absolute position instead, within the screen
+		int32_t max_x = context->m_clientWidth != 0 ? context->m_clientWidth-1 : 0;
+		int32_t max_y = context->m_clientHeight != 0 ? context->m_clientHeight-1 : 0;
+		int32_t x = (int32_t)context->m_mouseX + dx;
+		int32_t y = (int32_t)context->m_mouseY + dy;
+		context->m_mouseX = (uint16_t)(x < 0 ? 0 : x > max_x ? max_x : x);
+		context->m_mouseY = (uint16_t)(y < 0 ? 0 : y > max_y ? max_y : y);
+		sSendMouseCallback(context);
+	}
+}
+
+
+
+/**
+@brief Send keyboard callback when a key has been pressed or released
+**/
+static void sSendKeyboardCallback(uBarrierContext *context, uint16_t key, uint16_t modifiers, uBarrierBool down, uint16_t repeat)
+{
+	uint64_t start;
+
+	// Queue an event instead
+	if (context->m_eventRing != 0L)
+	{
+		uBarrierEvent *event = sBeginEvent(context, UBARRIER_EVENT_KEY);
+		if (event == 0L)
+			return;
+		event->m_data.m_key.m_key		= key;
+		event->m_data.m_key.m_modifiers	= modifiers;
+		event->m_data.m_key.m_repeat	= repeat;
+		event->m_data.m_key.m_down		= down ? 1 : 0;
+		sEndEvent(context);
+		return;
+	}
+
+	// Skip if no callback is installed
+	if (context->m_keyboardCallback == 0L)
+		return;
+
+	// Send callback
+	start = sTimeNs(context);
+	context->m_keyboardCallback(context->m_cookie, key, modifiers, down, repeat);
+	sRecordLatency(context, UBARRIER_HISTOGRAM_CALLBACK, start);
+}
+
+
+
+/**
+@brief Does a key with Barrier key ID @a id repeat when held?
+
+Modifiers and locks don't, like on the server: shift, control, caps lock, meta, alt, super and hyper
+(0xEFE1 ... 0xEFEE), num lock, scroll lock and AltGr.
+**/
+static uBarrierBool sKeyRepeats(uint16_t id)
+{
+	if (id >= 0xEFE1 && id <= 0xEFEE)
+		return UBARRIER_FALSE;
+	return (id != 0xEF7F && id != 0xEF14 && id != 0xFE03) ? UBARRIER_TRUE : UBARRIER_FALSE;
+}
+
+
+
+/**
+@brief Send the local repeats of the held key that are due, as one callback
+**/
+static void sProcessKeyRepeat(uBarrierContext *context)
+{
+	uint32_t interval = context->m_keyRepeatInterval != 0 ? context->m_keyRepeatInterval : UBARRIER_KEY_REPEAT_INTERVAL;
+	int32_t late = (int32_t)(context->m_getTimeFunc() - context->m_keyRepeatTime);
+	uint32_t count;
+	if (late < 0)
+		return;
+
+	// Repeats missed while the thread was busy are counted instead of sent one by one
+	count = (uint32_t)late / interval + 1;
+	context->m_keyRepeatTime += count * interval;
+	sSendKeyboardCallback(context, context->m_keyRepeatKey, context->m_keyRepeatModifiers, UBARRIER_TRUE, (uint16_t)(count < 0xFFFF ? count : 0xFFFF));
+}
+
+
+
+/**
+@brief Send joystick callback
+**/
+static void sSendJoystickCallback(uBarrierContext *context, uint8_t joyNum)
+{
+	int8_t *sticks = context->m_joystickSticks[joyNum];
+	uint64_t start;
+
+	// Queue an event instead
+	if (context->m_eventRing != 0L)
+	{
+		uBarrierEvent *event = sBeginEvent(context, UBARRIER_EVENT_JOYSTICK);
+		if (event == 0L)
+			return;
+		event->m_data.m_joystick.m_joystick	= joyNum;
+		event->m_data.m_joystick.m_buttons	= context->m_joystickButtons[joyNum];
+		memcpy(event->m_data.m_joystick.m_sticks, sticks, sizeof(event->m_data.m_joystick.m_sticks));
+		sEndEvent(context);
+		return;
+	}
+
+	// Skip if no callback is installed
+	if (context->m_joystickCallback == 0L)
+		return;
+
+	// Send callback
+	start = sTimeNs(context);
+	context->m_joystickCallback(context->m_cookie, joyNum, context->m_joystickButtons[joyNum], sticks[0], sticks[1], sticks[2], sticks[3]);
+	sRecordLatency(context, UBARRIER_HISTOGRAM_CALLBACK, start);
+}
+
+
+
+/**
+@brief Send screen active callback when the screen was entered or left
+**/
+static void sSendScreenActive(uBarrierContext *context, uBarrierBool active)
+{
+	uint64_t start;
+
+	// Queue an event instead
+	if (context->m_eventRing != 0L)
+	{
+		uBarrierEvent *event = sBeginEvent(context, UBARRIER_EVENT_SCREEN);
+		if (event == 0L)
+			return;
+		event->m_data.m_screen.m_active = active ? 1 : 0;
+		sEndEvent(context);
+		return;
+	}
+
+	// Skip if no callback is installed
+	if (context->m_screenActiveCallback == 0L)
+		return;
+
+	// Send callback
+	start = sTimeNs(context);
+	context->m_screenActiveCallback(context->m_cookie, active);
+	sRecordLatency(context, UBARRIER_HISTOGRAM_CALLBACK, start);
+}
+
+
+
+/**
+@brief Deliver a mouse button change
+**/
+static void sSendMouseButton(uBarrierContext *context, uint8_t button, uBarrierBool down)
+{
+	uBarrierEvent *event;
+	if (context->m_eventRing == 0L)
+	{
+		sSendMouseCallback(context);
+		return;
+	}
+	if ((event = sBeginEvent(context, UBARRIER_EVENT_MOUSE_BUTTON)) == 0L)
+		return;
+	event->m_data.m_button.m_x		= context->m_mouseX;
+	event->m_data.m_button.m_y		= context->m_mouseY;
+	event->m_data.m_button.m_button	= button;
+	event->m_data.m_button.m_down	= down ? 1 : 0;
+	sEndEvent(context);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Clipboard decoder
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Clipboard chunk marks used by protocol 1.6 and later, DCLP%1i%4i%1i%s
+**/
+#define UBARRIER_CLIPBOARD_MARK_START	1				/* Data is the marshalled clipboard size as a decimal string */
+#define UBARRIER_CLIPBOARD_MARK_DATA	2				/* Data is the next piece of the marshalled clipboard */
+#define UBARRIER_CLIPBOARD_MARK_END		3				/* Marshalled clipboard is complete, no data */
+
+
+
+/**
+@brief Clipboard decoder states
+**/
+enum
+{
+	CLIPBOARD_IDLE,										/* No clipboard transfer in progress */
+	CLIPBOARD_COUNT,									/* Expecting the format count */
+	CLIPBOARD_HEADER,									/* Expecting a format header (format and size) */
+	CLIPBOARD_DATA,										/* Expecting format data */
+	CLIPBOARD_DONE,										/* All formats decoded */
+};
+
+
+
+/**
+@brief Length of the DCLP header between the message ID and the clipboard data, message ID included
+**/
+static uint32_t sClipboardHeaderLength(const uBarrierContext *context)
+{
+	//		kMsgDClipboard		= "DCLP%1i%4i%1i%s"	(1.6)
+	//		kMsgDClipboard1_0	= "DCLP%1i%4i%s"
+	return context->m_protocolMinor >= 6 ? UBARRIER_WIRE_LENGTH_DCLP : UBARRIER_WIRE_LENGTH_DCLP_1_0;
+}
+
+
+
+/**
+@brief Decode the header of a DCLP packet of @a length bytes, returns UBARRIER_FALSE if it contradicts @a length
+
+Only the header has to be in the buffer. Before protocol 1.6 there is no chunk mark, @a chunk gets
+UBARRIER_CLIPBOARD_MARK_DATA then.
+**/
+static uBarrierBool sDecodeClipboardHeader(const uBarrierContext *context, const uint8_t *message, uint32_t length, sMessageDCLP *chunk)
+{
+	uint32_t header = sClipboardHeaderLength(context);
+	if (length < header)
+		return UBARRIER_FALSE;
+
+	if (context->m_protocolMinor < 6)
+	{
+		sMessageDCLP_1_0 clipboard;
+		sDecodeDCLP_1_0(message, &clipboard);
+		chunk->m_id			= clipboard.m_id;
+		chunk->m_sequence	= clipboard.m_sequence;
+		chunk->m_mark		= UBARRIER_CLIPBOARD_MARK_DATA;
+		chunk->m_size		= clipboard.m_size;
+	}
+	else
+		sDecodeDCLP(message, chunk);
+
+	// The string is the rest of the packet
+	return chunk->m_size == length - header ? UBARRIER_TRUE : UBARRIER_FALSE;
+}
+
+
+
+/**
+@brief Pass a clipboard chunk to the application
+**/
+static void sSendClipboardChunk(uBarrierContext *context, enum uBarrierClipboardChunk chunk, const uint8_t *data, uint32_t size)
+{
+	enum uBarrierClipboardFormat format = (enum uBarrierClipboardFormat)context->m_clipboardFormat;
+
+	if (context->m_clipboardChunkCallback != 0L)
+		context->m_clipboardChunkCallback(context->m_cookie, chunk, format, data, size, context->m_clipboardSize);
+	else if (context->m_clipboardCallback != 0L)
+	{
+		// The plain callback needs a format in one piece, which is the case whenever its packet fit the receive buffer
+		if (chunk == UBARRIER_CLIPBOARD_CHUNK_DATA && size == context->m_clipboardSize)
+			context->m_clipboardCallback(context->m_cookie, format, data, size);
+		else if (chunk == UBARRIER_CLIPBOARD_CHUNK_END && context->m_clipboardSize == 0)
+			context->m_clipboardCallback(context->m_cookie, format, data, 0);
+		else if (chunk == UBARRIER_CLIPBOARD_CHUNK_BEGIN && context->m_clipboardSize > context->m_receiveBufferSize)
+			sTrace(context, UBARRIER_TRACE_CLIPBOARD_TOO_LARGE, 0, 0);
+	}
+}
+
+
+
+/**
+@brief Start decoding a marshalled clipboard of @a expected bytes
+**/
+static void sResetClipboard(uBarrierContext *context, uint32_t expected)
+{
+	// A format that was cut short is dropped
+	if (context->m_clipboardState == CLIPBOARD_DATA)
+		sSendClipboardChunk(context, UBARRIER_CLIPBOARD_CHUNK_ABORT, 0L, 0);
+
+	context->m_clipboardState		= expected != 0 ? CLIPBOARD_COUNT : CLIPBOARD_IDLE;
+	context->m_clipboardExpected	= expected;
+	context->m_clipboardReceived	= 0;
+	context->m_clipboardHeaderFill	= 0;
+}
+
+
+
+/**
+@brief Give up on a clipboard whose contents contradict its size, the rest of it is ignored
+**/
+static void sMalformedClipboard(uBarrierContext *context, uint32_t announced, uint32_t left)
+{
+	context->m_stats.m_numMalformedPackets++;
+	sTrace(context, UBARRIER_TRACE_CLIPBOARD_MALFORMED, announced, left);
+	sResetClipboard(context, 0);
+}
+
+
+
+/**
+@brief Finish the current clipboard format
+**/
+static void sEndClipboardFormat(uBarrierContext *context)
+{
+	sSendClipboardChunk(context, UBARRIER_CLIPBOARD_CHUNK_END, 0L, 0);
+	if (context->m_eventRing != 0L)
+	{
+		uBarrierEvent *event = sBeginEvent(context, UBARRIER_EVENT_CLIPBOARD);
+		if (event != 0L)
+		{
+			event->m_data.m_clipboard.m_format	= context->m_clipboardFormat;
+			event->m_data.m_clipboard.m_size	= context->m_clipboardSize;
+			sEndEvent(context);
+		}
+	}
+	context->m_clipboardFormatsLeft--;
+	context->m_clipboardState = context->m_clipboardFormatsLeft != 0 ? CLIPBOARD_HEADER : CLIPBOARD_DONE;
+}
+
+
+
+/**
+@brief Decode the next piece of a marshalled clipboard
+
+The marshalled clipboard is a format count followed by a format header (format and size) and the data for
+every format. Pieces can be cut anywhere, headers that straddle two pieces are assembled in the context.
+Format data is passed on straight from @a data without copying it. The count and sizes are checked against
+the size of the marshalled clipboard before they are trusted, so the walk never goes past it.
+**/
+static void sFeedClipboard(uBarrierContext *context, const uint8_t *data, uint32_t size)
+{
+	// Nothing expected, ignore
+	if (context->m_clipboardState == CLIPBOARD_IDLE)
+		return;
+	if (size > context->m_clipboardExpected - context->m_clipboardReceived)
+	{
+		sMalformedClipboard(context, size, context->m_clipboardExpected - context->m_clipboardReceived);
+		return;
+	}
+
+	context->m_clipboardReceived += size;
+	while (size != 0)
+	{
+		// Bytes of the marshalled clipboard from here on
+		uint32_t left = context->m_clipboardExpected - context->m_clipboardReceived + size;
+
+		if (context->m_clipboardState == CLIPBOARD_DATA)
+		{
+			// Pass on as much format data as we have, limited by the chunk size
+			uint32_t piece = size < context->m_clipboardLeft ? size : context->m_clipboardLeft;
+			if (context->m_clipboardChunkCallback != 0L && context->m_clipboardChunkSize != 0 && piece > context->m_clipboardChunkSize)
+				piece = context->m_clipboardChunkSize;
+			sSendClipboardChunk(context, UBARRIER_CLIPBOARD_CHUNK_DATA, data, piece);
+			data += piece;
+			size -= piece;
+			context->m_clipboardLeft -= piece;
+			if (context->m_clipboardLeft == 0)
+				sEndClipboardFormat(context);
+		}
+		else if (context->m_clipboardState == CLIPBOARD_COUNT || context->m_clipboardState == CLIPBOARD_HEADER)
+		{
+			// Assemble format count or format header
+			uint32_t header_size = context->m_clipboardState == CLIPBOARD_COUNT ? 4 : 8;
+			uint32_t piece = header_size - context->m_clipboardHeaderFill;
+			if (piece > size)
+				piece = size;
+			memcpy(context->m_clipboardHeader + context->m_clipboardHeaderFill, data, piece);
+			context->m_clipboardHeaderFill += piece;
+			data += piece;
+			size -= piece;
+			if (context->m_clipboardHeaderFill != header_size)
+				break;
+			context->m_clipboardHeaderFill = 0;
+
+			left -= piece;
+			if (context->m_clipboardState == CLIPBOARD_COUNT)
+			{
+				// Every format takes at least its header
+				context->m_clipboardFormatsLeft = sWireRead4(context->m_clipboardHeader);
+				if (context->m_clipboardFormatsLeft > left/8)
+				{
+					sMalformedClipboard(context, context->m_clipboardFormatsLeft, left);
+					return;
+				}
+				context->m_clipboardState = context->m_clipboardFormatsLeft != 0 ? CLIPBOARD_HEADER : CLIPBOARD_DONE;
+			}
+			else
+			{
+				// The data has to leave room for the headers of the formats after it
+				context->m_clipboardFormat	= sWireRead4(context->m_clipboardHeader);
+				context->m_clipboardSize	= sWireRead4(context->m_clipboardHeader+4);
+				if (context->m_clipboardSize > left - (context->m_clipboardFormatsLeft-1)*8)
+				{
+					sMalformedClipboard(context, context->m_clipboardSize, left);
+					return;
+				}
+				context->m_clipboardLeft	= context->m_clipboardSize;
+				context->m_clipboardState	= CLIPBOARD_DATA;
+				sSendClipboardChunk(context, UBARRIER_CLIPBOARD_CHUNK_BEGIN, 0L, 0);
+				if (context->m_clipboardLeft == 0)
+					sEndClipboardFormat(context);
+			}
+		}
+		else
+		{
+			// Done, the size check above leaves nothing to ignore
+			break;
+		}
+	}
+}
+
+
+
+/**
+@brief Finish decoding a marshalled clipboard
+**/
+static void sFinishClipboard(uBarrierContext *context)
+{
+	if (context->m_clipboardReceived != context->m_clipboardExpected || (context->m_clipboardExpected != 0 && context->m_clipboardState != CLIPBOARD_DONE))
+		sTrace(context, UBARRIER_TRACE_CLIPBOARD_INCOMPLETE, context->m_clipboardReceived, context->m_clipboardExpected);
+	sResetClipboard(context, 0);
+}
+
+
+
+/**
+@brief Parse the decimal clipboard size sent with a START chunk
+**/
+static uint32_t sParseClipboardSize(const uint8_t *data, uint32_t size)
+{
+	uint32_t value = 0;
+	for (; size != 0 && *data >= '0' && *data <= '9'; size--)
+		value = value*10 + (*data++ - '0');
+	return value;
+}
+
+
+
+/**
+@brief Start streaming a packet that is too large for the receive buffer
+
+Clipboard data is decoded as it arrives, anything else is thrown away. Returns the number of bytes of
+@a packet that were consumed, 0 if more data is needed first.
+
+@param context		Context the packet was received on
+@param packet		Start of the packet, including the 4 byte length prefix
+@param length		Length of the packet, excluding the length prefix
+@param available	Number of bytes of the packet in the receive buffer
+**/
+static uint32_t sBeginStream(uBarrierContext *context, const uint8_t *packet, uint32_t length, uint32_t available)
+{
+	uint32_t		header		= sClipboardHeaderLength(context);
+	uBarrierBool	malformed	= UBARRIER_FALSE;
+	if (available < 4+header)
+		return 0;
+
+	// This packet ends any run of coalesced mouse moves
+	if (context->m_mouseMovePending)
+		sFlushMouseMove(context);
+	if (context->m_mouseRelativePending)
+		sFlushMouseRelative(context);
+
+	context->m_stats.m_numOversizedPackets++;
+	context->m_streamLeft			= length - (available-4);		/* length+4 could wrap */
+	context->m_streamToClipboard	= UBARRIER_FALSE;
+	context->m_streamEndsClipboard	= UBARRIER_FALSE;
+	if (memcmp(packet+4, "DCLP", 4)==0)
+	{
+		sMessageDCLP chunk;
+		if (!sDecodeClipboardHeader(context, packet, length, &chunk))
+			malformed = UBARRIER_TRUE;
+		else if (context->m_protocolMinor < 6)
+		{
+			// The whole clipboard in one packet
+			sResetClipboard(context, chunk.m_size);
+			context->m_streamToClipboard	= UBARRIER_TRUE;
+			context->m_streamEndsClipboard	= UBARRIER_TRUE;
+		}
+		else if (chunk.m_mark == UBARRIER_CLIPBOARD_MARK_DATA)
+		{
+			// One chunk of the clipboard
+			context->m_streamToClipboard	= UBARRIER_TRUE;
+		}
+	}
+
+	if (context->m_streamToClipboard)
+	{
+		context->m_stats.m_numPackets[UBARRIER_MESSAGE_DCLP]++;
+		sFeedClipboard(context, packet+4+header, available-4-header);
+	}
+	else if (malformed)
+		sMalformedPacket(context, packet, length);
+	else
+	{
+		context->m_stats.m_numOversizedDropped++;
+		sTrace(context, UBARRIER_TRACE_OVERSIZED_PACKET, sTraceType(packet, available-4), length);
+	}
+	return available;
+}
+
+
+
+/**
+@brief Pass the next received bytes of a streamed packet on, returns the number of bytes consumed
+**/
+static uint32_t sContinueStream(uBarrierContext *context, const uint8_t *data, uint32_t size)
+{
+	if (size > context->m_streamLeft)
+		size = context->m_streamLeft;
+	context->m_streamLeft -= size;
+
+	if (context->m_streamToClipboard)
+	{
+		sFeedClipboard(context, data, size);
+		if (context->m_streamLeft == 0 && context->m_streamEndsClipboard)
+			sFinishClipboard(context);
+
+		// Acknowledge like any other clipboard packet
+		if (context->m_streamLeft == 0)
+		{
+			context->m_replyCur = sEncodeCNOP(context->m_replyCur);
+			sSendReply(context);
+		}
+	}
+	return size;
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Message handlers
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Build a 32 bit message identifier from its four characters, in the order they appear on the wire
+**/
+#define UBARRIER_FOURCC(a, b, c, d)		(((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+
+
+/**
+@brief Maximum length of messages that end in a string or a list, their handlers check the length fields
+**/
+#define UBARRIER_LENGTH_UNLIMITED		0xffffffffu
+
+
+
+/**
+@brief Message handler
+
+@param context	Context the message was received on
+@param message	Start of the packet, including the 4 byte length prefix
+@param length	Length of the packet, excluding the length prefix
+**/
+typedef void (*sMessageHandler)(uBarrierContext *context, const uint8_t *message, uint32_t length);
+
+
+
+/**
+@brief Welcome message
+**/
+static void sHandleHello(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgHello			= "Barrier%2i%2i"
+	//		kMsgHelloBack		= "Barrier%2i%2i%s"
+	sMessageHELLO		hello;
+	sMessageHELLO_BACK	hello_back;
+	uint32_t			name_length = (uint32_t)strlen(context->m_clientName);
+	uint32_t			reply_length = 4+UBARRIER_WIRE_LENGTH_HELLO_BACK+name_length;
+	(void)length;
+	sDecodeHELLO(message, &hello);
+
+	// The reply buffer is sized at run time, a name that doesn't fit will never connect
+	if (reply_length > context->m_replyBufferSize)
+	{
+		sTrace(context, UBARRIER_TRACE_CLIENT_NAME_TOO_LONG, reply_length, context->m_replyBufferSize);
+		sDropConnection(context, UBARRIER_RECONNECT_DELAY_MAX);
+		return;
+	}
+
+	// Like the Barrier client, use the server's version if it is older than ours
+	context->m_protocolMinor = (hello.m_major == UBARRIER_PROTOCOL_MAJOR && hello.m_minor < UBARRIER_PROTOCOL_MINOR) ? hello.m_minor : UBARRIER_PROTOCOL_MINOR;
+
+	hello_back.m_major		= UBARRIER_PROTOCOL_MAJOR;
+	hello_back.m_minor		= context->m_protocolMinor;
+	hello_back.m_nameLength	= name_length;
+	context->m_replyCur = sEncodeHELLO_BACK(context->m_replyCur, &hello_back);
+	sAddData(context, context->m_clientName, name_length);
+	if (!sSendReply(context) || !sFlushReplies(context))
+	{
+		// Send reply failed, let's try to reconnect
+		sTrace(context, UBARRIER_TRACE_SEND_REPLY_FAILED, 0, 0);
+		sDropConnection(context, 0);
+	}
+	else
+	{
+		// Let's assume we're connected
+		sTrace(context, UBARRIER_TRACE_CONNECTED, 0, 0);
+		context->m_hasReceivedHello		= UBARRIER_TRUE;
+		context->m_lastMessageTime		= context->m_getTimeFunc();
+		context->m_reconnectAttempts	= 0;
+		memset(&context->m_link, 0, sizeof(context->m_link));
+		context->m_linkChanged			= UBARRIER_TRUE;
+	}
+}
+
+
+
+/**
+@brief Screen info query, reply with DINF
+**/
+static void sHandleQINF(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgQInfo			= "QINF"
+	//		kMsgDInfo			= "DINF%2i%2i%2i%2i%2i%2i%2i"
+	sMessageDINF info;
+	(void)message; (void)length;
+	info.m_x		= 0;
+	info.m_y		= 0;
+	info.m_width	= context->m_clientWidth;
+	info.m_height	= context->m_clientHeight;
+	info.m_warp		= 0;
+	info.m_mouseX	= 0;		// mx?
+	info.m_mouseY	= 0;		// my?
+	context->m_replyCur = sEncodeDINF(context->m_replyCur, &info);
+	context->m_infoReplyPending = UBARRIER_TRUE;
+	sSendReply(context);
+}
+
+
+
+/**
+@brief Screen info acknowledged, the one reply the server sends to the client
+**/
+static void sHandleCIAK(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgCInfoAck		= "CIAK"
+	(void)message; (void)length;
+	if (context->m_infoSentTime != 0 && context->m_eventTime > context->m_infoSentTime)
+	{
+		sUpdateEstimate(&context->m_link.m_roundTrip, context->m_eventTime - context->m_infoSentTime);
+		context->m_linkChanged = UBARRIER_TRUE;
+	}
+	context->m_infoSentTime = 0;
+}
+
+
+
+/**
+@brief Set the server options to their defaults
+**/
+static void sResetOptions(uBarrierContext *context)
+{
+	context->m_optionHeartbeatSet			= UBARRIER_FALSE;
+	context->m_optionHeartbeat				= 0;
+	context->m_optionScreenSaverSync		= UBARRIER_FALSE;
+	context->m_optionClipboardSharing		= UBARRIER_TRUE;
+	context->m_optionRelativeMouseMoves		= UBARRIER_FALSE;
+	context->m_optionHalfDuplex				= 0;
+}
+
+
+
+/**
+@brief Turn half duplex handling of a lock key on or off
+**/
+static void sSetHalfDuplex(uBarrierContext *context, uint16_t lock, uint32_t value)
+{
+	if (value != 0)
+		context->m_optionHalfDuplex |= lock;
+	else
+		context->m_optionHalfDuplex &= (uint16_t)~lock;
+}
+
+
+
+/**
+@brief Reset options
+**/
+static void sHandleCROP(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgCResetOptions	= "CROP"
+	(void)message; (void)length;
+	sResetOptions(context);
+}
+
+
+
+/**
+@brief Set options
+**/
+static void sHandleDSOP(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDSetOptions		= "DSOP%4I"
+	// A list of option ID and value pairs, options we don't know are skipped
+	sMessageDSOP	options;
+	uint32_t		list_length = length - UBARRIER_WIRE_LENGTH_DSOP;
+	uint32_t		i;
+	sDecodeDSOP(message, &options);
+
+	// The list fills the rest of the packet with whole pairs
+	if (list_length % 8 != 0 || options.m_count != list_length/4)
+	{
+		sMalformedPacket(context, message, length);
+		return;
+	}
+	for (i = 0; i < options.m_count; i += 2)
+	{
+		const uint8_t *option = message + 4 + UBARRIER_WIRE_LENGTH_DSOP + i*4;
+		uint32_t value = sWireRead4(option+4);
+		switch (sWireRead4(option))
+		{
+			case UBARRIER_FOURCC('H','A','R','T'):
+				// Values up to 0 turn the keep alives off
+				context->m_optionHeartbeatSet	= UBARRIER_TRUE;
+				context->m_optionHeartbeat		= (int32_t)value > 0 ? value : 0;
+				break;
+			case UBARRIER_FOURCC('S','S','V','R'):	context->m_optionScreenSaverSync	= value != 0 ? UBARRIER_TRUE : UBARRIER_FALSE;		break;
+			case UBARRIER_FOURCC('C','L','P','S'):	context->m_optionClipboardSharing	= value != 0 ? UBARRIER_TRUE : UBARRIER_FALSE;		break;
+			case UBARRIER_FOURCC('M','D','L','T'):	context->m_optionRelativeMouseMoves	= value != 0 ? UBARRIER_TRUE : UBARRIER_FALSE;		break;
+			case UBARRIER_FOURCC('H','D','C','L'):	sSetHalfDuplex(context, UBARRIER_MODIFIER_CAPSLOCK, value);								break;
+			case UBARRIER_FOURCC('H','D','N','L'):	sSetHalfDuplex(context, UBARRIER_MODIFIER_NUMLOCK, value);								break;
+			case UBARRIER_FOURCC('H','D','S','L'):	sSetHalfDuplex(context, UBARRIER_MODIFIER_SCROLLOCK, value);							break;
+		}
+	}
+}
+
+
+
+/**
+@brief Screen enter
+**/
+static void sHandleCINN(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgCEnter 			= "CINN%2i%2i%4i%2i"
+	sMessageCINN enter;
+	(void)length;
+	sDecodeCINN(message, &enter);
+
+	// Obtain the Barrier sequence number
+	context->m_sequenceNumber = enter.m_sequence;
+	context->m_isCaptured = UBARRIER_TRUE;
+	sSendScreenActive(context, UBARRIER_TRUE);
+}
+
+
+
+/**
+@brief Screen leave
+**/
+static void sHandleCOUT(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgCLeave 			= "COUT"
+	(void)message; (void)length;
+	context->m_isCaptured		= UBARRIER_FALSE;
+	context->m_keyRepeatActive	= UBARRIER_FALSE;
+	sSendScreenActive(context, UBARRIER_FALSE);
+}
+
+
+
+/**
+@brief Mouse down
+**/
+static void sHandleDMDN(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDMouseDown		= "DMDN%1i"
+	sMessageDMDN button;
+	(void)length;
+	sDecodeDMDN(message, &button);
+	if (button.m_button==UBARRIER_MOUSE_BUTTON_RIGHT)
+		context->m_mouseButtonRight		= UBARRIER_TRUE;
+	else if (button.m_button==UBARRIER_MOUSE_BUTTON_MIDDLE)
+		context->m_mouseButtonMiddle	= UBARRIER_TRUE;
+	else
+	{
+		context->m_mouseButtonLeft		= UBARRIER_TRUE;
+		button.m_button					= UBARRIER_MOUSE_BUTTON_LEFT;
+	}
+	sSendMouseButton(context, (uint8_t)button.m_button, UBARRIER_TRUE);
+}
+
+
+
+/**
+@brief Mouse up
+**/
+static void sHandleDMUP(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDMouseUp		= "DMUP%1i"
+	sMessageDMUP button;
+	(void)length;
+	sDecodeDMUP(message, &button);
+	if (button.m_button==UBARRIER_MOUSE_BUTTON_RIGHT)
+		context->m_mouseButtonRight		= UBARRIER_FALSE;
+	else if (button.m_button==UBARRIER_MOUSE_BUTTON_MIDDLE)
+		context->m_mouseButtonMiddle	= UBARRIER_FALSE;
+	else
+	{
+		context->m_mouseButtonLeft		= UBARRIER_FALSE;
+		button.m_button					= UBARRIER_MOUSE_BUTTON_LEFT;
+	}
+	sSendMouseButton(context, (uint8_t)button.m_button, UBARRIER_FALSE);
+}
+
+
+
+/**
+@brief Mouse move
+**/
+static void sHandleDMMV(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDMouseMove		= "DMMV%2i%2i"
+	sMessageDMMV move;
+	(void)length;
+	sDecodeDMMV(message, &move);
+	context->m_mouseX = move.m_x;
+	context->m_mouseY = move.m_y;
+
+	// When coalescing, only the last position of a run of moves is delivered
+	if (context->m_coalesceMouseMoves)
+	{
+		if (context->m_mouseMovePending)
+			context->m_stats.m_numMouseMovesCoalesced++;
+		context->m_mouseMovePending = UBARRIER_TRUE;
+	}
+	else
+		sSendMouseMove(context);
+}
+
+
+
+/**
+@brief Relative mouse move
+**/
+static void sHandleDMRM(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDMouseRelMove	= "DMRM%2i%2i"
+	int64_t			scale = context->m_mouseRelativeScale != 0 ? context->m_mouseRelativeScale : 65536;
+	sMessageDMRM	move;
+	(void)length;
+	sDecodeDMRM(message, &move);
+	context->m_mouseRelativeX += move.m_x * scale;
+	context->m_mouseRelativeY += move.m_y * scale;
+
+	// When coalescing, a run of moves is summed up and delivered once
+	if (context->m_coalesceMouseMoves)
+	{
+		if (context->m_mouseRelativePending)
+			context->m_stats.m_numMouseMovesCoalesced++;
+		context->m_mouseRelativePending = UBARRIER_TRUE;
+	}
+	else
+		sFlushMouseRelative(context);
+}
+
+
+
+/**
+@brief Mouse wheel
+**/
+static void sHandleDMWM(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDMouseWheel		= "DMWM%2i%2i"
+	//		kMsgDMouseWheel1_0	= "DMWM%2i"
+	sMessageDMWM wheel;
+	(void)length;
+	sDecodeDMWM(message, &wheel);
+	context->m_mouseWheelX += wheel.m_x;
+	context->m_mouseWheelY += wheel.m_y;
+	if (context->m_eventRing != 0L)
+	{
+		uBarrierEvent *event = sBeginEvent(context, UBARRIER_EVENT_MOUSE_WHEEL);
+		if (event == 0L)
+			return;
+		event->m_data.m_wheel.m_dx = wheel.m_x;
+		event->m_data.m_wheel.m_dy = wheel.m_y;
+		sEndEvent(context);
+	}
+	else
+		sSendMouseCallback(context);
+}
+
+
+
+/**
+@brief Key down
+**/
+static void sHandleDKDN(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDKeyDown		= "DKDN%2i%2i%2i"
+	//		kMsgDKeyDown1_0		= "DKDN%2i%2i"
+	sMessageDKDN key;
+	(void)length;
+	sDecodeDKDN(message, &key);
+	sSendKeyboardCallback(context, key.m_button, key.m_mask, UBARRIER_TRUE, 0);
+
+	// The last key pressed repeats, until it is released
+	if (context->m_localKeyRepeat && sKeyRepeats(key.m_id))
+	{
+		context->m_keyRepeatActive		= UBARRIER_TRUE;
+		context->m_keyRepeatKey			= key.m_button;
+		context->m_keyRepeatModifiers	= key.m_mask;
+		context->m_keyRepeatTime		= context->m_getTimeFunc() + (context->m_keyRepeatDelay != 0 ? context->m_keyRepeatDelay : UBARRIER_KEY_REPEAT_DELAY);
+	}
+}
+
+
+
+/**
+@brief Key repeat
+**/
+static void sHandleDKRP(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDKeyRepeat		= "DKRP%2i%2i%2i%2i"
+	//		kMsgDKeyRepeat1_0	= "DKRP%2i%2i%2i"
+	sMessageDKRP key;
+	(void)length;
+
+	// Held keys repeat locally, the server's repeats would double them
+	if (context->m_localKeyRepeat)
+		return;
+	sDecodeDKRP(message, &key);
+	sSendKeyboardCallback(context, key.m_button, key.m_mask, UBARRIER_TRUE, key.m_count != 0 ? key.m_count : 1);
+}
+
+
+
+/**
+@brief Key up
+**/
+static void sHandleDKUP(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDKeyUp			= "DKUP%2i%2i%2i"
+	//		kMsgDKeyUp1_0		= "DKUP%2i%2i"
+	sMessageDKUP key;
+	(void)length;
+	sDecodeDKUP(message, &key);
+	if (context->m_keyRepeatActive && key.m_button == context->m_keyRepeatKey)
+		context->m_keyRepeatActive = UBARRIER_FALSE;
+	sSendKeyboardCallback(context, key.m_button, key.m_mask, UBARRIER_FALSE, 0);
+}
+
+
+
+/**
+@brief Joystick buttons
+**/
+static void sHandleDGBT(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDGameButtons	= "DGBT%1i%2i";
+	sMessageDGBT buttons;
+	(void)length;
+	sDecodeDGBT(message, &buttons);
+	if (buttons.m_joystick<UBARRIER_NUM_JOYSTICKS)
+	{
+		// Copy button state, then send callback
+		context->m_joystickButtons[buttons.m_joystick] = buttons.m_buttons;
+		sSendJoystickCallback(context, buttons.m_joystick);
+	}
+}
+
+
+
+/**
+@brief Joystick sticks
+**/
+static void sHandleDGST(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDGameSticks		= "DGST%1i%1i%1i%1i%1i";
+	sMessageDGST sticks;
+	(void)length;
+	sDecodeDGST(message, &sticks);
+	if (sticks.m_joystick<UBARRIER_NUM_JOYSTICKS)
+	{
+		// Copy stick state, then send callback
+		int8_t *stick = context->m_joystickSticks[sticks.m_joystick];
+		stick[0] = sticks.m_x1;
+		stick[1] = sticks.m_y1;
+		stick[2] = sticks.m_x2;
+		stick[3] = sticks.m_y2;
+		sSendJoystickCallback(context, sticks.m_joystick);
+	}
+}
+
+
+
+/**
+@brief Keepalive, reply with CALV and then CNOP
+**/
+static void sHandleCALV(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgCKeepAlive		= "CALV"
+	(void)message; (void)length;
+	if (context->m_eventTime != 0)
+	{
+		if (context->m_keepAliveTime != 0)
+		{
+			sUpdateEstimate(&context->m_link.m_keepAliveInterval, context->m_eventTime - context->m_keepAliveTime);
+			context->m_linkChanged = UBARRIER_TRUE;
+		}
+		context->m_keepAliveTime		= context->m_eventTime;
+		context->m_keepAliveReplyTime	= context->m_eventTime;
+	}
+	context->m_replyCur = sEncodeCALV(context->m_replyCur);
+	sSendReply(context);
+}
+
+
+
+/**
+@brief Clipboard message
+**/
+static void sHandleDCLP(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgDClipboard		= "DCLP%1i%4i%1i%s"	(1.6)
+	//		kMsgDClipboard1_0	= "DCLP%1i%4i%s"
+	//
+	// The clipboard message contains:
+	//		1 uint32:	The size of the message
+	//		4 chars: 	The identifier ("DCLP")
+	//		1 uint8: 	The clipboard index
+	//		1 uint32:	The sequence number. It's zero, because this message is always coming from the server?
+	//		1 uint8:	Since protocol 1.6, the chunk mark (start, data or end)
+	//		1 uint32:	The total size of the remaining 'string' (as per the Barrier %s string format (which is 1 uint32 for size followed by a char buffer (not necessarily null terminated)).
+	//
+	// Before protocol 1.6 the string is the marshalled clipboard. Since 1.6 the marshalled clipboard is sent
+	// in chunks: a start chunk with its size as a decimal string, data chunks and an end chunk. The marshalled
+	// clipboard contains:
+	//		1 uint32:	The number of formats present in the message
+	// And then 'number of formats' times the following:
+	//		1 uint32:	The format of the clipboard data
+	//		1 uint32:	The size n of the clipboard data
+	//		n uint8:	The clipboard data
+	const uint8_t *	data	= message+4+sClipboardHeaderLength(context);
+	sMessageDCLP	chunk;
+	if (!sDecodeClipboardHeader(context, message, length, &chunk))
+	{
+		sMalformedPacket(context, message, length);
+		return;
+	}
+
+	if (context->m_protocolMinor < 6)
+	{
+		sResetClipboard(context, chunk.m_size);
+		sFeedClipboard(context, data, chunk.m_size);
+		sFinishClipboard(context);
+	}
+	else if (chunk.m_mark == UBARRIER_CLIPBOARD_MARK_START)
+		sResetClipboard(context, sParseClipboardSize(data, chunk.m_size));
+	else if (chunk.m_mark == UBARRIER_CLIPBOARD_MARK_DATA)
+		sFeedClipboard(context, data, chunk.m_size);
+	else if (chunk.m_mark == UBARRIER_CLIPBOARD_MARK_END)
+		sFinishClipboard(context);
+}
+
+
+
+/**
+@brief Server shutting down
+**/
+static void sHandleCBYE(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgCClose 			= "CBYE"
+	(void)message; (void)length;
+	sTrace(context, UBARRIER_TRACE_SERVER_DISCONNECTING, 0, 0);
+	sDropConnection(context, 0);
+}
+
+
+
+/**
+@brief Client is unknown to the server
+**/
+static void sHandleEUNK(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgEUnknown		= "EUNK"
+	(void)message; (void)length;
+	// Retrying won't help until the server configuration changes, so don't retry often
+	sTrace(context, UBARRIER_TRACE_CLIENT_UNKNOWN, 0, 0);
+	sDropConnection(context, context->m_reconnectDelayMax != 0 ? context->m_reconnectDelayMax : UBARRIER_RECONNECT_DELAY_MAX);
+}
+
+
+
+/**
+@brief Client name is already in use
+**/
+static void sHandleEBSY(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgEBusy			= "EBSY"
+	(void)message; (void)length;
+	// Usually our own previous connection, which the server drops once it misses its keep alives
+	sTrace(context, UBARRIER_TRACE_CLIENT_BUSY, 0, 0);
+	sDropConnection(context, UBARRIER_RECONNECT_DELAY_BUSY);
+}
+
+
+
+/**
+@brief Protocol versions are incompatible
+**/
+static void sHandleEICV(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgEIncompatible	= "EICV%2i%2i"
+	sMessageEICV versions;
+	(void)length;
+	sDecodeEICV(message, &versions);
+	sTrace(context, UBARRIER_TRACE_PROTOCOL_INCOMPATIBLE, versions.m_major, versions.m_minor);
+	sDropConnection(context, context->m_reconnectDelayMax != 0 ? context->m_reconnectDelayMax : UBARRIER_RECONNECT_DELAY_MAX);
+}
+
+
+
+/**
+@brief Server didn't understand us
+**/
+static void sHandleEBAD(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	//		kMsgEBad			= "EBAD"
+	(void)message; (void)length;
+	sTrace(context, UBARRIER_TRACE_PROTOCOL_ERROR, 0, 0);
+	sDropConnection(context, 0);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Message dispatch
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Message type descriptor
+**/
+typedef struct
+{
+	sMessageHandler		m_handler;			/* Handler function */
+	uint32_t			m_minLength;		/* Minimum packet length, message ID included, length prefix excluded */
+	uint32_t			m_maxLength;		/* Maximum packet length, the same for messages of a fixed size */
+	uBarrierBool		m_replyNop;			/* Reply with CNOP after the handler ran? */
+} sMessageType;
+
+
+
+/**
+@brief Message type table, indexed by enum uBarrierMessageType
+**/
+static const sMessageType s_messageTypes[] =
+{
+	/* Handler				Min length								Max length								Reply CNOP */
+	{ sHandleHello,			UBARRIER_WIRE_LENGTH_HELLO,				UBARRIER_WIRE_LENGTH_HELLO,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_HELLO */
+	{ sHandleQINF,			UBARRIER_WIRE_LENGTH_QINF,				UBARRIER_WIRE_LENGTH_QINF,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_QINF */
+	{ sHandleCIAK,			UBARRIER_WIRE_LENGTH_CIAK,				UBARRIER_WIRE_LENGTH_CIAK,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_CIAK */
+	{ sHandleCROP,			UBARRIER_WIRE_LENGTH_CROP,				UBARRIER_WIRE_LENGTH_CROP,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_CROP */
+	{ sHandleCINN,			UBARRIER_WIRE_LENGTH_CINN,				UBARRIER_WIRE_LENGTH_CINN,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_CINN */
+	{ sHandleCOUT,			UBARRIER_WIRE_LENGTH_COUT,				UBARRIER_WIRE_LENGTH_COUT,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_COUT */
+	{ sHandleDMDN,			UBARRIER_WIRE_LENGTH_DMDN,				UBARRIER_WIRE_LENGTH_DMDN,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DMDN */
+	{ sHandleDMUP,			UBARRIER_WIRE_LENGTH_DMUP,				UBARRIER_WIRE_LENGTH_DMUP,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DMUP */
+	{ sHandleDMMV,			UBARRIER_WIRE_LENGTH_DMMV,				UBARRIER_WIRE_LENGTH_DMMV,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DMMV */
+	{ sHandleDMRM,			UBARRIER_WIRE_LENGTH_DMRM,				UBARRIER_WIRE_LENGTH_DMRM,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DMRM */
+	{ sHandleDMWM,			UBARRIER_WIRE_LENGTH_DMWM,				UBARRIER_WIRE_LENGTH_DMWM,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DMWM */
+	{ sHandleDKDN,			UBARRIER_WIRE_LENGTH_DKDN,				UBARRIER_WIRE_LENGTH_DKDN,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DKDN */
+	{ sHandleDKRP,			UBARRIER_WIRE_LENGTH_DKRP,				UBARRIER_WIRE_LENGTH_DKRP,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DKRP */
+	{ sHandleDKUP,			UBARRIER_WIRE_LENGTH_DKUP,				UBARRIER_WIRE_LENGTH_DKUP,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DKUP */
+	{ sHandleDGBT,			UBARRIER_WIRE_LENGTH_DGBT,				UBARRIER_WIRE_LENGTH_DGBT,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DGBT */
+	{ sHandleDGST,			UBARRIER_WIRE_LENGTH_DGST,				UBARRIER_WIRE_LENGTH_DGST,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DGST */
+	{ sHandleDSOP,			UBARRIER_WIRE_LENGTH_DSOP,				UBARRIER_LENGTH_UNLIMITED,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DSOP */
+	{ sHandleCALV,			UBARRIER_WIRE_LENGTH_CALV,				UBARRIER_WIRE_LENGTH_CALV,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_CALV */
+	{ sHandleDCLP,			UBARRIER_WIRE_LENGTH_DCLP_1_0,			UBARRIER_LENGTH_UNLIMITED,				UBARRIER_TRUE },	/* UBARRIER_MESSAGE_DCLP */
+	{ sHandleCBYE,			UBARRIER_WIRE_LENGTH_CBYE,				UBARRIER_WIRE_LENGTH_CBYE,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_CBYE */
+	{ sHandleEUNK,			UBARRIER_WIRE_LENGTH_EUNK,				UBARRIER_WIRE_LENGTH_EUNK,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_EUNK */
+	{ sHandleEBSY,			UBARRIER_WIRE_LENGTH_EBSY,				UBARRIER_WIRE_LENGTH_EBSY,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_EBSY */
+	{ sHandleEICV,			UBARRIER_WIRE_LENGTH_EICV,				UBARRIER_WIRE_LENGTH_EICV,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_EICV */
+	{ sHandleEBAD,			UBARRIER_WIRE_LENGTH_EBAD,				UBARRIER_WIRE_LENGTH_EBAD,				UBARRIER_FALSE },	/* UBARRIER_MESSAGE_EBAD */
+};
+
+
+
+/**
+@brief Look up the descriptor for a message, returns 0L for unknown messages
+
+The message ID is loaded once as a 32 bit integer and dispatched with a switch, which the compiler
+turns into a jump table or a short binary search instead of a chain of string compares.
+**/
+static const sMessageType *sFindMessageType(const uint8_t *message, uint32_t length)
+{
+	switch (sWireRead4(message+4))
+	{
+		case UBARRIER_FOURCC('D','M','M','V'):	return &s_messageTypes[UBARRIER_MESSAGE_DMMV];
+		case UBARRIER_FOURCC('D','M','R','M'):	return &s_messageTypes[UBARRIER_MESSAGE_DMRM];
+		case UBARRIER_FOURCC('D','M','D','N'):	return &s_messageTypes[UBARRIER_MESSAGE_DMDN];
+		case UBARRIER_FOURCC('D','M','U','P'):	return &s_messageTypes[UBARRIER_MESSAGE_DMUP];
+		case UBARRIER_FOURCC('D','M','W','M'):	return &s_messageTypes[UBARRIER_MESSAGE_DMWM];
+		case UBARRIER_FOURCC('D','K','D','N'):	return &s_messageTypes[UBARRIER_MESSAGE_DKDN];
+		case UBARRIER_FOURCC('D','K','R','P'):	return &s_messageTypes[UBARRIER_MESSAGE_DKRP];
+		case UBARRIER_FOURCC('D','K','U','P'):	return &s_messageTypes[UBARRIER_MESSAGE_DKUP];
+		case UBARRIER_FOURCC('C','A','L','V'):	return &s_messageTypes[UBARRIER_MESSAGE_CALV];
+		case UBARRIER_FOURCC('C','I','N','N'):	return &s_messageTypes[UBARRIER_MESSAGE_CINN];
+		case UBARRIER_FOURCC('C','O','U','T'):	return &s_messageTypes[UBARRIER_MESSAGE_COUT];
+		case UBARRIER_FOURCC('D','G','B','T'):	return &s_messageTypes[UBARRIER_MESSAGE_DGBT];
+		case UBARRIER_FOURCC('D','G','S','T'):	return &s_messageTypes[UBARRIER_MESSAGE_DGST];
+		case UBARRIER_FOURCC('D','C','L','P'):	return &s_messageTypes[UBARRIER_MESSAGE_DCLP];
+		case UBARRIER_FOURCC('D','S','O','P'):	return &s_messageTypes[UBARRIER_MESSAGE_DSOP];
+		case UBARRIER_FOURCC('Q','I','N','F'):	return &s_messageTypes[UBARRIER_MESSAGE_QINF];
+		case UBARRIER_FOURCC('C','I','A','K'):	return &s_messageTypes[UBARRIER_MESSAGE_CIAK];
+		case UBARRIER_FOURCC('C','R','O','P'):	return &s_messageTypes[UBARRIER_MESSAGE_CROP];
+		case UBARRIER_FOURCC('C','B','Y','E'):	return &s_messageTypes[UBARRIER_MESSAGE_CBYE];
+		case UBARRIER_FOURCC('E','U','N','K'):	return &s_messageTypes[UBARRIER_MESSAGE_EUNK];
+		case UBARRIER_FOURCC('E','B','S','Y'):	return &s_messageTypes[UBARRIER_MESSAGE_EBSY];
+		case UBARRIER_FOURCC('E','I','C','V'):	return &s_messageTypes[UBARRIER_MESSAGE_EICV];
+		case UBARRIER_FOURCC('E','B','A','D'):	return &s_messageTypes[UBARRIER_MESSAGE_EBAD];
+		case UBARRIER_FOURCC('B','a','r','r'):
+			// "Barrier" is the only message with an ID longer than four characters
+			if (length >= 7 && memcmp(message+8, "ier", 3)==0)
+				return &s_messageTypes[UBARRIER_MESSAGE_HELLO];
+			break;
+	}
+	return 0L;
+}
+
+
+
+/**
+@brief Parse a single client message, update state, send callbacks and send replies
+**/
+static void sProcessMessage(uBarrierContext *context, const uint8_t *message, uint32_t length)
+{
+	const sMessageType *type = length >= 4 ? sFindMessageType(message, length) : 0L;
+	if (type == 0L)
+	{
+		// Unknown packet, could be any of these
+		//		kMsgCNoop 			= "CNOP"
+		//		kMsgCClipboard 		= "CCLP%1i%4i"
+		//		kMsgCScreenSaver 	= "CSEC%1i"
+		context->m_stats.m_numPackets[UBARRIER_MESSAGE_UNKNOWN]++;
+		sTrace(context, UBARRIER_TRACE_UNKNOWN_PACKET, sTraceType(message, length), 0);
+		return;
+	}
+	context->m_stats.m_numPackets[type - s_messageTypes]++;
+
+	// One unsigned compare checks both ends, lengths below the minimum wrap around to large values
+	if (length - type->m_minLength > type->m_maxLength - type->m_minLength)
+	{
+		if (length < type->m_minLength)
+		{
+			// Too short to be decoded, don't read past its end
+			context->m_stats.m_numShortPackets++;
+			context->m_stats.m_numMalformedPackets++;
+			sTrace(context, UBARRIER_TRACE_SHORT_PACKET, sTraceType(message, length), length);
+		}
+		else
+			sMalformedPacket(context, message, length);
+		return;
+	}
+
+	// Any other message ends a run of coalesced mouse moves, so events stay in order
+	if (context->m_mouseMovePending && type != &s_messageTypes[UBARRIER_MESSAGE_DMMV])
+		sFlushMouseMove(context);
+	if (context->m_mouseRelativePending && type != &s_messageTypes[UBARRIER_MESSAGE_DMRM])
+		sFlushMouseRelative(context);
+
+	type->m_handler(context, message, length);
+
+	// Reply with CNOP maybe?
+	if (type->m_replyNop)
+	{
+		context->m_replyCur = sEncodeCNOP(context->m_replyCur);
+		sSendReply(context);
+	}
+}
+
+
+
+/**
+@brief Is a send queued by uBarrierQueueClipboard waiting?
+**/
+static uBarrierBool sSendQueued(const uBarrierContext *context)
+{
+	return context->m_sendQueueHead != context->m_sendQueueTail;
+}
+
+
+
+/**
+@brief Send the clipboards queued by uBarrierQueueClipboard
+
+Entries published by the queueing thread are read after its barrier. Each slot is handed back before its
+done callback runs, so the callback may queue the next send.
+**/
+static uBarrierBool sDrainSendQueue(uBarrierContext *context)
+{
+	uint32_t head = context->m_sendQueueHead;
+	uint32_t tail;
+	UBARRIER_MEMORY_BARRIER();
+	for (tail = context->m_sendQueueTail; tail != head; tail++)
+	{
+		uBarrierSendJob job = context->m_sendQueue[tail & (UBARRIER_SEND_QUEUE_SIZE-1)];
+		uBarrierBool sent = uBarrierSendClipboardData(context, job.m_formats, job.m_numFormats);
+		UBARRIER_MEMORY_BARRIER();
+		context->m_sendQueueTail = tail+1;
+		if (job.m_doneCallback != 0L)
+			job.m_doneCallback(context->m_cookie, job.m_userData, sent);
+		if (!sent)
+			return UBARRIER_FALSE;
+	}
+	return UBARRIER_TRUE;
+}
+
+
+
+/**
+@brief Drop the queued sends, they were meant for the old connection
+**/
+static void sDropSendQueue(uBarrierContext *context)
+{
+	uint32_t head = context->m_sendQueueHead;
+	uint32_t tail;
+	UBARRIER_MEMORY_BARRIER();
+	for (tail = context->m_sendQueueTail; tail != head; tail++)
+	{
+		uBarrierSendJob job = context->m_sendQueue[tail & (UBARRIER_SEND_QUEUE_SIZE-1)];
+		UBARRIER_MEMORY_BARRIER();
+		context->m_sendQueueTail = tail+1;
+		if (job.m_doneCallback != 0L)
+			job.m_doneCallback(context->m_cookie, job.m_userData, UBARRIER_FALSE);
+	}
+}
+
+
+
+/**
+@brief Mark context as being disconnected
+**/
+static void sSetDisconnected(uBarrierContext *context)
+{
+	context->m_connected		= UBARRIER_FALSE;
+	context->m_hasReceivedHello = UBARRIER_FALSE;
+	context->m_isCaptured		= UBARRIER_FALSE;
+	context->m_mouseMovePending	= UBARRIER_FALSE;
+	context->m_mouseRelativePending	= UBARRIER_FALSE;
+	context->m_keyRepeatActive	= UBARRIER_FALSE;
+	context->m_mouseRelativeX	= 0;
+	context->m_mouseRelativeY	= 0;
+	context->m_replyPacket		= context->m_replyBuffer;
+	context->m_replyCur			= context->m_replyBuffer + 4;
+	context->m_receiveOfs		= 0;
+	context->m_sequenceNumber	= 0;
+	context->m_protocolMinor	= 0;
+	context->m_streamLeft		= 0;
+	context->m_keepAliveTime	= 0;
+	context->m_keepAliveReplyTime	= 0;
+	context->m_infoReplyPending	= UBARRIER_FALSE;
+	context->m_infoSentTime		= 0;
+	sResetClipboard(context, 0);
+	sResetOptions(context);
+	sDropSendQueue(context);
+}
+
+
+
+/**
+@brief Drop a connection that failed, reconnect right away
+**/
+static void sDisconnect(uBarrierContext *context)
+{
+	context->m_stats.m_numDisconnects++;
+	context->m_statsChanged = UBARRIER_TRUE;
+	sSetDisconnected(context);
+	sScheduleReconnect(context, 0);
+}
+
+
+
+/**
+@brief Idle time after which the server is considered gone, 0 if it never is
+
+Unless configured, this follows the heartbeat the server set: a few missed keep alives, or never when the
+server turned keep alives off. Keep alives that arrive late or irregularly stretch it the way TCP stretches
+its retransmission timeout, so a slow link isn't mistaken for a dead one.
+**/
+static uint32_t sIdleTimeout(const uBarrierContext *context)
+{
+	const uBarrierEstimate *interval = &context->m_link.m_keepAliveInterval;
+	uint32_t timeout = UBARRIER_IDLE_TIMEOUT;
+	uint64_t observed;
+	if (context->m_idleTimeout != 0)
+		return context->m_idleTimeout;
+	if (context->m_optionHeartbeatSet)
+	{
+		if (context->m_optionHeartbeat == 0)
+			return 0;
+		timeout = context->m_optionHeartbeat * UBARRIER_HEARTBEATS_UNTIL_DEATH;
+	}
+	if (interval->m_count != 0)
+	{
+		observed = (interval->m_average * UBARRIER_HEARTBEATS_UNTIL_DEATH + interval->m_deviation * 4) / 1000000;
+		if (observed > timeout && observed < 0x7FFFFFFF)
+			timeout = (uint32_t)observed;
+	}
+	return timeout;
+}
+
+
+
+/**
+@brief Connect, or schedule the next attempt if that fails
+**/
+static void sConnect(uBarrierContext *context)
+{
+	// The ring is indexed with a mask, check its size before the first event can be written
+	uint32_t ring_size = context->m_eventRingSize;
+	if (context->m_eventRing != 0L && (ring_size == 0 || (ring_size & (ring_size-1)) != 0))
+	{
+		sTrace(context, UBARRIER_TRACE_EVENT_RING_SIZE, ring_size, 0);
+		context->m_eventRing = 0L;
+	}
+
+	context->m_reconnectDelayed = UBARRIER_FALSE;
+	context->m_statsChanged = UBARRIER_TRUE;
+	if (context->m_connectFunc(context->m_cookie))
+	{
+		context->m_stats.m_numConnects++;
+		context->m_connected = UBARRIER_TRUE;
+	}
+	else
+	{
+		context->m_stats.m_numConnectFailures++;
+		/* Only a lost connection earns an immediate retry, a failed attempt always backs off */
+		if (context->m_reconnectAttempts == 0)
+			context->m_reconnectAttempts = 1;
+		sScheduleReconnect(context, 0);
+	}
+}
+
+
+
+/**
+@brief Update a connected context
+**/
+static void sUpdateContext(uBarrierContext *context)
+{
+	/* Receive data (blocking) */
+	int receive_size = (int)context->m_receiveBufferSize - context->m_receiveOfs;
+	int num_received = 0;
+	uint64_t arrival_time = 0;
+	uBarrierBool received;
+	uint32_t packlen;
+	int read_ofs;
+	if (context->m_receiveTimedFunc != 0L)
+		received = context->m_receiveTimedFunc(context->m_cookie, context->m_receiveBuffer + context->m_receiveOfs, receive_size, &num_received, &arrival_time);
+	else
+		received = context->m_receiveFunc(context->m_cookie, context->m_receiveBuffer + context->m_receiveOfs, receive_size, &num_received);
+	if (received == UBARRIER_FALSE)
+	{
+		/* Receive failed, let's try to reconnect */
+		sTrace(context, UBARRIER_TRACE_RECEIVE_FAILED, (uint32_t)receive_size, (uint32_t)num_received);
+		sDisconnect(context);
+		return;
+	}
+	context->m_receiveOfs += num_received;
+	if (num_received != 0)
+	{
+		context->m_receiveTime = sTimeNs(context);
+		context->m_eventTime = arrival_time != 0 ? arrival_time : context->m_receiveTime;
+		context->m_stats.m_numReceives++;
+		context->m_stats.m_numBytesReceived += (uint64_t)num_received;
+		context->m_statsChanged = UBARRIER_TRUE;
+	}
+
+	/*	If we didn't receive any data then we're probably still polling to get connected and
+		therefore not getting any data back. To avoid overloading the system with a Barrier
+		thread that would hammer on polling, we let it rest for a bit if there's no data. When
+		polling, no data just means the caller's timer fired. */
+	if (num_received == 0 && !context->m_polling && !context->m_keyRepeatActive && !sSendQueued(context))
+		context->m_sleepFunc(context->m_cookie, 500);
+
+	/* Check for timeouts */
+	if (context->m_hasReceivedHello)
+	{
+		uint32_t cur_time = context->m_getTimeFunc();
+		if (num_received == 0)
+		{
+			/* Timeout after missing several keep alives (we received no CALV) */
+			uint32_t timeout = sIdleTimeout(context);
+			if (timeout != 0 && (cur_time - context->m_lastMessageTime) > timeout)
+			{
+				sTrace(context, UBARRIER_TRACE_SERVER_TIMEOUT, 0, 0);
+				sDisconnect(context);
+				return;
+			}
+		}
+		else
+			context->m_lastMessageTime = cur_time;
+	}
+
+	/* Repeats that came due before this data arrived go first, stamped with the time they are sent */
+	if (context->m_keyRepeatActive)
+	{
+		uint64_t event_time = context->m_eventTime;
+		context->m_eventTime = sTimeNs(context);
+		sProcessKeyRepeat(context);
+		context->m_eventTime = event_time;
+	}
+
+	/*	Eat packets in place. Parsing only advances a read offset, the partial packet that is left
+		over is moved to the front of the buffer once per receive instead of after every packet. */
+	read_ofs = 0;
+
+	/* Pass the tail of a packet too large for the receive buffer on as it arrives */
+	if (context->m_streamLeft != 0)
+		read_ofs = sContinueStream(context, context->m_receiveBuffer, (uint32_t)context->m_receiveOfs);
+
+	for (;;)
+	{
+		/* Grab packet length and bail out if the packet goes beyond the end of the buffer */
+		const uint8_t *packet = context->m_receiveBuffer + read_ofs;
+		uint32_t available = (uint32_t)(context->m_receiveOfs - read_ofs);
+		if (available < 4)
+			break;
+		packlen = sWireRead4(packet);
+		if (packlen > available-4)
+		{
+			/* Start streaming packets that will never fit, wait for the rest of any other packet */
+			if (packlen > context->m_receiveBufferSize-4)
+			{
+				/* No packet is that long, the framing is lost and only reconnecting gets it back */
+				if (packlen > UBARRIER_MAX_PACKET_LENGTH)
+				{
+					context->m_stats.m_numMalformedPackets++;
+					sTrace(context, UBARRIER_TRACE_MALFORMED_PACKET, sTraceType(packet, available-4), packlen);
+					sDisconnect(context);
+					return;
+				}
+				read_ofs += sBeginStream(context, packet, packlen, available);
+			}
+			break;
+		}
+
+		/* Process message */
+		sProcessMessage(context, packet, packlen);
+		sRecordLatency(context, UBARRIER_HISTOGRAM_DISPATCH, context->m_receiveTime);
+		read_ofs += packlen+4;
+
+		/* A handler dropped the connection, the rest of the data is stale */
+		if (!context->m_connected)
+		{
+			sSetDisconnected(context);
+			return;
+		}
+	}
+
+	/* Deliver the last coalesced mouse move of the batch */
+	if (context->m_mouseMovePending)
+		sFlushMouseMove(context);
+	if (context->m_mouseRelativePending)
+		sFlushMouseRelative(context);
+
+	/* Wake the consumer of the event ring before sending, so it gets going while we do */
+	sEventsReady(context);
+
+	/* Send the replies batched up while parsing */
+	if (!sFlushReplies(context))
+	{
+		/* Send failed, let's try to reconnect */
+		sTrace(context, UBARRIER_TRACE_SEND_REPLIES_FAILED, 0, 0);
+		sDisconnect(context);
+		return;
+	}
+
+	/* Send what other threads queued, behind the replies */
+	if (context->m_hasReceivedHello && sSendQueued(context) && !sDrainSendQueue(context))
+	{
+		sTrace(context, UBARRIER_TRACE_SEND_CLIPBOARD_FAILED, 0, 0);
+		sDisconnect(context);
+		return;
+	}
+	if (num_received != 0)
+		sRecordLatency(context, UBARRIER_HISTOGRAM_BATCH, context->m_receiveTime);
+
+	/* Compact the buffer */
+	if (read_ofs != 0)
+	{
+		memmove(context->m_receiveBuffer, context->m_receiveBuffer+read_ofs, context->m_receiveOfs-read_ofs);
+		context->m_stats.m_numBytesCompacted += (uint64_t)(context->m_receiveOfs-read_ofs);
+		context->m_receiveOfs -= read_ofs;
+	}
+}
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Vectored sends
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Memory blocks collected for one vectored send
+
+Small pieces like packet headers are written to the reply buffer with the sAdd* functions, large
+payloads are referenced where they are. Header bytes that have not been turned into a block yet
+start at m_pending and end at the reply write pointer.
+**/
+typedef struct
+{
+	uBarrierIOVec	m_vectors[UBARRIER_MAX_SEND_VECTORS];		/* Memory blocks to send */
+	int				m_count;									/* Number of memory blocks */
+	uint8_t*		m_pending;									/* Start of header bytes not covered by a block */
+} sGather;
+
+
+
+/**
+@brief Start collecting memory blocks, replies that are batched up go out first
+**/
+static void sBeginGather(uBarrierContext *context, sGather *gather)
+{
+	gather->m_count		= 0;
+	gather->m_pending	= context->m_replyBuffer;
+	context->m_replyCur	= context->m_replyPacket;
+}
+
+
+
+/**
+@brief Turn pending header bytes into a memory block
+**/
+static void sGatherPending(uBarrierContext *context, sGather *gather)
+{
+	if (context->m_replyCur != gather->m_pending)
+	{
+		uBarrierIOVec *vector = &gather->m_vectors[gather->m_count++];
+		vector->m_data = gather->m_pending;
+		vector->m_size = (uint32_t)(context->m_replyCur - gather->m_pending);
+		gather->m_pending = context->m_replyCur;
+	}
+}
+
+
+
+/**
+@brief Send the memory blocks collected so far
+**/
+static uBarrierBool sSendGather(uBarrierContext *context, sGather *gather)
+{
+	uBarrierBool ret = UBARRIER_TRUE;
+	uint64_t start;
+	int i;
+
+	sGatherPending(context, gather);
+	start = sTimeNs(context);
+	if (context->m_sendVectorFunc != 0L)
+	{
+		ret = context->m_sendVectorFunc(context->m_cookie, gather->m_vectors, gather->m_count);
+		context->m_stats.m_numSends++;
+	}
+	else
+	{
+		for (i = 0; i < gather->m_count && ret; i++)
+		{
+			ret = context->m_sendFunc(context->m_cookie, gather->m_vectors[i].m_data, (int)gather->m_vectors[i].m_size);
+			context->m_stats.m_numSends++;
+		}
+	}
+	sRecordLatency(context, UBARRIER_HISTOGRAM_SEND, start);
+	for (i = 0; i < gather->m_count; i++)
+		context->m_stats.m_numBytesSent += gather->m_vectors[i].m_size;
+	context->m_statsChanged = UBARRIER_TRUE;
+	if (ret)
+		sRepliesSent(context, start);
+
+	// Start over at the front of the reply buffer
+	gather->m_count		= 0;
+	gather->m_pending	= context->m_replyBuffer;
+	context->m_replyCur	= context->m_replyBuffer;
+	return ret;
+}
+
+
+
+/**
+@brief Send the remaining memory blocks and reset the reply buffer
+**/
+static uBarrierBool sEndGather(uBarrierContext *context, sGather *gather)
+{
+	uBarrierBool ret = UBARRIER_TRUE;
+	if (gather->m_count != 0 || context->m_replyCur != gather->m_pending)
+		ret = sSendGather(context, gather);
+	context->m_replyPacket	= context->m_replyBuffer;
+	context->m_replyCur		= context->m_replyBuffer+4;
+	return ret;
+}
+
+
+
+/**
+@brief Add a payload memory block, sending the blocks collected so far when running out of room
+**/
+static uBarrierBool sGatherData(uBarrierContext *context, sGather *gather, const uint8_t *data, uint32_t size)
+{
+	uBarrierIOVec *vector;
+
+	sGatherPending(context, gather);
+	if (size != 0)
+	{
+		vector = &gather->m_vectors[gather->m_count++];
+		vector->m_data = data;
+		vector->m_size = size;
+	}
+
+	// Keep room for a header block and a data block, and for the next headers in the reply buffer
+	if (gather->m_count > UBARRIER_MAX_SEND_VECTORS-2 || context->m_replyBuffer + context->m_replyBufferSize - context->m_replyCur < UBARRIER_REPLY_BATCH_RESERVE)
+	{
+		if (!sSendGather(context, gather))
+		{
+			// May run on another thread than the trace ring's producer, the caller learns from the result
+			sEndGather(context, gather);
+			return UBARRIER_FALSE;
+		}
+	}
+	return UBARRIER_TRUE;
+}
+
+
+
+/**
+@brief Add the header of an outgoing clipboard chunk with @a size bytes of data to the reply buffer
+**/
+static void sAddClipboardChunkHeader(uBarrierContext *context, uint8_t mark, uint32_t size)
+{
+	sMessageDCLP chunk;
+	chunk.m_id			= 0;										/* Clipboard index */
+	chunk.m_sequence	= context->m_sequenceNumber;
+	chunk.m_mark		= mark;
+	chunk.m_size		= size;
+	sAddUInt32(context, UBARRIER_WIRE_LENGTH_DCLP+size);
+	context->m_replyCur = sEncodeDCLP(context->m_replyCur, &chunk);
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Traffic counters
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Publish the traffic counters and link timing for uBarrierGetStats and uBarrierGetLinkStats
+
+A sequence lock: the sequence is odd while the snapshot is written, readers retry if it was odd or changed
+while they copied. The update thread never waits for readers. The link timing only changes with keep alives
+and the screen info exchange, so it is only copied when an estimate was updated.
+**/
+static void sPublishStatsNow(uBarrierContext *context)
+{
+	uint32_t sequence = context->m_statsSequence;
+	context->m_statsSequence = sequence+1;
+	UBARRIER_MEMORY_BARRIER();
+	context->m_statsSnapshot = context->m_stats;
+	if (context->m_linkChanged)
+		context->m_linkSnapshot = context->m_link;
+	UBARRIER_MEMORY_BARRIER();
+	context->m_statsSequence = sequence+2;
+	context->m_statsChanged		= UBARRIER_FALSE;
+	context->m_linkChanged		= UBARRIER_FALSE;
+	context->m_statsPublishTime	= context->m_getTimeFunc();
+}
+
+
+
+/**
+@brief Publish changed counters at the end of an update, at most every UBARRIER_STATS_INTERVAL
+
+An update that handles a single packet touches a few lines of counters; copying all of them would touch
+more memory than the packet itself. Updated link estimates are rare and published right away.
+**/
+static void sPublishStats(uBarrierContext *context)
+{
+	if (context->m_linkChanged)
+		sPublishStatsNow(context);
+	else if (context->m_statsChanged && context->m_getTimeFunc() - context->m_statsPublishTime >= UBARRIER_STATS_INTERVAL)
+		sPublishStatsNow(context);
+}
+
+
+
+/**
+@brief Clear the latency histograms if uBarrierResetHistograms asked for it
+**/
+static void sApplyHistogramReset(uBarrierContext *context)
+{
+	if (!context->m_resetHistograms)
+		return;
+	context->m_resetHistograms = UBARRIER_FALSE;
+	memset(context->m_histograms, 0, sizeof(context->m_histograms));
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Trace formatting
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief How the arguments of a trace are printed
+**/
+enum sTraceArgs
+{
+	TRACE_ARGS_NUMBERS,														/* Both arguments as %u */
+	TRACE_ARGS_TYPE,														/* Packet type as %s, then a number */
+	TRACE_ARGS_CLIENT_NAME													/* Client name as %s */
+};
+
+
+
+/**
+@brief Text of each kind of trace, indexed by uBarrierTraceEvent
+**/
+static const struct
+{
+	const char*		m_format;
+	enum sTraceArgs	m_args;
+} s_traceTypes[UBARRIER_NUM_TRACE_EVENTS] =
+{
+	{ "Connected as client \"%s\"",										TRACE_ARGS_CLIENT_NAME },
+	{ "Receive failed (%u bytes asked, %u bytes received), reconnecting",	TRACE_ARGS_NUMBERS },
+	{ "SendReply failed, reconnecting",										TRACE_ARGS_NUMBERS },
+	{ "Sending replies failed, reconnecting",								TRACE_ARGS_NUMBERS },
+	{ "Server timed out, reconnecting",										TRACE_ARGS_NUMBERS },
+	{ "Server disconnecting",												TRACE_ARGS_NUMBERS },
+	{ "Client is unknown to server",										TRACE_ARGS_NUMBERS },
+	{ "Client name is already connected to server",							TRACE_ARGS_NUMBERS },
+	{ "Server protocol %u.%u is incompatible",								TRACE_ARGS_NUMBERS },
+	{ "Server reported a protocol error",									TRACE_ARGS_NUMBERS },
+	{ "Unknown packet '%s'",												TRACE_ARGS_TYPE },
+	{ "Short packet '%s' (length %u)",										TRACE_ARGS_TYPE },
+	{ "Oversized packet: '%s' (length %u)",									TRACE_ARGS_TYPE },
+	{ "Incomplete clipboard (%u of %u bytes)",								TRACE_ARGS_NUMBERS },
+	{ "Clipboard too large for the clipboard callback, install a chunk callback",	TRACE_ARGS_NUMBERS },
+	{ "Sending clipboard failed, reconnecting",								TRACE_ARGS_NUMBERS },
+	{ "Client name needs a %u byte reply, the reply buffer holds %u",		TRACE_ARGS_NUMBERS },
+	{ "Malformed packet '%s' (length %u)",									TRACE_ARGS_TYPE },
+	{ "Malformed clipboard (%u announced, %u bytes left), ignoring the rest",	TRACE_ARGS_NUMBERS },
+	{ "Event ring size %u isn't a power of two, using callbacks",			TRACE_ARGS_NUMBERS },
+};
+
+
+
+/**
+@brief Format a trace record into @a buffer
+**/
+static void sFormatTrace(const uBarrierContext *context, const uBarrierTraceRecord *record, char *buffer, int size)
+{
+	const char *format = s_traceTypes[record->m_event].m_format;
+	int length = 0;
+	switch (s_traceTypes[record->m_event].m_args)
+	{
+	case TRACE_ARGS_NUMBERS:
+		length = snprintf(buffer, size, format, (unsigned)record->m_args[0], (unsigned)record->m_args[1]);
+		break;
+	case TRACE_ARGS_TYPE:
+	{
+		char type[5];
+		int i;
+		for (i = 0; i < 4; i++)
+		{
+			// Packet types come from the network, keep the trace printable
+			char c = (char)(record->m_args[0] >> (24 - i*8));
+			type[i] = (c >= ' ' && c <= '~') ? c : '?';
+		}
+		type[4] = 0;
+		length = snprintf(buffer, size, format, type, (unsigned)record->m_args[1]);
+		break;
+	}
+	case TRACE_ARGS_CLIENT_NAME:
+		length = snprintf(buffer, size, format, context->m_clientName);
+		break;
+	}
+	if (record->m_suppressed != 0 && length >= 0 && length < size)
+		snprintf(buffer + length, size - length, " (%u similar traces suppressed)", (unsigned)record->m_suppressed);
+}
+
+
+
 //---------------------------------------------------------------------------------------------------------------------
-//	Internal helpers
+//	Public interface
 //---------------------------------------------------------------------------------------------------------------------
 
 
 
 /**
-@brief Read 16 bit integer in network byte order and convert to native byte order
+@brief Initialize a context with the given buffers
 **/
-static int16_t sNetToNative16(const unsigned char *value)
+static void sInitContext(uBarrierContext *context, uint8_t *receiveBuffer, uint32_t receiveSize, uint8_t *replyBuffer, uint32_t replySize)
 {
-#ifdef UBARRIER_LITTLE_ENDIAN
-	return value[1] | (value[0] << 8);
-#else
-	return value[0] | (value[1] << 8);
-#endif
+	/* Zero memory */
+	memset(context, 0, sizeof(uBarrierContext));
+
+	/* The buffers live apart from the state, so the state touched by every packet stays on few cache lines */
+	context->m_receiveBuffer		= receiveBuffer;
+	context->m_receiveBufferSize	= receiveSize;
+	context->m_replyBuffer			= replyBuffer;
+	context->m_replyBufferSize		= replySize;
+
+	/* Initialize to default state */
+	sSetDisconnected(context);
 }
 
 
 
 /**
-@brief Read 32 bit integer in network byte order and convert to native byte order
+@brief Round @a pointer up to the next cache line
 **/
-static int32_t sNetToNative32(const unsigned char *value)
+static uint8_t *sAlignCacheLine(uint8_t *pointer)
 {
-#ifdef UBARRIER_LITTLE_ENDIAN
-	return value[3] | (value[2] << 8) | (value[1] << 16) | (value[0] << 24);
-#else
-	return value[0] | (value[1] << 8) | (value[2] << 16) | (value[3] << 24);
-#endif
+	uintptr_t misalignment = (uintptr_t)pointer & (UBARRIER_CACHE_LINE_SIZE-1);
+	return misalignment == 0 ? pointer : pointer + (UBARRIER_CACHE_LINE_SIZE - misalignment);
 }
 
 
 
+#if UBARRIER_DEFAULT_STORAGE
 /**
-@brief Trace text to client
+@brief Initialize uBarrier context
 **/
-static void sTrace(uBarrierContext *context, const char* text)
+void uBarrierInit(uBarrierContext *context)
 {
-	// Don't trace if we don't have a trace function
-	if (context->m_traceFunc != 0L)
-		context->m_traceFunc(context->m_cookie, text);
+	sInitContext(context, context->m_receiveStorage, UBARRIER_RECEIVE_BUFFER_SIZE, context->m_replyStorage, UBARRIER_REPLY_BUFFER_SIZE);
 }
+#endif
 
 
 
 /**
-@brief Add string to reply packet
+@brief Initialize uBarrier context with buffers in caller memory
 **/
-static void sAddString(uBarrierContext *context, const char *string)
+uBarrierBool uBarrierInitArena(uBarrierContext *context, void *arena, uint32_t arenaSize, uint32_t receiveSize, uint32_t replySize)
 {
-	size_t len = strlen(string);
-	memcpy(context->m_replyCur, string, len);
-	context->m_replyCur += len;
+	uint8_t *receive_buffer, *reply_buffer;
+
+	// Offsets into the receive buffer are ints
+	if (receiveSize < UBARRIER_MIN_RECEIVE_BUFFER_SIZE || replySize < UBARRIER_MIN_REPLY_BUFFER_SIZE || receiveSize > 0x7FFFFFFF)
+		return UBARRIER_FALSE;
+	if (arena == 0L || arenaSize < UBARRIER_CACHE_LINE_SIZE*2 || arenaSize - UBARRIER_CACHE_LINE_SIZE*2 < receiveSize || arenaSize - UBARRIER_CACHE_LINE_SIZE*2 - receiveSize < replySize)
+		return UBARRIER_FALSE;
+
+	receive_buffer	= sAlignCacheLine((uint8_t*)arena);
+	reply_buffer	= sAlignCacheLine(receive_buffer + receiveSize);
+	sInitContext(context, receive_buffer, receiveSize, reply_buffer, replySize);
+	return UBARRIER_TRUE;
 }
 
 
-
 /**
-@brief Add uint8 to reply packet
+@brief Update uBarrier
 **/
-static void sAddUInt8(uBarrierContext *context, uint8_t value)
+void uBarrierUpdate(uBarrierContext *context)
 {
-	*context->m_replyCur++ = value;
+	sApplyHistogramReset(context);
+	context->m_polling = UBARRIER_FALSE;
+	if (context->m_connected)
+	{
+		/* Update context, receive data, call callbacks */
+		sUpdateContext(context);
+	}
+	else
+	{
+		/* Wait for the scheduled attempt, then try to connect */
+		int wait = uBarrierGetReconnectTime(context);
+		if (wait > 0)
+			context->m_sleepFunc(context->m_cookie, wait);
+		sConnect(context);
+	}
+	sEventsReady(context);
+	if (!context->m_deferTrace)
+		uBarrierDrainTrace(context);
+	sPublishStats(context);
 }
 
 
 
 /**
-@brief Add uint16 to reply packet
+@brief Poll uBarrier
 **/
-static void sAddUInt16(uBarrierContext *context, uint16_t value)
+void uBarrierPoll(uBarrierContext *context)
 {
-	uint8_t *reply = context->m_replyCur;
-	*reply++ = (uint8_t)(value >> 8);
-	*reply++ = (uint8_t)value;
-	context->m_replyCur = reply;
+	sApplyHistogramReset(context);
+	context->m_polling = UBARRIER_TRUE;
+	if (context->m_connected)
+	{
+		/* Process available data, call callbacks */
+		sUpdateContext(context);
+	}
+	else if (uBarrierGetReconnectTime(context) == 0)
+	{
+		/* Try to connect, retry later if that fails */
+		sConnect(context);
+	}
+	sEventsReady(context);
+	if (!context->m_deferTrace)
+		uBarrierDrainTrace(context);
+	sPublishStats(context);
 }
 
 
 
 /**
-@brief Add uint32 to reply packet
+@brief Get descriptor of the connection
 **/
-static void sAddUInt32(uBarrierContext *context, uint32_t value)
+int uBarrierGetFd(uBarrierContext *context)
 {
-	uint8_t *reply = context->m_replyCur;
-	*reply++ = (uint8_t)(value >> 24);
-	*reply++ = (uint8_t)(value >> 16);
-	*reply++ = (uint8_t)(value >> 8);
-	*reply++ = (uint8_t)value;
-	context->m_replyCur = reply;
+	if (!context->m_connected || context->m_getFdFunc == 0L)
+		return -1;
+	return context->m_getFdFunc(context->m_cookie);
 }
 
 
 
 /**
-@brief Send reply packet
+@brief Get time until uBarrierPoll must be called
 **/
-static uBarrierBool sSendReply(uBarrierContext *context)
+int uBarrierNextTimeout(uBarrierContext *context)
 {
-	// Set header size
-	uint8_t		*reply_buf	= context->m_replyBuffer;
-	uint32_t	reply_len	= (uint32_t)(context->m_replyCur - reply_buf);				/* Total size of reply */
-	uint32_t	body_len	= reply_len - 4;											/* Size of body */
-	uBarrierBool ret;
-	reply_buf[0] = (uint8_t)(body_len >> 24);
-	reply_buf[1] = (uint8_t)(body_len >> 16);
-	reply_buf[2] = (uint8_t)(body_len >> 8);
-	reply_buf[3] = (uint8_t)body_len;
+	int32_t left = -1;
+	if (!context->m_connected)
+		return uBarrierGetReconnectTime(context);
+	else if (context->m_hasReceivedHello)
+	{
+		/* Idle timeout, which fires once more than the timeout has passed */
+		uint32_t cur_time = context->m_getTimeFunc();
+		uint32_t timeout = sIdleTimeout(context);
+		if (timeout != 0)
+		{
+			left = (int32_t)(context->m_lastMessageTime + timeout + 1 - cur_time);
+			if (left < 0)
+				left = 0;
+		}
 
-	// Send reply
-	ret = context->m_sendFunc(context->m_cookie, context->m_replyBuffer, reply_len);
+		/* Next local key repeat */
+		if (context->m_keyRepeatActive)
+		{
+			int32_t repeat = (int32_t)(context->m_keyRepeatTime - cur_time);
+			if (repeat < 0)
+				repeat = 0;
+			if (left < 0 || repeat < left)
+				left = repeat;
+		}
 
-	// Reset reply buffer write pointer
-	context->m_replyCur = context->m_replyBuffer+4;
-	return ret;
+		/* Queued sends go out on the next poll */
+		if (sSendQueued(context))
+			left = 0;
+	}
+	return (int)left;
 }
 
 
 
 /**
-@brief Call mouse callback after a mouse event
+@brief Get time until the next connection attempt
 **/
-static void sSendMouseCallback(uBarrierContext *context)
+int uBarrierGetReconnectTime(uBarrierContext *context)
 {
-	// Skip if no callback is installed
-	if (context->m_mouseCallback == 0L)
-		return;
-
-	// Send callback
-	context->m_mouseCallback(context->m_cookie, context->m_mouseX, context->m_mouseY, context->m_mouseWheelX,
-		context->m_mouseWheelY, context->m_mouseButtonLeft, context->m_mouseButtonRight, context->m_mouseButtonMiddle);
+	int32_t left;
+	if (context->m_connected)
+		return -1;
+	if (!context->m_reconnectDelayed)
+		return 0;
+	left = (int32_t)(context->m_reconnectTime - context->m_getTimeFunc());
+	return left > 0 ? (int)left : 0;
 }
 
 
 
 /**
-@brief Send keyboard callback when a key has been pressed or released
+@brief Get the arrival time of the event being delivered
 **/
-static void sSendKeyboardCallback(uBarrierContext *context, uint16_t key, uint16_t modifiers, uBarrierBool down, uBarrierBool repeat)
+uint64_t uBarrierGetEventTime(const uBarrierContext *context)
 {
-	// Skip if no callback is installed
-	if (context->m_keyboardCallback == 0L)
-		return;
+	return context->m_eventTime;
+}
 
-	// Send callback
-	context->m_keyboardCallback(context->m_cookie, key, modifiers, down, repeat);
+
+
+/**
+@brief Get traffic counters
+**/
+void uBarrierGetStats(const uBarrierContext *context, uBarrierStats *stats)
+{
+	uint32_t before, after;
+	do
+	{
+		before = context->m_statsSequence;
+		UBARRIER_MEMORY_BARRIER();
+		*stats = context->m_statsSnapshot;
+		UBARRIER_MEMORY_BARRIER();
+		after = context->m_statsSequence;
+	} while ((before & 1) != 0 || before != after);
 }
 
 
 
 /**
-@brief Send joystick callback
+@brief Get link timing
 **/
-static void sSendJoystickCallback(uBarrierContext *context, uint8_t joyNum)
+void uBarrierGetLinkStats(const uBarrierContext *context, uBarrierLinkStats *link)
 {
-	int8_t *sticks;
+	uint32_t before, after;
+	do
+	{
+		before = context->m_statsSequence;
+		UBARRIER_MEMORY_BARRIER();
+		*link = context->m_linkSnapshot;
+		UBARRIER_MEMORY_BARRIER();
+		after = context->m_statsSequence;
+	} while ((before & 1) != 0 || before != after);
+}
 
-	// Skip if no callback is installed
-	if (context->m_joystickCallback == 0L)
-		return;
 
-	// Send callback
-	sticks = context->m_joystickSticks[joyNum];
-	context->m_joystickCallback(context->m_cookie, joyNum, context->m_joystickButtons[joyNum], sticks[0], sticks[1], sticks[2], sticks[3]);
+
+/**
+@brief Publish the traffic counters now
+**/
+void uBarrierPublishStats(uBarrierContext *context)
+{
+	sPublishStatsNow(context);
 }
 
 
 
 /**
-@brief Parse a single client message, update state, send callbacks and send replies
+@brief Get a latency histogram
 **/
-#define UBARRIER_IS_PACKET(pkt_id)	memcmp(message+4, pkt_id, 4)==0
-static void sProcessMessage(uBarrierContext *context, const uint8_t *message)
-{
-	// We have a packet!
-	if (memcmp(message+4, "Barrier", 7)==0)
-	{
-		// Welcome message
-		//		kMsgHello			= "Barrier%2i%2i"
-		//		kMsgHelloBack		= "Barrier%2i%2i%s"
-		sAddString(context, "Barrier");
-		sAddUInt16(context, UBARRIER_PROTOCOL_MAJOR);
-		sAddUInt16(context, UBARRIER_PROTOCOL_MINOR);
-		sAddUInt32(context, (uint32_t)strlen(context->m_clientName));
-		sAddString(context, context->m_clientName);
-		if (!sSendReply(context))
-		{
-			// Send reply failed, let's try to reconnect
-			sTrace(context, "SendReply failed, trying to reconnect in a second");
-			context->m_connected = UBARRIER_FALSE;
-			context->m_sleepFunc(context->m_cookie, 1000);
-		}
-		else
-		{
-			// Let's assume we're connected
-			char buffer[256+1];
-			sprintf(buffer, "Connected as client \"%s\"", context->m_clientName);
-			sTrace(context, buffer);
-			context->m_hasReceivedHello = UBARRIER_TRUE;
-		}
-		return;
-	}
-	else if (UBARRIER_IS_PACKET("QINF"))
-	{
-		// Screen info. Reply with DINF
-		//		kMsgQInfo			= "QINF"
-		//		kMsgDInfo			= "DINF%2i%2i%2i%2i%2i%2i%2i"
-		uint16_t x = 0, y = 0, warp = 0;
-		sAddString(context, "DINF");
-		sAddUInt16(context, x);
-		sAddUInt16(context, y);
-		sAddUInt16(context, context->m_clientWidth);
-		sAddUInt16(context, context->m_clientHeight);
-		sAddUInt16(context, warp);
-		sAddUInt16(context, 0);		// mx?
-		sAddUInt16(context, 0);		// my?
-		sSendReply(context);
-		return;
-	}
-	else if (UBARRIER_IS_PACKET("CIAK"))
-	{
-		// Do nothing?
-		//		kMsgCInfoAck		= "CIAK"
-		return;
-	}
-	else if (UBARRIER_IS_PACKET("CROP"))
-	{
-		// Do nothing?
-		//		kMsgCResetOptions	= "CROP"
-		return;
-	}
-	else if (UBARRIER_IS_PACKET("CINN"))
-	{
-		// Screen enter. Reply with CNOP
-		//		kMsgCEnter 			= "CINN%2i%2i%4i%2i"
+void uBarrierGetHistogram(const uBarrierContext *context, enum uBarrierHistogramStage stage, uBarrierHistogram *histogram)
+{
+	*histogram = context->m_histograms[stage];
+}
 
-		// Obtain the Barrier sequence number
-		context->m_sequenceNumber = sNetToNative32(message + 12);
-		context->m_isCaptured = UBARRIER_TRUE;
 
-		// Call callback
-		if (context->m_screenActiveCallback != 0L)
-			context->m_screenActiveCallback(context->m_cookie, UBARRIER_TRUE);
-	}
-	else if (UBARRIER_IS_PACKET("COUT"))
-	{
-		// Screen leave
-		//		kMsgCLeave 			= "COUT"
-		context->m_isCaptured = UBARRIER_FALSE;
 
-		// Call callback
-		if (context->m_screenActiveCallback != 0L)
-			context->m_screenActiveCallback(context->m_cookie, UBARRIER_FALSE);
-	}
-	else if (UBARRIER_IS_PACKET("DMDN"))
-	{
-		// Mouse down
-		//		kMsgDMouseDown		= "DMDN%1i"
-		char btn = message[8]-1;
-		if (btn==2)
-			context->m_mouseButtonRight		= UBARRIER_TRUE;
-		else if (btn==1)
-			context->m_mouseButtonMiddle	= UBARRIER_TRUE;
-		else
-			context->m_mouseButtonLeft		= UBARRIER_TRUE;
-		sSendMouseCallback(context);
-	}
-	else if (UBARRIER_IS_PACKET("DMUP"))
-	{
-		// Mouse up
-		//		kMsgDMouseUp		= "DMUP%1i"
-		char btn = message[8]-1;
-		if (btn==2)
-			context->m_mouseButtonRight		= UBARRIER_FALSE;
-		else if (btn==1)
-			context->m_mouseButtonMiddle	= UBARRIER_FALSE;
-		else
-			context->m_mouseButtonLeft		= UBARRIER_FALSE;
-		sSendMouseCallback(context);
-	}
-	else if (UBARRIER_IS_PACKET("DMMV"))
-	{
-		// Mouse move. Reply with CNOP
-		//		kMsgDMouseMove		= "DMMV%2i%2i"
-		context->m_mouseX = sNetToNative16(message+8);
-		context->m_mouseY = sNetToNative16(message+10);
-		sSendMouseCallback(context);
-	}
-	else if (UBARRIER_IS_PACKET("DMWM"))
-	{
-		// Mouse wheel
-		//		kMsgDMouseWheel		= "DMWM%2i%2i"
-		//		kMsgDMouseWheel1_0	= "DMWM%2i"
-		context->m_mouseWheelX += sNetToNative16(message+8);
-		context->m_mouseWheelY += sNetToNative16(message+10);
-		sSendMouseCallback(context);
-	}
-	else if (UBARRIER_IS_PACKET("DKDN"))
-	{
-		// Key down
-		//		kMsgDKeyDown		= "DKDN%2i%2i%2i"
-		//		kMsgDKeyDown1_0		= "DKDN%2i%2i"
-		//uint16_t id = sNetToNative16(message+8);
-		uint16_t mod = sNetToNative16(message+10);
-		uint16_t key = sNetToNative16(message+12);
-		sSendKeyboardCallback(context, key, mod, UBARRIER_TRUE, UBARRIER_FALSE);
-	}
-	else if (UBARRIER_IS_PACKET("DKRP"))
-	{
-		// Key repeat
-		//		kMsgDKeyRepeat		= "DKRP%2i%2i%2i%2i"
-		//		kMsgDKeyRepeat1_0	= "DKRP%2i%2i%2i"
-		uint16_t mod = sNetToNative16(message+10);
-//		uint16_t count = sNetToNative16(message+12);
-		uint16_t key = sNetToNative16(message+14);
-		sSendKeyboardCallback(context, key, mod, UBARRIER_TRUE, UBARRIER_TRUE);
-	}
-	else if (UBARRIER_IS_PACKET("DKUP"))
-	{
-		// Key up
-		//		kMsgDKeyUp			= "DKUP%2i%2i%2i"
-		//		kMsgDKeyUp1_0		= "DKUP%2i%2i"
-		//uint16 id=Endian::sNetToNative(sbuf[4]);
-		uint16_t mod = sNetToNative16(message+10);
-		uint16_t key = sNetToNative16(message+12);
-		sSendKeyboardCallback(context, key, mod, UBARRIER_FALSE, UBARRIER_FALSE);
-	}
-	else if (UBARRIER_IS_PACKET("DGBT"))
-	{
-		// Joystick buttons
-		//		kMsgDGameButtons	= "DGBT%1i%2i";
-		uint8_t	joy_num = message[8];
-		if (joy_num<UBARRIER_NUM_JOYSTICKS)
-		{
-			// Copy button state, then send callback
-			context->m_joystickButtons[joy_num] = (message[9] << 8) | message[10];
-			sSendJoystickCallback(context, joy_num);
-		}
-	}
-	else if (UBARRIER_IS_PACKET("DGST"))
-	{
-		// Joystick sticks
-		//		kMsgDGameSticks		= "DGST%1i%1i%1i%1i%1i";
-		uint8_t	joy_num = message[8];
-		if (joy_num<UBARRIER_NUM_JOYSTICKS)
-		{
-			// Copy stick state, then send callback
-			memcpy(context->m_joystickSticks[joy_num], message+9, 4);
-			sSendJoystickCallback(context, joy_num);
-		}
-	}
-	else if (UBARRIER_IS_PACKET("DSOP"))
-	{
-		// Set options
-		//		kMsgDSetOptions		= "DSOP%4I"
-	}
-	else if (UBARRIER_IS_PACKET("CALV"))
-	{
-		// Keepalive, reply with CALV and then CNOP
-		//		kMsgCKeepAlive		= "CALV"
-		sAddString(context, "CALV");
-		sSendReply(context);
-		// now reply with CNOP
-	}
-	else if (UBARRIER_IS_PACKET("DCLP"))
-	{
-		// Clipboard message
-		//		kMsgDClipboard		= "DCLP%1i%4i%s"
-		//
-		// The clipboard message contains:
-		//		1 uint32:	The size of the message
-		//		4 chars: 	The identifier ("DCLP")
-		//		1 uint8: 	The clipboard index
-		//		1 uint32:	The sequence number. It's zero, because this message is always coming from the server?
-		//		1 uint32:	The total size of the remaining 'string' (as per the Barrier %s string format (which is 1 uint32 for size followed by a char buffer (not necessarily null terminated)).
-		//		1 uint32:	The number of formats present in the message
-		// And then 'number of formats' times the following:
-		//		1 uint32:	The format of the clipboard data
-		//		1 uint32:	The size n of the clipboard data
-		//		n uint8:	The clipboard data
-		const uint8_t *	parse_msg	= message+17;
-		uint32_t		num_formats = sNetToNative32(parse_msg);
-		parse_msg += 4;
-		for (; num_formats; num_formats--)
-		{
-			// Parse clipboard format header
-			uint32_t format	= sNetToNative32(parse_msg);
-			uint32_t size	= sNetToNative32(parse_msg+4);
-			parse_msg += 8;
-			
-			// Call callback
-			if (context->m_clipboardCallback)
-				context->m_clipboardCallback(context->m_cookie, format, parse_msg, size);
-
-			parse_msg += size;
-		}
-	}
-	else if (UBARRIER_IS_PACKET("CBYE")) 
-	{
-		// Server shutting down
-		//		kMsgCClose 			= "CBYE"
-		sTrace(context, "Server disconnecting");
-	}
-	else if (UBARRIER_IS_PACKET("EUNK")) 
-	{
-		// Client is Unknown
-		//		kMsgEUnknown		= "EUNK"
-		sTrace(context, "Client is unknown to server");
-	}
-	else
+/**
+@brief Get a percentile of a latency histogram
+**/
+uint64_t uBarrierHistogramPercentile(const uBarrierHistogram *histogram, double percentile)
+{
+	uint64_t rank, seen = 0, value;
+	uint32_t bucket, exponent;
+	if (histogram->m_count == 0)
+		return 0;
+
+	/* Rank of the value, counting from 1 */
+	rank = (uint64_t)((double)histogram->m_count * percentile / 100.0 + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > histogram->m_count)
+		rank = histogram->m_count;
+
+	for (bucket = 0; bucket < UBARRIER_HISTOGRAM_BUCKETS-1; bucket++)
 	{
-		// Unknown packet, could be any of these
-		//		kMsgCNoop 			= "CNOP"
-		//		kMsgCClipboard 		= "CCLP%1i%4i"
-		//		kMsgCScreenSaver 	= "CSEC%1i"
-		//		kMsgDKeyRepeat		= "DKRP%2i%2i%2i%2i"
-		//		kMsgDKeyRepeat1_0	= "DKRP%2i%2i%2i"
-		//		kMsgDMouseRelMove	= "DMRM%2i%2i"
-		//		kMsgEIncompatible	= "EICV%2i%2i"
-		//		kMsgEBusy 			= "EBSY"
-		//		kMsgEBad			= "EBAD"
-		char buffer[64];
-		sprintf(buffer, "Unknown packet '%c%c%c%c'", message[4], message[5], message[6], message[7]);
-		sTrace(context, buffer);
-		return;
+		seen += histogram->m_buckets[bucket];
+		if (seen >= rank)
+			break;
 	}
 
-	// Reply with CNOP maybe?
-	sAddString(context, "CNOP");
-	sSendReply(context);
+	/* The last bucket is open ended, report the largest value seen instead */
+	if (bucket >= UBARRIER_HISTOGRAM_BUCKETS-1)
+		return histogram->m_max;
+	if (bucket < 8)
+		return bucket;
+	exponent = bucket/8 + 2;
+	value = ((uint64_t)(8 + bucket%8) << (exponent-3)) + ((uint64_t)1 << (exponent-3)) - 1;
+
+	/* The bucket's upper bound can lie above every value seen */
+	return value < histogram->m_max ? value : histogram->m_max;
 }
-#undef UBARRIER_IS_PACKET
 
 
 
 /**
-@brief Mark context as being disconnected
+@brief Clear all latency histograms
 **/
-static void sSetDisconnected(uBarrierContext *context)
+void uBarrierResetHistograms(uBarrierContext *context)
 {
-	context->m_connected		= UBARRIER_FALSE;
-	context->m_hasReceivedHello = UBARRIER_FALSE;
-	context->m_isCaptured		= UBARRIER_FALSE;
-	context->m_replyCur			= context->m_replyBuffer + 4;
-	context->m_sequenceNumber	= 0;
+	context->m_resetHistograms = UBARRIER_TRUE;
 }
 
 
 
 /**
-@brief Update a connected context
+@brief Format a summary of all latency histograms
 **/
-static void sUpdateContext(uBarrierContext *context)
+int uBarrierFormatHistograms(const uBarrierContext *context, char *buffer, int size)
 {
-	/* Receive data (blocking) */
-	int receive_size = UBARRIER_RECEIVE_BUFFER_SIZE - context->m_receiveOfs;
-	int num_received = 0;
-	int packlen = 0;
-	if (context->m_receiveFunc(context->m_cookie, context->m_receiveBuffer + context->m_receiveOfs, receive_size, &num_received) == UBARRIER_FALSE)
+	static const char *s_stageNames[UBARRIER_NUM_HISTOGRAMS] = { "dispatch", "callback", "send", "batch" };
+	int length = 0;
+	int stage;
+	if (size > 0)
+		buffer[0] = 0;
+	for (stage = 0; stage < UBARRIER_NUM_HISTOGRAMS; stage++)
 	{
-		/* Receive failed, let's try to reconnect */
-		char buffer[128];
-		sprintf(buffer, "Receive failed (%d bytes asked, %d bytes received), trying to reconnect in a second", receive_size, num_received);
-		sTrace(context, buffer);
-		sSetDisconnected(context);
-		context->m_sleepFunc(context->m_cookie, 1000);
-		return;
-	}
-	context->m_receiveOfs += num_received;
-
-	/*	If we didn't receive any data then we're probably still polling to get connected and
-		therefore not getting any data back. To avoid overloading the system with a Barrier
-		thread that would hammer on polling, we let it rest for a bit if there's no data. */
-	if (num_received == 0)
-		context->m_sleepFunc(context->m_cookie, 500);
+		uBarrierHistogram histogram;
+		int written;
+		uBarrierGetHistogram(context, (enum uBarrierHistogramStage)stage, &histogram);
+		written = snprintf(buffer + length, length < size ? (size_t)(size - length) : 0,
+			"%-8s %10llu  mean %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+			s_stageNames[stage], (unsigned long long)histogram.m_count,
+			histogram.m_count != 0 ? (double)histogram.m_sum / (double)histogram.m_count / 1000.0 : 0.0,
+			(double)uBarrierHistogramPercentile(&histogram, 50.0) / 1000.0,
+			(double)uBarrierHistogramPercentile(&histogram, 90.0) / 1000.0,
+			(double)uBarrierHistogramPercentile(&histogram, 99.0) / 1000.0,
+			(double)uBarrierHistogramPercentile(&histogram, 99.9) / 1000.0,
+			(double)histogram.m_max / 1000.0);
+		if (written < 0)
+			break;
 
-	/* Check for timeouts */
-	if (context->m_hasReceivedHello)
-	{
-		uint32_t cur_time = context->m_getTimeFunc();
-		if (num_received == 0)
+		// Truncated, keep what fits and stop so the write position stays inside the buffer
+		if (written >= size - length)
 		{
-			/* Timeout after 2 secs of inactivity (we received no CALV) */
-			if ((cur_time - context->m_lastMessageTime) > UBARRIER_IDLE_TIMEOUT)
-				sSetDisconnected(context);
+			length = size > 0 ? size-1 : 0;
+			break;
 		}
-		else
-			context->m_lastMessageTime = cur_time;
+		length += written;
 	}
+	return length;
+}
 
-	/* Eat packets */
-	for (;;)
-	{
-		/* Grab packet length and bail out if the packet goes beyond the end of the buffer */
-		packlen = sNetToNative32(context->m_receiveBuffer);
-		if (packlen+4 > context->m_receiveOfs)
-			break;
 
-		/* Process message */
-		sProcessMessage(context, context->m_receiveBuffer);
 
-		/* Move packet to front of buffer */
-		memmove(context->m_receiveBuffer, context->m_receiveBuffer+packlen+4, context->m_receiveOfs-packlen-4);
-		context->m_receiveOfs -= packlen+4;
+/**
+@brief Deliver recorded traces
+**/
+int uBarrierDrainTrace(uBarrierContext *context)
+{
+	char buffer[UBARRIER_TRACE_BUFFER_SIZE];
+	uint32_t head, tail, lost;
+	int count = 0;
+	if (context->m_traceFunc == 0L)
+		return 0;
+
+	// Report traces that didn't fit in the ring
+	lost = context->m_traceLost;
+	if (lost != context->m_traceLostReported)
+	{
+		sprintf(buffer, "%u traces lost, trace ring full", (unsigned)(lost - context->m_traceLostReported));
+		context->m_traceLostReported = lost;
+		context->m_traceFunc(context->m_cookie, buffer);
+		count++;
 	}
 
-	/* Throw away over-sized packets */
-	if (packlen > UBARRIER_RECEIVE_BUFFER_SIZE)
+	// Read the records published so far, then hand their slots back
+	head = context->m_traceHead;
+	UBARRIER_MEMORY_BARRIER();
+	for (tail = context->m_traceTail; tail != head; tail++)
 	{
-		/* Oversized packet, ditch tail end */
-		char buffer[128];
-		sprintf(buffer, "Oversized packet: '%c%c%c%c' (length %d)", context->m_receiveBuffer[4], context->m_receiveBuffer[5], context->m_receiveBuffer[6], context->m_receiveBuffer[7], packlen);
-		sTrace(context, buffer);
-		num_received = context->m_receiveOfs-4; // 4 bytes for the size field
-		while (num_received != packlen)
-		{
-			int buffer_left = packlen - num_received;
-			int to_receive = buffer_left < UBARRIER_RECEIVE_BUFFER_SIZE ? buffer_left : UBARRIER_RECEIVE_BUFFER_SIZE;
-			int ditch_received = 0;
-			if (context->m_receiveFunc(context->m_cookie, context->m_receiveBuffer, to_receive, &ditch_received) == UBARRIER_FALSE)
-			{
-				/* Receive failed, let's try to reconnect */
-				sTrace(context, "Receive failed, trying to reconnect in a second");
-				sSetDisconnected(context);
-				context->m_sleepFunc(context->m_cookie, 1000);
-				break;
-			}
-			else
-			{
-				num_received += ditch_received;
-			}
-		}
-		context->m_receiveOfs = 0;
+		sFormatTrace(context, &context->m_traceRing[tail & (UBARRIER_TRACE_RING_SIZE-1)], buffer, sizeof(buffer));
+		UBARRIER_MEMORY_BARRIER();
+		context->m_traceTail = tail+1;
+		context->m_traceFunc(context->m_cookie, buffer);
+		count++;
 	}
+	return count;
 }
 
 
-//---------------------------------------------------------------------------------------------------------------------
-//	Public interface
-//---------------------------------------------------------------------------------------------------------------------
+
+/**
+@brief Take the next event from the event ring
+**/
+uBarrierBool uBarrierNextEvent(uBarrierContext *context, uBarrierEvent *event)
+{
+	return uBarrierDrainEvents(context, event, 1) != 0 ? UBARRIER_TRUE : UBARRIER_FALSE;
+}
 
 
 
 /**
-@brief Initialize uBarrier context
+@brief Take all waiting events from the event ring
 **/
-void uBarrierInit(uBarrierContext *context)
+int uBarrierDrainEvents(uBarrierContext *context, uBarrierEvent *events, int maxEvents)
 {
-	/* Zero memory */
-	memset(context, 0, sizeof(uBarrierContext));
+	uint32_t head, tail, mask;
+	int count = 0;
+	if (context->m_eventRing == 0L)
+		return 0;
+
+	// Copy the events published so far, then hand their slots back at once
+	head = context->m_eventHead;
+	UBARRIER_MEMORY_BARRIER();
+	mask = context->m_eventRingSize-1;
+	for (tail = context->m_eventTail; tail != head && count < maxEvents; tail++)
+		events[count++] = context->m_eventRing[tail & mask];
+	UBARRIER_MEMORY_BARRIER();
+	context->m_eventTail = tail;
+	return count;
+}
 
-	/* Initialize to default state */
-	sSetDisconnected(context);
+
+
+/**
+@brief Send clipboard data
+**/
+void uBarrierSendClipboard(uBarrierContext *context, const char *text)
+{
+	uBarrierClipboardData data;
+	data.m_format	= UBARRIER_CLIPBOARD_FORMAT_TEXT;
+	data.m_data		= (const uint8_t*)text;
+	data.m_size		= (uint32_t)strlen(text);
+	uBarrierSendClipboardData(context, &data, 1);
 }
 
 
+
 /**
-@brief Update uBarrier
+@brief Send clipboard data in several formats
 **/
-void uBarrierUpdate(uBarrierContext *context)
+uBarrierBool uBarrierSendClipboardData(uBarrierContext *context, const uBarrierClipboardData *formats, int numFormats)
 {
-	if (context->m_connected)
+	sGather		gather;
+	uint32_t	chunk_size	= context->m_clipboardChunkSize != 0 ? context->m_clipboardChunkSize : UBARRIER_CLIPBOARD_CHUNK_SIZE;
+	uint32_t	total_size	= 4;											/* Size of marshalled clipboard, starting with number of formats */
+	int			i;
+
+	for (i = 0; i < numFormats; i++)
+		total_size += 4 + 4 + formats[i].m_size;						/* Clipboard format, data length, data */
+
+	// Replies that are batched up go out with the clipboard
+	sBeginGather(context, &gather);
+
+	if (context->m_protocolMinor < 6)
 	{
-		/* Update context, receive data, call callbacks */
-		sUpdateContext(context);
+		// The whole clipboard in one packet
+		//		kMsgDClipboard1_0	= "DCLP%1i%4i%s"
+		sMessageDCLP_1_0 clipboard;
+		clipboard.m_id			= 0;								/* Clipboard index */
+		clipboard.m_sequence	= context->m_sequenceNumber;
+		clipboard.m_size		= total_size;						/* Rest of message size */
+		sAddUInt32(context, UBARRIER_WIRE_LENGTH_DCLP_1_0+total_size);
+		context->m_replyCur = sEncodeDCLP_1_0(context->m_replyCur, &clipboard);
+		sAddUInt32(context, (uint32_t)numFormats);
+		for (i = 0; i < numFormats; i++)
+		{
+			sAddUInt32(context, formats[i].m_format);
+			sAddUInt32(context, formats[i].m_size);
+			if (!sGatherData(context, &gather, formats[i].m_data, formats[i].m_size))
+				return UBARRIER_FALSE;
+		}
 	}
 	else
 	{
-		/* Try to connect */
-		if (context->m_connectFunc(context->m_cookie))
-			context->m_connected = UBARRIER_TRUE;
+		// A start chunk with the decimal size, one or more data chunks per format and an end chunk
+		//		kMsgDClipboard		= "DCLP%1i%4i%1i%s"
+		char size_string[16];
+		uint32_t size_length = (uint32_t)sprintf(size_string, "%u", (unsigned)total_size);
+		sAddClipboardChunkHeader(context, UBARRIER_CLIPBOARD_MARK_START, size_length);
+		sAddData(context, size_string, size_length);
+
+		for (i = 0; i < numFormats; i++)
+		{
+			const uint8_t *data = formats[i].m_data;
+			uint32_t left = formats[i].m_size;
+			uint32_t header = (i == 0 ? 4 : 0) + 4 + 4;
+			do
+			{
+				// The first chunk of a format carries its header, and the number of formats before the first format
+				uint32_t piece = left < chunk_size ? left : chunk_size;
+				sAddClipboardChunkHeader(context, UBARRIER_CLIPBOARD_MARK_DATA, header + piece);
+				if (header != 0)
+				{
+					if (i == 0)
+						sAddUInt32(context, (uint32_t)numFormats);
+					sAddUInt32(context, formats[i].m_format);
+					sAddUInt32(context, formats[i].m_size);
+					header = 0;
+				}
+				if (!sGatherData(context, &gather, data, piece))
+					return UBARRIER_FALSE;
+				data += piece;
+				left -= piece;
+			} while (left != 0);
+		}
+		if (numFormats == 0)
+		{
+			// Three headers and no payload in between, make room for the end chunk like a payload would
+			sAddClipboardChunkHeader(context, UBARRIER_CLIPBOARD_MARK_DATA, 4);
+			sAddUInt32(context, 0);
+			if (!sGatherData(context, &gather, 0L, 0))
+				return UBARRIER_FALSE;
+		}
+		sAddClipboardChunkHeader(context, UBARRIER_CLIPBOARD_MARK_END, 0);
 	}
+
+	return sEndGather(context, &gather);
 }
 
 
 
 /**
-@brief Send clipboard data
+@brief Queue clipboard data to be sent by the update thread
 **/
-void uBarrierSendClipboard(uBarrierContext *context, const char *text)
+uBarrierBool uBarrierQueueClipboard(uBarrierContext *context, const uBarrierClipboardData *formats, int numFormats, uBarrierSendDoneCallback doneCallback, void *userData)
 {
-	// Calculate maximum size that will fit in a reply packet
-	uint32_t overhead_size =	4 +					/* Message size */
-								4 +					/* Message ID */
-								1 +					/* Clipboard index */
-								4 +					/* Sequence number */
-								4 +					/* Rest of message size (because it's a Barrier string from here on) */
-								4 +					/* Number of clipboard formats */
-								4 +					/* Clipboard format */
-								4;					/* Clipboard data length */
-	uint32_t max_length = UBARRIER_REPLY_BUFFER_SIZE - overhead_size;
-	
-	// Clip text to max length
-	uint32_t text_length = (uint32_t)strlen(text);
-	if (text_length > max_length)
-	{
-		char buffer[128];
-		sprintf(buffer, "Clipboard buffer too small, clipboard truncated at %d characters", max_length);
-		sTrace(context, buffer);
-		text_length = max_length;
-	}
-
-	// Assemble packet
-	sAddString(context, "DCLP");
-	sAddUInt8(context, 0);							/* Clipboard index */
-	sAddUInt32(context, context->m_sequenceNumber);
-	sAddUInt32(context, 4+4+4+text_length);			/* Rest of message size: numFormats, format, length, data */
-	sAddUInt32(context, 1);							/* Number of formats (only text for now) */
-	sAddUInt32(context, UBARRIER_CLIPBOARD_FORMAT_TEXT);
-	sAddUInt32(context, text_length);
-	sAddString(context, text);
-	sSendReply(context);
+	uint32_t head = context->m_sendQueueHead;
+	uBarrierSendJob *job;
+	if (head - context->m_sendQueueTail >= UBARRIER_SEND_QUEUE_SIZE)
+		return UBARRIER_FALSE;
+	job = &context->m_sendQueue[head & (UBARRIER_SEND_QUEUE_SIZE-1)];
+	job->m_formats		= formats;
+	job->m_numFormats	= numFormats;
+	job->m_doneCallback	= doneCallback;
+	job->m_userData		= userData;
+
+	// Publish the entry after its contents
+	UBARRIER_MEMORY_BARRIER();
+	context->m_sendQueueHead = head+1;
+	return UBARRIER_TRUE;
 }
@@ -24,6 +24,9 @@ freely, subject to the following restrictions:
    3. This notice may not be removed or altered from any source
    distribution.
 */
+#ifndef UBARRIER_CLIENT_H
+#define UBARRIER_CLIENT_H
+
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -59,6 +62,20 @@ extern "C" {
 
 
 
+/**
+@brief Embed default buffers in the context
+
+When UBARRIER_DEFAULT_STORAGE is 1 (the default) the context carries a receive buffer of
+UBARRIER_RECEIVE_BUFFER_SIZE bytes and a reply buffer of UBARRIER_REPLY_BUFFER_SIZE bytes, which uBarrierInit
+uses. Define it as 0 to leave them out; contexts must then be initialized with uBarrierInitArena. The
+setting changes the layout of uBarrierContext, so the library and the application must agree on it.
+**/
+#if !defined(UBARRIER_DEFAULT_STORAGE)
+	#define UBARRIER_DEFAULT_STORAGE	1
+#endif
+
+
+
 //---------------------------------------------------------------------------------------------------------------------
 //	Types and Constants
 //---------------------------------------------------------------------------------------------------------------------
@@ -95,19 +112,327 @@ enum uBarrierClipboardFormat
 
 
 
+/**
+@brief Clipboard chunk types, see uBarrierClipboardChunkCallback
+**/
+enum uBarrierClipboardChunk
+{
+	UBARRIER_CLIPBOARD_CHUNK_BEGIN					= 0,			/* A format starts, its size is passed as total size */
+	UBARRIER_CLIPBOARD_CHUNK_DATA					= 1,			/* Next piece of data of the current format */
+	UBARRIER_CLIPBOARD_CHUNK_END					= 2,			/* The current format is complete */
+	UBARRIER_CLIPBOARD_CHUNK_ABORT					= 3,			/* The transfer broke off, drop data received since BEGIN */
+};
+
+
+
+/**
+@brief Message types, see uBarrierStats
+**/
+enum uBarrierMessageType
+{
+	UBARRIER_MESSAGE_HELLO							= 0,			/* Handshake ("Barrier") */
+	UBARRIER_MESSAGE_QINF,											/* Query screen info */
+	UBARRIER_MESSAGE_CIAK,											/* Info acknowledged */
+	UBARRIER_MESSAGE_CROP,											/* Reset options */
+	UBARRIER_MESSAGE_CINN,											/* Enter screen */
+	UBARRIER_MESSAGE_COUT,											/* Leave screen */
+	UBARRIER_MESSAGE_DMDN,											/* Mouse button down */
+	UBARRIER_MESSAGE_DMUP,											/* Mouse button up */
+	UBARRIER_MESSAGE_DMMV,											/* Mouse move */
+	UBARRIER_MESSAGE_DMRM,											/* Relative mouse move */
+	UBARRIER_MESSAGE_DMWM,											/* Mouse wheel */
+	UBARRIER_MESSAGE_DKDN,											/* Key down */
+	UBARRIER_MESSAGE_DKRP,											/* Key repeat */
+	UBARRIER_MESSAGE_DKUP,											/* Key up */
+	UBARRIER_MESSAGE_DGBT,											/* Joystick buttons */
+	UBARRIER_MESSAGE_DGST,											/* Joystick sticks */
+	UBARRIER_MESSAGE_DSOP,											/* Set options */
+	UBARRIER_MESSAGE_CALV,											/* Keep alive */
+	UBARRIER_MESSAGE_DCLP,											/* Clipboard data */
+	UBARRIER_MESSAGE_CBYE,											/* Server closing */
+	UBARRIER_MESSAGE_EUNK,											/* Client unknown */
+	UBARRIER_MESSAGE_EBSY,											/* Client name busy */
+	UBARRIER_MESSAGE_EICV,											/* Incompatible versions */
+	UBARRIER_MESSAGE_EBAD,											/* Protocol error */
+	UBARRIER_MESSAGE_UNKNOWN,										/* Any message uBarrier doesn't know */
+	UBARRIER_NUM_MESSAGE_TYPES										/* Number of message types */
+};
+
+
+
+/**
+@brief Traffic counters, see uBarrierGetStats
+
+All counters start at zero in uBarrierInit and only ever grow.
+**/
+typedef struct
+{
+	uint64_t						m_numPackets[UBARRIER_NUM_MESSAGE_TYPES];		/* Packets received, per message type */
+	uint64_t						m_numBytesReceived;								/* Bytes returned by the receive function */
+	uint64_t						m_numReceives;									/* Receive calls that returned data */
+	uint64_t						m_numReplies;									/* Reply packets built */
+	uint64_t						m_numSends;										/* Send function calls, vectored sends count once */
+	uint64_t						m_numBytesSent;									/* Bytes passed to the send functions */
+	uint64_t						m_numBytesCompacted;							/* Bytes moved to the front of the receive buffer */
+	uint64_t						m_numMouseMovesCoalesced;						/* Mouse moves replaced by a later one or merged before delivery */
+	uint64_t						m_numShortPackets;								/* Packets too short for their type, dropped */
+	uint64_t						m_numMalformedPackets;							/* Packets that failed validation and were skipped, short packets included */
+	uint64_t						m_numOversizedPackets;							/* Packets larger than the receive buffer, streamed */
+	uint64_t						m_numOversizedDropped;							/* Of those, packets that were dropped */
+	uint64_t						m_numEventsQueued;								/* Events written to the event ring */
+	uint64_t						m_numEventsDropped;								/* Events dropped because the event ring was full */
+	uint32_t						m_numConnects;									/* Successful connection attempts */
+	uint32_t						m_numConnectFailures;							/* Failed connection attempts */
+	uint32_t						m_numDisconnects;								/* Connections lost or dropped */
+} uBarrierStats;
+
+
+
+/**
+@brief Smoothed estimate of a recurring time in nanoseconds, see uBarrierLinkStats
+
+Smoothed the way TCP smooths its round trip time: the average moves 1/8 and the deviation 1/4 of the way
+towards each new sample. The first sample sets the average and leaves the deviation at 0.
+**/
+typedef struct
+{
+	uint64_t						m_count;										/* Number of samples */
+	uint64_t						m_last;											/* Latest sample */
+	uint64_t						m_average;										/* Moving average */
+	uint64_t						m_deviation;									/* Moving mean deviation from the average, the jitter */
+	uint64_t						m_min;											/* Smallest sample */
+	uint64_t						m_max;											/* Largest sample */
+} uBarrierEstimate;
+
+
+
+/**
+@brief Timing of the link to the server, see uBarrierGetLinkStats
+
+Estimates start over with every connection and need m_getTimeNsFunc.
+**/
+typedef struct
+{
+	uBarrierEstimate				m_keepAliveInterval;							/* Time between keep alives (CALV) arriving */
+	uBarrierEstimate				m_keepAliveReply;								/* From a keep alive arriving until the reply was sent */
+	uBarrierEstimate				m_roundTrip;									/* From sending screen info (DINF) until the server acknowledged it (CIAK) */
+} uBarrierLinkStats;
+
+
+
+/**
+@brief Clipboard data of one format, see uBarrierSendClipboardData
+**/
+typedef struct
+{
+	enum uBarrierClipboardFormat	m_format;										/* Clipboard format */
+	const uint8_t*					m_data;											/* Clipboard data, doesn't need to be NUL terminated */
+	uint32_t						m_size;											/* Size of clipboard data */
+} uBarrierClipboardData;
+
+
+
+/**
+@brief Memory block of a vectored send, see uBarrierSendVectorFunc
+**/
+typedef struct
+{
+	const uint8_t*					m_data;											/* Start of memory block */
+	uint32_t						m_size;											/* Size of memory block */
+} uBarrierIOVec;
+
+
+
 /**
 @brief Constants and limits
 **/
 #define				UBARRIER_NUM_JOYSTICKS			4				/* Maximum number of supported joysticks */
 
 #define				UBARRIER_PROTOCOL_MAJOR			1				/* Major protocol version */
-#define				UBARRIER_PROTOCOL_MINOR			4				/* Minor protocol version */
+#define				UBARRIER_PROTOCOL_MINOR			6				/* Minor protocol version */
 
-#define				UBARRIER_IDLE_TIMEOUT			2000			/* Timeout in milliseconds before reconnecting */
+#define				UBARRIER_IDLE_TIMEOUT			9000			/* Default timeout in milliseconds before reconnecting, three keep alives */
+#define				UBARRIER_HEARTBEATS_UNTIL_DEATH	3				/* Keep alives missed before reconnecting when the server set the heartbeat */
+#define				UBARRIER_RECONNECT_DELAY_MIN	250				/* Default delay in milliseconds before the second connection attempt */
+#define				UBARRIER_RECONNECT_DELAY_MAX	10000			/* Default limit in milliseconds of the growing reconnect delay */
+#define				UBARRIER_RECONNECT_DELAY_BUSY	3000			/* Minimum delay in milliseconds after the server reported our name as busy */
+#define				UBARRIER_KEY_REPEAT_DELAY		500				/* Default delay in milliseconds before a held key repeats locally */
+#define				UBARRIER_KEY_REPEAT_INTERVAL	33				/* Default time in milliseconds between local key repeats */
 
 #define				UBARRIER_TRACE_BUFFER_SIZE		1024			/* Maximum length of traced message */
-#define				UBARRIER_REPLY_BUFFER_SIZE		1024			/* Maximum size of a reply packet */
-#define				UBARRIER_RECEIVE_BUFFER_SIZE	4096			/* Maximum size of an incoming packet */
+#define				UBARRIER_REPLY_BUFFER_SIZE		1024			/* Default size of the reply buffer, the maximum size of a reply packet */
+#define				UBARRIER_RECEIVE_BUFFER_SIZE	4096			/* Default size of the receive buffer, larger packets are streamed or dropped */
+#define				UBARRIER_MAX_PACKET_LENGTH		4194304			/* Longest packet Barrier sends, a longer length means the stream is corrupt */
+#define				UBARRIER_MIN_REPLY_BUFFER_SIZE	64				/* Smallest reply buffer accepted by uBarrierInitArena */
+#define				UBARRIER_MIN_RECEIVE_BUFFER_SIZE	128		/* Smallest receive buffer accepted by uBarrierInitArena */
+#define				UBARRIER_CACHE_LINE_SIZE		64				/* Alignment of the buffers in an arena, and padding between the context's blocks */
+#define				UBARRIER_STATS_INTERVAL			100				/* Milliseconds between publications of changed counters, see uBarrierGetStats */
+#define				UBARRIER_CLIPBOARD_CHUNK_SIZE	32768			/* Default size of outgoing clipboard chunks */
+#define				UBARRIER_MAX_SEND_VECTORS		16				/* Maximum number of memory blocks passed to a vectored send */
+#define				UBARRIER_HISTOGRAM_BUCKETS		256				/* Buckets per latency histogram, covers up to 17 seconds */
+#define				UBARRIER_TRACE_RING_SIZE		64				/* Trace records buffered until uBarrierDrainTrace, a power of two */
+#define				UBARRIER_TRACE_RATE_LIMIT		4				/* Traces of one kind recorded per UBARRIER_TRACE_RATE_WINDOW */
+#define				UBARRIER_TRACE_RATE_WINDOW		1000			/* Rate limiting window of traces in milliseconds */
+#define				UBARRIER_SEND_QUEUE_SIZE		8				/* Sends queued by uBarrierQueueClipboard, a power of two */
+
+
+
+/**
+@brief Pipeline stages with a latency histogram, see uBarrierGetHistogram
+**/
+enum uBarrierHistogramStage
+{
+	UBARRIER_HISTOGRAM_DISPATCH						= 0,			/* From the receive function returning until a message was handled */
+	UBARRIER_HISTOGRAM_CALLBACK						= 1,			/* Time spent in one mouse, keyboard, joystick or screen callback */
+	UBARRIER_HISTOGRAM_SEND							= 2,			/* Time spent in one send function call */
+	UBARRIER_HISTOGRAM_BATCH						= 3,			/* From the receive function returning until the batch and its replies were done */
+	UBARRIER_NUM_HISTOGRAMS											/* Number of histograms */
+};
+
+
+
+/**
+@brief Kinds of trace, each has its own text and arguments
+**/
+enum uBarrierTraceEvent
+{
+	UBARRIER_TRACE_CONNECTED						= 0,			/* Handshake done */
+	UBARRIER_TRACE_RECEIVE_FAILED					= 1,			/* Receive function failed (bytes asked, bytes received) */
+	UBARRIER_TRACE_SEND_REPLY_FAILED				= 2,			/* Send function failed while handshaking */
+	UBARRIER_TRACE_SEND_REPLIES_FAILED				= 3,			/* Send function failed on batched replies */
+	UBARRIER_TRACE_SERVER_TIMEOUT					= 4,			/* No data within the idle timeout */
+	UBARRIER_TRACE_SERVER_DISCONNECTING				= 5,			/* CBYE */
+	UBARRIER_TRACE_CLIENT_UNKNOWN					= 6,			/* EUNK */
+	UBARRIER_TRACE_CLIENT_BUSY						= 7,			/* EBSY */
+	UBARRIER_TRACE_PROTOCOL_INCOMPATIBLE			= 8,			/* EICV (server major, server minor) */
+	UBARRIER_TRACE_PROTOCOL_ERROR					= 9,			/* EBAD */
+	UBARRIER_TRACE_UNKNOWN_PACKET					= 10,			/* Unhandled packet type (type) */
+	UBARRIER_TRACE_SHORT_PACKET						= 11,			/* Packet shorter than its type needs (type, length) */
+	UBARRIER_TRACE_OVERSIZED_PACKET					= 12,			/* Packet larger than the receive buffer dropped (type, length) */
+	UBARRIER_TRACE_CLIPBOARD_INCOMPLETE				= 13,			/* Clipboard ended early (bytes received, bytes expected) */
+	UBARRIER_TRACE_CLIPBOARD_TOO_LARGE				= 14,			/* Clipboard needs a chunk callback */
+	UBARRIER_TRACE_SEND_CLIPBOARD_FAILED			= 15,			/* Send function failed on a queued clipboard */
+	UBARRIER_TRACE_CLIENT_NAME_TOO_LONG				= 16,			/* Handshake reply doesn't fit in the reply buffer (size needed, buffer size) */
+	UBARRIER_TRACE_MALFORMED_PACKET					= 17,			/* Packet size contradicts its type or its length fields (type, length) */
+	UBARRIER_TRACE_CLIPBOARD_MALFORMED				= 18,			/* Clipboard count or size runs past the clipboard (size announced, bytes left) */
+	UBARRIER_TRACE_EVENT_RING_SIZE					= 19,			/* Event ring size isn't a power of two, callbacks are used instead (size) */
+	UBARRIER_NUM_TRACE_EVENTS										/* Number of kinds of trace */
+};
+
+
+
+/**
+@brief Trace recorded by the update thread, formatted later by uBarrierDrainTrace
+**/
+typedef struct
+{
+	uint32_t						m_time;											/* Time the trace was recorded */
+	uint16_t						m_event;										/* Kind of trace, see uBarrierTraceEvent */
+	uint16_t						m_suppressed;									/* Traces of this kind dropped by rate limiting before this one */
+	uint32_t						m_args[2];										/* Arguments, packet types as four characters in network order */
+} uBarrierTraceRecord;
+
+
+
+/**
+@brief Log bucketed latency histogram in nanoseconds
+
+Values below 8 get a bucket each, every power of two above that is split into 8 buckets, so a bucket is
+never wider than 1/8 of its values. The last bucket also collects everything larger.
+**/
+typedef struct
+{
+	uint64_t						m_count;										/* Number of recorded values */
+	uint64_t						m_sum;											/* Sum of recorded values */
+	uint64_t						m_max;											/* Largest recorded value */
+	uint32_t						m_buckets[UBARRIER_HISTOGRAM_BUCKETS];			/* Count per bucket */
+} uBarrierHistogram;
+
+
+
+/**
+@brief Kinds of event, see uBarrierEvent
+**/
+enum uBarrierEventType
+{
+	UBARRIER_EVENT_MOUSE_MOVE						= 0,			/* Mouse moved to a position */
+	UBARRIER_EVENT_MOUSE_RELATIVE					= 1,			/* Mouse moved by a distance */
+	UBARRIER_EVENT_MOUSE_BUTTON						= 2,			/* Mouse button pressed or released */
+	UBARRIER_EVENT_MOUSE_WHEEL						= 3,			/* Mouse wheel turned */
+	UBARRIER_EVENT_KEY								= 4,			/* Key pressed, repeated or released */
+	UBARRIER_EVENT_JOYSTICK							= 5,			/* Joystick buttons or sticks changed */
+	UBARRIER_EVENT_CLIPBOARD						= 6,			/* A clipboard format was passed to the clipboard callbacks */
+	UBARRIER_EVENT_SCREEN							= 7,			/* Screen entered or left */
+};
+
+
+
+/**
+@brief Mouse buttons of UBARRIER_EVENT_MOUSE_BUTTON, the numbers Barrier uses
+**/
+#define				UBARRIER_MOUSE_BUTTON_LEFT		1				/* Left button */
+#define				UBARRIER_MOUSE_BUTTON_MIDDLE	2				/* Middle button */
+#define				UBARRIER_MOUSE_BUTTON_RIGHT		3				/* Right button */
+
+
+
+/**
+@brief Decoded input event, see uBarrierNextEvent
+
+A record of 24 bytes. The member of m_data that holds the event is the one named after m_type.
+**/
+typedef struct
+{
+	uint64_t						m_time;											/* Arrival time, see uBarrierGetEventTime */
+	uint32_t						m_type;											/* Kind of event, see uBarrierEventType */
+	union
+	{
+		struct
+		{
+			uint16_t				m_x;											/* New X position */
+			uint16_t				m_y;											/* New Y position */
+		}							m_move;											/* UBARRIER_EVENT_MOUSE_MOVE */
+		struct
+		{
+			int32_t					m_dx;											/* Horizontal distance in pixels, positive is to the right */
+			int32_t					m_dy;											/* Vertical distance in pixels, positive is down */
+		}							m_relative;										/* UBARRIER_EVENT_MOUSE_RELATIVE */
+		struct
+		{
+			uint16_t				m_x;											/* X position */
+			uint16_t				m_y;											/* Y position */
+			uint8_t					m_button;										/* Button, UBARRIER_MOUSE_BUTTON_* */
+			uint8_t					m_down;											/* 1 if pressed, 0 if released */
+		}							m_button;										/* UBARRIER_EVENT_MOUSE_BUTTON */
+		struct
+		{
+			int16_t					m_dx;											/* Horizontal wheel distance */
+			int16_t					m_dy;											/* Vertical wheel distance */
+		}							m_wheel;										/* UBARRIER_EVENT_MOUSE_WHEEL */
+		struct
+		{
+			uint16_t				m_key;											/* Key code */
+			uint16_t				m_modifiers;									/* Modifier keys, UBARRIER_MODIFIER_* */
+			uint16_t				m_repeat;										/* Repeats this event stands for, see uBarrierKeyboardCallback */
+			uint8_t					m_down;											/* 1 if pressed or repeated, 0 if released */
+		}							m_key;											/* UBARRIER_EVENT_KEY */
+		struct
+		{
+			uint8_t					m_joystick;										/* Joystick number, in range [0 ... UBARRIER_NUM_JOYSTICKS> */
+			int8_t					m_sticks[4];									/* Left X, left Y, right X and right Y stick position */
+			uint16_t				m_buttons;										/* Button pressed mask */
+		}							m_joystick;										/* UBARRIER_EVENT_JOYSTICK */
+		struct
+		{
+			uint32_t				m_format;										/* Clipboard format, see uBarrierClipboardFormat */
+			uint32_t				m_size;											/* Size of the format */
+		}							m_clipboard;									/* UBARRIER_EVENT_CLIPBOARD */
+		struct
+		{
+			uint8_t					m_active;										/* 1 if the screen was entered, 0 if it was left */
+		}							m_screen;										/* UBARRIER_EVENT_SCREEN */
+	}								m_data;											/* Event data */
+} uBarrierEvent;
 
 
 
@@ -155,7 +480,7 @@ typedef uBarrierBool (*uBarrierConnectFunc)(uBarrierCookie cookie);
 
 This function is called when uBarrier needs to send something over the default connection. It should return
 UBARRIER_TRUE if sending succeeded and UBARRIER_FALSE otherwise. This function should block until the send
-operation is completed.
+operation is completed. send() may write fewer bytes than asked, the function must then send the rest.
 
 @param cookie		Cookie supplied in the Barrier context
 @param buffer		Address of buffer to send
@@ -165,6 +490,23 @@ typedef uBarrierBool (*uBarrierSendFunc)(uBarrierCookie cookie, const uint8_t *b
 
 
 
+/**
+@brief Vectored send function
+
+This optional function sends several memory blocks, in order, as if they were one buffer. It is the
+equivalent of writev() and lets uBarrier send large payloads straight from the application's memory. It
+should return UBARRIER_TRUE if sending succeeded and UBARRIER_FALSE otherwise. This function should block
+until the send operation is completed, writev() may stop in the middle of any block. When it is not supplied
+the send function is called for every block.
+
+@param cookie		Cookie supplied in the Barrier context
+@param vectors		Memory blocks to send
+@param count		Number of memory blocks, at most UBARRIER_MAX_SEND_VECTORS
+**/
+typedef uBarrierBool (*uBarrierSendVectorFunc)(uBarrierCookie cookie, const uBarrierIOVec *vectors, int count);
+
+
+
 /**
 @brief Receive function
 
@@ -182,6 +524,51 @@ typedef uBarrierBool (*uBarrierReceiveFunc)(uBarrierCookie cookie, uint8_t *buff
 
 
 
+/**
+@brief Timed receive function
+
+This optional function replaces the receive function and also reports when the data arrived, in the time
+base of m_getTimeNsFunc. A socket can usually tell: on Linux, SO_TIMESTAMPNS or SO_TIMESTAMPING hand the
+time the kernel received the data to recvmsg(), which has to be converted from CLOCK_REALTIME. Leave
+@a outTimeNs at 0 if the time isn't known, uBarrier then uses the time the function returned. See
+uBarrierGetEventTime.
+
+@param cookie		Cookie supplied in the Barrier context
+@param buffer		Address of buffer to receive data into
+@param maxLength	Maximum amount of bytes to write into the receive buffer
+@param outLength	Address of integer that receives the actual amount of bytes written into @a buffer
+@param outTimeNs	Address of the arrival time of the last byte received, 0 on entry
+**/
+typedef uBarrierBool (*uBarrierReceiveTimedFunc)(uBarrierCookie cookie, uint8_t *buffer, int maxLength, int* outLength, uint64_t* outTimeNs);
+
+
+
+/**
+@brief Get descriptor function
+
+This optional function returns the file descriptor (or socket handle) of the current connection, so
+uBarrierGetFd can hand it to the application's event loop. It should return -1 if there is no connection.
+
+@param cookie		Cookie supplied in the Barrier context
+@returns			Descriptor of the connection, or -1
+**/
+typedef int			(*uBarrierGetFdFunc)(uBarrierCookie cookie);
+
+
+
+/**
+@brief Get precise time function
+
+This optional function returns a monotonic time in nanoseconds. When it is supplied uBarrier records
+latency histograms of its pipeline stages, see uBarrierGetHistogram. It is called a few times per
+message, so it should be cheap, like clock_gettime(CLOCK_MONOTONIC) or system_time().
+
+@returns			Time value in nanoseconds
+**/
+typedef uint64_t	(*uBarrierGetTimeNsFunc)();
+
+
+
 /**
 @brief Thread sleep function
 
@@ -215,6 +602,9 @@ This function is called when uBarrier wants to trace something. It is optional t
 are often useful when debugging. uBarrier only traces major events like connecting and disconnecting. Usually
 only a single trace is shown when the connection is established and no more trace are called.
 
+Traces are recorded into a ring and formatted by uBarrierDrainTrace, which calls this function. Unless
+m_deferTrace is set, uBarrierUpdate and uBarrierPoll drain the ring before returning.
+
 @param cookie		Cookie supplied in the Barrier context
 @param text			Text to be traced
 **/
@@ -255,6 +645,22 @@ typedef void		(*uBarrierMouseCallback)(uBarrierCookie cookie, uint16_t x, uint16
 
 
 
+/**
+@brief Relative mouse move callback
+
+This callback is called when the server moves the mouse by a distance instead of to a position, which servers
+do for clients that grabbed the mouse, like games. When coalescing, the moves of a receive batch are summed
+up and delivered once. Without this callback relative moves update the position passed to the mouse callback,
+clamped to the screen.
+
+@param cookie		Cookie supplied in the Barrier context
+@param dx			Horizontal distance in pixels, positive is to the right
+@param dy			Vertical distance in pixels, positive is down
+**/
+typedef void		(*uBarrierMouseRelativeCallback)(uBarrierCookie cookie, int32_t dx, int32_t dy);
+
+
+
 /**
 @brief Key event callback
 
@@ -264,9 +670,9 @@ This callback is called when a key is pressed or released.
 @param key			Key code of key that was pressed or released
 @param modifiers	Status of modifier keys (alt, shift, etc.)
 @param down			Down or up status, 1 is key is pressed down, 0 if key is released (up)
-@param repeat		Repeat flag, 1 if the key is down because the key is repeating, 0 if the key is initially pressed by the user
+@param repeat		Number of repeats this event stands for, 0 if the key is initially pressed by the user or released
 **/
-typedef void		(*uBarrierKeyboardCallback)(uBarrierCookie cookie, uint16_t key, uint16_t modifiers, uBarrierBool down, uBarrierBool repeat);
+typedef void		(*uBarrierKeyboardCallback)(uBarrierCookie cookie, uint16_t key, uint16_t modifiers, uBarrierBool down, uint16_t repeat);
 
 
 
@@ -306,6 +712,68 @@ typedef void		(*uBarrierClipboardCallback)(uBarrierCookie cookie, enum uBarrierC
 
 
 
+/**
+@brief Clipboard chunk callback
+
+This callback streams clipboard data of any size. For every format on the clipboard it receives a BEGIN
+chunk carrying the size of the format, any number of DATA chunks and an END chunk. An ABORT chunk replaces
+the END chunk if the transfer broke off, for example because the connection was lost. DATA chunks point
+straight into the receive buffer and are only valid during the callback.
+
+When this callback is installed m_clipboardCallback is not called. Without it, m_clipboardCallback only
+receives formats that fit in the receive buffer.
+
+@param cookie		Cookie supplied in the Barrier context
+@param chunk		Chunk type
+@param format		Clipboard format
+@param data			Clipboard data for DATA chunks, 0L otherwise
+@param size			Size of @a data
+@param totalSize	Total size of the format
+**/
+typedef void		(*uBarrierClipboardChunkCallback)(uBarrierCookie cookie, enum uBarrierClipboardChunk chunk, enum uBarrierClipboardFormat format, const uint8_t *data, uint32_t size, uint32_t totalSize);
+
+
+
+/**
+@brief Events ready callback
+
+This optional callback is called by the update thread at the end of every receive batch that wrote events to
+the event ring, so the thread draining the ring can be woken, for example through a semaphore or a pipe.
+
+@param cookie		Cookie supplied in the Barrier context
+**/
+typedef void		(*uBarrierEventsReadyCallback)(uBarrierCookie cookie);
+
+
+
+/**
+@brief Send done callback
+
+This callback is called by the update thread once a send queued with uBarrierQueueClipboard is over, because
+it was sent or because it was dropped with the connection. The memory handed to uBarrierQueueClipboard may be
+released from here on.
+
+@param cookie		Cookie supplied in the Barrier context
+@param userData		User data passed to uBarrierQueueClipboard
+@param sent			UBARRIER_TRUE if the data was sent, UBARRIER_FALSE if it was dropped
+**/
+typedef void		(*uBarrierSendDoneCallback)(uBarrierCookie cookie, void *userData, uBarrierBool sent);
+
+
+
+/**
+@brief Send queued by uBarrierQueueClipboard
+**/
+typedef struct
+{
+	const uBarrierClipboardData*	m_formats;										/* Clipboard data, one entry per format */
+	int								m_numFormats;									/* Number of entries in m_formats */
+	uBarrierSendDoneCallback		m_doneCallback;									/* Called when the send is over (can be NULL) */
+	void*							m_userData;										/* Passed to m_doneCallback */
+} uBarrierSendJob;
+
+
+
 //---------------------------------------------------------------------------------------------------------------------
 //	Context
 //---------------------------------------------------------------------------------------------------------------------
@@ -327,25 +795,49 @@ typedef struct
 	uint16_t						m_clientWidth;									/* Width of screen */
 	uint16_t						m_clientHeight;									/* Height of screen */
 
-	/* Optional configuration data, filled in by client */
+	/* Optional configuration data, filled in by client, the ones read for every packet first */
 	uBarrierCookie					m_cookie;										/* Cookie pointer passed to callback functions (can be NULL) */
+	uBarrierMouseCallback			m_mouseCallback;								/* Callback for mouse events */
+	uBarrierEvent*					m_eventRing;									/* Ring that replaces the input callbacks, see uBarrierNextEvent (can be NULL) */
+	uint32_t						m_eventRingSize;								/* Number of events in m_eventRing, a power of two */
+	uBarrierGetTimeNsFunc			m_getTimeNsFunc;								/* Precise time function, enables latency histograms (can be NULL) */
+	uBarrierReceiveTimedFunc		m_receiveTimedFunc;								/* Receive function reporting arrival times, replaces m_receiveFunc (can be NULL) */
 	uBarrierTraceFunc				m_traceFunc;									/* Function for tracing status (can be NULL) */
+	uBarrierBool					m_batchReplies;									/* Send all replies to a receive batch with one send call */
+	uBarrierBool					m_coalesceMouseMoves;							/* Collapse consecutive mouse moves in a receive batch into the last one */
+	uBarrierBool					m_deferTrace;									/* Leave traces to uBarrierDrainTrace called by another thread */
 	uBarrierScreenActiveCallback	m_screenActiveCallback;							/* Callback for entering and leaving screen */
-	uBarrierMouseCallback			m_mouseCallback;								/* Callback for mouse events */
 	uBarrierKeyboardCallback		m_keyboardCallback;								/* Callback for keyboard events */
 	uBarrierJoystickCallback		m_joystickCallback;								/* Callback for joystick events */
 	uBarrierClipboardCallback		m_clipboardCallback;							/* Callback for clipboard events */
-
-	/* State data, used internall by client, initialized by uBarrierInit() */
+	uBarrierClipboardChunkCallback	m_clipboardChunkCallback;						/* Callback for streamed clipboard data (can be NULL) */
+	uint32_t						m_clipboardChunkSize;							/* Maximum size of a DATA chunk and of an outgoing chunk, 0 for defaults */
+	uBarrierSendVectorFunc			m_sendVectorFunc;								/* Vectored send function (can be NULL) */
+	uBarrierGetFdFunc				m_getFdFunc;									/* Get descriptor function, needed for uBarrierGetFd (can be NULL) */
+	uint32_t						m_idleTimeout;									/* Milliseconds without data before reconnecting, 0 to follow the server's keep alives */
+	uint32_t						m_reconnectDelayMin;							/* Delay before the second connection attempt, 0 for UBARRIER_RECONNECT_DELAY_MIN */
+	uint32_t						m_reconnectDelayMax;							/* Limit of the reconnect delay, 0 for UBARRIER_RECONNECT_DELAY_MAX */
+	uBarrierMouseRelativeCallback	m_mouseRelativeCallback;						/* Callback for relative mouse moves (can be NULL) */
+	int32_t							m_mouseRelativeScale;							/* Relative move multiplier in 16.16 fixed point, 0 for 1.0 */
+	uBarrierBool					m_localKeyRepeat;								/* Repeat held keys from a local timer and ignore the server's repeats */
+	uint32_t						m_keyRepeatDelay;								/* Local repeat delay, 0 for UBARRIER_KEY_REPEAT_DELAY */
+	uint32_t						m_keyRepeatInterval;							/* Time between local repeats, 0 for UBARRIER_KEY_REPEAT_INTERVAL */
+	uBarrierEventsReadyCallback		m_eventsReadyCallback;							/* Callback after a batch wrote events to m_eventRing (can be NULL) */
+
+	/* State data, used internally by client, initialized by uBarrierInit() */
+	/* Hot state, touched by every packet: two cache lines when the context starts on one */
+	uint8_t*						m_receiveBuffer;								/* Receive buffer, m_receiveBufferSize bytes */
+	uint8_t*						m_replyBuffer;									/* Reply buffer, m_replyBufferSize bytes */
+	uint8_t*						m_replyPacket;									/* Start of reply packet being built */
+	uint8_t*						m_replyCur;										/* Write offset into reply buffer */
+	int								m_receiveOfs;									/* Receive buffer offset */
+	uint32_t						m_streamLeft;									/* Bytes left of a packet too large for the receive buffer */
 	uBarrierBool					m_connected;									/* Is our socket connected? */
 	uBarrierBool					m_hasReceivedHello;								/* Have we received a 'Hello' from the server? */
 	uBarrierBool					m_isCaptured;									/* Is Barrier active (i.e. this client is receiving input messages?) */
+	uBarrierBool					m_polling;										/* Driven by uBarrierPoll, never sleep */
 	uint32_t						m_lastMessageTime;								/* Time at which last message was received */
-	uint32_t						m_sequenceNumber;								/* Packet sequence number */
-	uint8_t							m_receiveBuffer[UBARRIER_RECEIVE_BUFFER_SIZE];	/* Receive buffer */
-	int								m_receiveOfs;									/* Receive buffer offset */
-	uint8_t							m_replyBuffer[UBARRIER_REPLY_BUFFER_SIZE];		/* Reply buffer */
-	uint8_t*						m_replyCur;										/* Write offset into reply buffer */
+	uBarrierBool					m_keyRepeatActive;								/* A key is held and repeats locally */
 	uint16_t						m_mouseX;										/* Mouse X position */
 	uint16_t						m_mouseY;										/* Mouse Y position */
 	int16_t							m_mouseWheelX;									/* Mouse wheel X position */
@@ -353,8 +845,87 @@ typedef struct
 	uBarrierBool					m_mouseButtonLeft;								/* Mouse left button */
 	uBarrierBool					m_mouseButtonRight;								/* Mouse right button */
 	uBarrierBool					m_mouseButtonMiddle;							/* Mouse middle button */
+	uBarrierBool					m_mouseMovePending;								/* Coalesced mouse move not delivered yet */
+	uBarrierBool					m_mouseRelativePending;							/* Summed relative mouse move not delivered yet */
+	uBarrierBool					m_eventsPending;								/* Events were written to the ring during this batch */
+	uBarrierBool					m_statsChanged;									/* Counters changed since they were last published */
+	uBarrierBool					m_linkChanged;									/* Link timing changed since it was last published */
+	uint32_t						m_receiveBufferSize;							/* Size of the receive buffer */
+	uint64_t						m_receiveTime;									/* Time the receive function returned the current batch */
+	uint64_t						m_eventTime;									/* Arrival time of the data behind the current callback */
+
+	/* State shared with other threads, read by every update, padded off the lines the update thread writes */
+	uint8_t							m_sharedPad[UBARRIER_CACHE_LINE_SIZE];			/* Separates the hot state from the shared state */
+	volatile uint32_t				m_statsSequence;								/* Odd while m_statsSnapshot is being written */
+	volatile uBarrierBool			m_resetHistograms;								/* Clear the histograms at the start of the next update */
+	volatile uint32_t				m_traceHead;									/* Number of traces recorded, only written by the update thread */
+	volatile uint32_t				m_traceTail;									/* Number of traces drained, only written by the draining thread */
+	volatile uint32_t				m_traceLost;									/* Traces dropped because the ring was full */
+	volatile uint32_t				m_sendQueueHead;								/* Number of sends queued, only written by the queueing thread */
+	volatile uint32_t				m_sendQueueTail;								/* Number of sends done, only written by the update thread */
+	volatile uint32_t				m_eventHead;									/* Number of events written, only written by the update thread */
+	volatile uint32_t				m_eventTail;									/* Number of events read, only written by the consuming thread */
+
+	/* Counters, written by every update that receives or sends */
+	uint8_t							m_countersPad[UBARRIER_CACHE_LINE_SIZE];		/* Separates the shared state from the counters */
+	uBarrierStats					m_stats;										/* Traffic counters, only touched by the update thread */
+
+	/* Published copies, read by other threads */
+	uint8_t							m_snapshotPad[UBARRIER_CACHE_LINE_SIZE];		/* Separates the counters from their published copy */
+	uBarrierStats					m_statsSnapshot;								/* Copy of m_stats published for uBarrierGetStats */
+	uBarrierLinkStats				m_linkSnapshot;									/* Copy of m_link published for uBarrierGetLinkStats */
+
+	/* Cold state */
+	int64_t							m_mouseRelativeX;								/* Relative X distance in 16.16 fixed point, fraction kept between moves */
+	int64_t							m_mouseRelativeY;								/* Relative Y distance in 16.16 fixed point, fraction kept between moves */
+	uBarrierLinkStats				m_link;											/* Link timing, only touched by the update thread */
+	uint32_t						m_statsPublishTime;								/* Time the counters were last published */
+	uint32_t						m_replyBufferSize;								/* Size of the reply buffer */
+	uint32_t						m_sequenceNumber;								/* Packet sequence number */
+	uint16_t						m_protocolMinor;								/* Minor protocol version agreed with the server */
+	uint16_t						m_optionHalfDuplex;								/* Half duplex lock keys (HDCL, HDNL, HDSL) as UBARRIER_MODIFIER_*LOCK */
+	uBarrierBool					m_reconnectDelayed;								/* Don't connect before m_reconnectTime */
+	uint32_t						m_reconnectTime;								/* Time of the next connection attempt */
+	uint32_t						m_reconnectAttempts;							/* Connection attempts since the last successful handshake */
+	uint32_t						m_randomState;									/* Random number state for reconnect jitter */
 	int8_t							m_joystickSticks[UBARRIER_NUM_JOYSTICKS][4];	/* Joystick stick position in 2 axes for 2 sticks */
 	uint16_t						m_joystickButtons[UBARRIER_NUM_JOYSTICKS];		/* Joystick button state */
+	uint64_t						m_keepAliveTime;								/* Arrival time of the last keep alive, 0 for none */
+	uint64_t						m_keepAliveReplyTime;							/* Arrival time of a keep alive whose reply wasn't sent yet, 0 for none */
+	uBarrierBool					m_infoReplyPending;								/* Screen info was built but not sent yet */
+	uint64_t						m_infoSentTime;									/* Time the screen info was sent, 0 if not waiting for CIAK */
+	uBarrierBool					m_optionHeartbeatSet;							/* Has the server set the heartbeat (HART)? */
+	uint32_t						m_optionHeartbeat;								/* Keep alive interval in milliseconds set by the server, 0 for none */
+	uBarrierBool					m_optionScreenSaverSync;						/* Should the screen saver follow the server's (SSVR)? */
+	uBarrierBool					m_optionClipboardSharing;						/* Does the server share the clipboard (CLPS)? */
+	uBarrierBool					m_optionRelativeMouseMoves;						/* Does the server send relative mouse moves (MDLT)? */
+	uint16_t						m_keyRepeatKey;									/* Key repeating locally */
+	uint16_t						m_keyRepeatModifiers;							/* Modifiers of the key repeating locally */
+	uint32_t						m_keyRepeatTime;								/* Time of the next local repeat */
+	uBarrierBool					m_streamToClipboard;							/* Streamed packet feeds the clipboard decoder (else it's dropped) */
+	uBarrierBool					m_streamEndsClipboard;							/* Clipboard is complete at the end of the streamed packet */
+	int								m_clipboardState;								/* Clipboard decoder state */
+	uint32_t						m_clipboardExpected;							/* Expected size of the marshalled clipboard */
+	uint32_t						m_clipboardReceived;							/* Bytes of marshalled clipboard decoded so far */
+	uint32_t						m_clipboardFormatsLeft;							/* Number of formats still to come */
+	uint32_t						m_clipboardFormat;								/* Current format */
+	uint32_t						m_clipboardSize;								/* Size of the current format */
+	uint32_t						m_clipboardLeft;								/* Bytes left of the current format */
+	uint8_t							m_clipboardHeader[8];							/* Format count or format header being assembled */
+	uint32_t						m_clipboardHeaderFill;							/* Bytes in m_clipboardHeader */
+	uBarrierHistogram				m_histograms[UBARRIER_NUM_HISTOGRAMS];			/* Latency histograms, only touched by the update thread */
+	uBarrierTraceRecord				m_traceRing[UBARRIER_TRACE_RING_SIZE];			/* Traces not drained yet */
+	uint32_t						m_traceLostReported;							/* Value of m_traceLost last reported by the draining thread */
+	uint32_t						m_traceWindowStart[UBARRIER_NUM_TRACE_EVENTS];	/* Start of the current rate limiting window per kind */
+	uint16_t						m_traceWindowCount[UBARRIER_NUM_TRACE_EVENTS];	/* Traces recorded in the current window per kind */
+	uint16_t						m_traceSuppressed[UBARRIER_NUM_TRACE_EVENTS];	/* Traces dropped by rate limiting per kind */
+	uBarrierSendJob					m_sendQueue[UBARRIER_SEND_QUEUE_SIZE];			/* Sends not done yet */
+
+#if UBARRIER_DEFAULT_STORAGE
+	/* Default storage of the buffers, kept behind all other state */
+	uint8_t							m_receiveStorage[UBARRIER_RECEIVE_BUFFER_SIZE];	/* Receive buffer storage */
+	uint8_t							m_replyStorage[UBARRIER_REPLY_BUFFER_SIZE];		/* Reply buffer storage */
+#endif
 } uBarrierContext;
 
 
@@ -365,6 +936,7 @@ typedef struct
 
 
 
+#if UBARRIER_DEFAULT_STORAGE
 /**
 @brief Initialize uBarrier context
 
@@ -372,9 +944,42 @@ This function initializes @a context for use. Call this function directly after
 creating the context, before filling in any configuration data in it. Not calling
 this function will cause undefined behavior.
 
+The context uses the buffers embedded in it, see uBarrierInitArena for other sizes.
+
 @param context	Context to be initialized
 **/
 extern void		uBarrierInit(uBarrierContext *context);
+#endif
+
+
+
+/**
+@brief Size of an arena for uBarrierInitArena
+
+Room for both buffers, each aligned to a cache line wherever the arena starts.
+**/
+#define				UBARRIER_ARENA_SIZE(receiveSize, replySize)		((receiveSize) + (replySize) + 2*UBARRIER_CACHE_LINE_SIZE)
+
+
+
+/**
+@brief Initialize uBarrier context with buffers in caller memory
+
+Like uBarrierInit, but the receive and reply buffers are carved out of @a arena with sizes chosen at run time.
+A small receive buffer suits clients that don't take clipboards; packets that don't fit are streamed to the
+clipboard chunk callback or dropped. A large one lets the plain clipboard callback take large clipboards.
+The reply buffer must hold the handshake reply, which carries the client name, and limits how many replies
+are batched. The arena must stay valid for as long as the context is used. uBarrier never allocates it or
+frees it.
+
+@param context		Context to be initialized
+@param arena		Memory for the buffers
+@param arenaSize	Size of @a arena, at least UBARRIER_ARENA_SIZE(@a receiveSize, @a replySize)
+@param receiveSize	Size of the receive buffer, at least UBARRIER_MIN_RECEIVE_BUFFER_SIZE
+@param replySize	Size of the reply buffer, at least UBARRIER_MIN_REPLY_BUFFER_SIZE
+@returns			UBARRIER_TRUE if the context was initialized, UBARRIER_FALSE if a size is out of range
+**/
+extern uBarrierBool	uBarrierInitArena(uBarrierContext *context, void *arena, uint32_t arenaSize, uint32_t receiveSize, uint32_t replySize);
 
 
 
@@ -392,12 +997,252 @@ waiting for system mutexes and won't eat much memory.
 uBarrierUpdate doesn't do any memory allocations or have any side effects beyond those of
 the callbacks it calls.
 
+Local key repeat (m_localKeyRepeat) needs a receive function that returns without data once
+uBarrierNextTimeout has passed, or repeats only go out when the next packet arrives.
+
 @param context	Context to be updated
 **/
 extern void		uBarrierUpdate(uBarrierContext *context);
 
 
 
+/**
+@brief Poll uBarrier
+
+This function is the non-blocking counterpart of uBarrierUpdate, for applications that run uBarrier from
+their own poll(), epoll or select loop. It processes whatever data is available and returns without ever
+calling the sleep function. Instead of sleeping after an error it schedules the next connection attempt,
+see uBarrierNextTimeout.
+
+The receive function must not block: when no data is available it should return UBARRIER_TRUE with
+@a outLength set to 0. It should only return UBARRIER_FALSE for errors and when the connection was closed.
+The connect function is still called from uBarrierPoll.
+
+Call uBarrierPoll when the descriptor returned by uBarrierGetFd becomes readable, and when the time
+returned by uBarrierNextTimeout has passed. Don't mix uBarrierPoll and uBarrierUpdate on one context.
+
+@param context	Context to be polled
+**/
+extern void		uBarrierPoll(uBarrierContext *context);
+
+
+
+/**
+@brief Get descriptor of the connection
+
+Returns the descriptor to wait on for readability before calling uBarrierPoll. The descriptor changes when
+uBarrier reconnects, so fetch it again after every call to uBarrierPoll.
+
+@param context	Context to query
+@returns		Descriptor of the connection, or -1 if not connected or m_getFdFunc is not supplied
+**/
+extern int		uBarrierGetFd(uBarrierContext *context);
+
+
+
+/**
+@brief Get time until uBarrierPoll must be called
+
+Returns the time until the next timer expires, for example the idle timeout, the next local key repeat or
+the next connection attempt. uBarrierPoll must be called once that time has passed, even if no data arrived.
+While sends queued by uBarrierQueueClipboard are waiting it returns 0.
+
+@param context	Context to query
+@returns		Time in milliseconds, 0 if uBarrierPoll should be called right away, or -1 if there is no timer
+**/
+extern int		uBarrierNextTimeout(uBarrierContext *context);
+
+
+
+/**
+@brief Get time until the next connection attempt
+
+After the connection is lost the first attempt is made right away, further attempts back off
+exponentially from m_reconnectDelayMin up to m_reconnectDelayMax with random jitter. Errors
+that retrying can't fix quickly, like an incompatible protocol version, wait the longest delay.
+
+@param context	Context to query
+@returns		Time in milliseconds, 0 if the attempt is due, or -1 if connected
+**/
+extern int		uBarrierGetReconnectTime(uBarrierContext *context);
+
+
+
+/**
+@brief Get the arrival time of the event being delivered
+
+Call it from a mouse, keyboard, joystick, screen or clipboard callback. It returns the time the data behind
+the event arrived: the time m_receiveTimedFunc reported, or else the time the receive function returned.
+Events that uBarrier makes up itself, like local key repeats, get the time they were sent. The time base is
+m_getTimeNsFunc, so the delay until the event is injected is m_getTimeNsFunc() minus this.
+
+@param context	Context of the callback
+@returns		Time in nanoseconds, 0 without m_getTimeNsFunc or a reported time
+**/
+extern uint64_t	uBarrierGetEventTime(const uBarrierContext *context);
+
+
+
+/**
+@brief Get traffic counters
+
+Copies a consistent snapshot of the counters in @a context to @a stats. It may be called from any thread.
+The counters are updated without locks while uBarrier runs. Copying them for every packet would touch more
+memory than handling the packet, so the update thread publishes changed counters at the end of an update
+at most every UBARRIER_STATS_INTERVAL milliseconds. Publishing never wakes the update thread by itself: the
+counters of the last updates before the server goes quiet show up with its next keep alive. The update
+thread can publish right away with uBarrierPublishStats.
+
+@param context	Context to query
+@param stats	Receives the counters
+**/
+extern void		uBarrierGetStats(const uBarrierContext *context, uBarrierStats *stats);
+
+
+
+/**
+@brief Publish the traffic counters now
+
+Makes the counters and link timing visible to uBarrierGetStats and uBarrierGetLinkStats without waiting for
+UBARRIER_STATS_INTERVAL. Call it from the update thread, for example before reading the counters on that
+thread or after its last update.
+
+@param context	Context to publish
+**/
+extern void		uBarrierPublishStats(uBarrierContext *context);
+
+
+
+/**
+@brief Get link timing
+
+Copies a consistent snapshot of the link estimates. They are published at the end of every update that
+changed them, under the same lock as the traffic counters. It may be called from any thread.
+
+Barrier's keep alives carry no time stamps and the server doesn't answer the client's, so the round trip
+is timed on the screen info exchange, which servers run once per connection and when they query the
+screen again. Keep alives still show how the link behaves all the time: the server sends them at a fixed
+rate, so a growing deviation of m_keepAliveInterval means the delay through the network varies. The idle
+timeout stretches along, see m_idleTimeout.
+
+@param context	Context to query
+@param link		Receives the estimates, all zero without m_getTimeNsFunc
+**/
+extern void		uBarrierGetLinkStats(const uBarrierContext *context, uBarrierLinkStats *link);
+
+
+
+/**
+@brief Get a latency histogram
+
+Copies the histogram of pipeline stage @a stage. Histograms are only recorded when m_getTimeNsFunc is
+supplied. This function may be called from any thread; values recorded while it copies may be missing
+from the copy or counted in some fields only.
+
+@param context		Context to query
+@param stage		Pipeline stage
+@param histogram	Receives the histogram
+**/
+extern void		uBarrierGetHistogram(const uBarrierContext *context, enum uBarrierHistogramStage stage, uBarrierHistogram *histogram);
+
+
+
+/**
+@brief Get a percentile of a latency histogram
+
+@param histogram	Histogram to evaluate
+@param percentile	Percentile, in range [0 ... 100]
+@returns			Highest value in the bucket holding the percentile, but no more than the largest value seen,
+					in nanoseconds, 0 if the histogram is empty
+**/
+extern uint64_t	uBarrierHistogramPercentile(const uBarrierHistogram *histogram, double percentile);
+
+
+
+/**
+@brief Clear all latency histograms
+
+The histograms are cleared by the update thread at the start of its next update, so this function may be
+called from any thread.
+
+@param context	Context to reset
+**/
+extern void		uBarrierResetHistograms(uBarrierContext *context);
+
+
+
+/**
+@brief Format a summary of all latency histograms
+
+Writes one line per pipeline stage with the number of values, the mean, the median, the 90th, 99th and
+99.9th percentile and the maximum in microseconds to @a buffer.
+
+@param context	Context to query
+@param buffer	Receives the NUL terminated text
+@param size		Size of @a buffer, 512 bytes are enough
+@returns		Length of the text, without the terminating NUL, at most @a size-1 when it was truncated
+**/
+extern int		uBarrierFormatHistograms(const uBarrierContext *context, char *buffer, int size);
+
+
+
+/**
+@brief Deliver recorded traces
+
+Formats the traces recorded since the last call and passes them to m_traceFunc. With m_deferTrace set this
+must be called regularly, from one thread at a time, which may be another thread than the update thread;
+otherwise uBarrierUpdate and uBarrierPoll call it. Traces that overflow the ring are counted and reported
+as lost.
+
+@param context	Context to drain
+@returns		Number of traces delivered
+**/
+extern int		uBarrierDrainTrace(uBarrierContext *context);
+
+
+
+/**
+@brief Take the next event from the event ring
+
+Setting m_eventRing switches the context from callbacks to events: instead of calling the mouse, relative
+mouse, keyboard, joystick and screen active callbacks, the update thread writes a uBarrierEvent per input
+to the ring and another thread takes them out with this function or uBarrierDrainEvents. The ring is a
+lock-free ring with one producer and one consumer, so decoding and injection run on their own threads
+and the consumer handles whole batches at a time. Set m_eventRing and m_eventRingSize after uBarrierInit
+and before connecting; a size that isn't a power of two is traced and turns the ring off again.
+The ring must stay valid for as long as the context is used. m_eventsReadyCallback tells the consumer when
+a batch was queued; the callback latency histogram stays empty in this mode.
+
+Events come in the order of the messages that caused them. Mouse moves and wheel turns carry what changed
+rather than the whole mouse state, relative moves are always delivered as UBARRIER_EVENT_MOUSE_RELATIVE.
+Clipboard data stays behind in the receive buffer, so it still goes to the clipboard callbacks on the update
+thread; UBARRIER_EVENT_CLIPBOARD follows once a format is complete. When the ring is full new events are
+dropped and counted in m_numEventsDropped, so size it for the longest burst the consumer may fall behind.
+
+Only one thread at a time may take events out of a context.
+
+@param context	Context to read from
+@param event	Receives the event
+@returns		UBARRIER_TRUE if an event was taken, UBARRIER_FALSE if the ring is empty
+**/
+extern uBarrierBool	uBarrierNextEvent(uBarrierContext *context, uBarrierEvent *event);
+
+
+
+/**
+@brief Take all waiting events from the event ring, up to @a maxEvents
+
+Like uBarrierNextEvent, but copies a batch with one pass over the ring's counters.
+
+@param context		Context to read from
+@param events		Receives the events, oldest first
+@param maxEvents	Number of entries in @a events
+@returns			Number of events taken
+**/
+extern int		uBarrierDrainEvents(uBarrierContext *context, uBarrierEvent *events, int maxEvents);
+
+
+
 /**
 @brief Send clipboard data
 
@@ -408,13 +1253,61 @@ server.
 Currently there is only support for plaintext, but HTML and image data could be
 supported with some effort.
 
+Like uBarrierSendClipboardData this must be called from the update thread, other
+threads use uBarrierQueueClipboard.
+
 @param context	Context to send clipboard data to
-@param text		Text to set to the clipboard
+@param text		Text to set to the clipboard, NUL terminated
 **/
 extern void		uBarrierSendClipboard(uBarrierContext *context, const char *text);
 
 
 
+/**
+@brief Send clipboard data in several formats
+
+This function sends new clipboard data of any size to the server. Packet headers are assembled in the
+reply buffer, the clipboard data itself is sent straight from @a formats without copying or truncating
+it, through m_sendVectorFunc if it is supplied.
+
+The data is sent right away with the send functions, which also carry the replies of the update thread.
+Call it from the update thread only, for example from a callback or between calls to uBarrierPoll.
+
+@param context		Context to send clipboard data to
+@param formats		Clipboard data, one entry per format
+@param numFormats	Number of entries in @a formats
+@returns			UBARRIER_TRUE if the data was sent, UBARRIER_FALSE if sending failed
+**/
+extern uBarrierBool	uBarrierSendClipboardData(uBarrierContext *context, const uBarrierClipboardData *formats, int numFormats);
+
+
+
+/**
+@brief Queue clipboard data to be sent by the update thread
+
+This function hands clipboard data to the update thread without waiting for it to be sent, so it may be
+called while uBarrierUpdate or uBarrierPoll runs on another thread. Only one thread may queue sends. The
+queue is a lock-free ring of UBARRIER_SEND_QUEUE_SIZE entries that the update thread drains after its
+replies, once the handshake is done, so packets never interleave.
+
+@a formats and the data it points to must stay valid until @a doneCallback is called on the update thread.
+Sends still queued when the connection is lost are dropped. A thread waiting in the receive function
+doesn't notice the new send by itself; wake it, for example through a pipe it polls along with the
+connection, or wait for the next keep alive.
+
+@param context		Context to send clipboard data to
+@param formats		Clipboard data, one entry per format
+@param numFormats	Number of entries in @a formats
+@param doneCallback	Called by the update thread when the send is over (can be NULL)
+@param userData		Passed to @a doneCallback
+@returns			UBARRIER_TRUE if the data was queued, UBARRIER_FALSE if the queue is full
+**/
+extern uBarrierBool	uBarrierQueueClipboard(uBarrierContext *context, const uBarrierClipboardData *formats, int numFormats, uBarrierSendDoneCallback doneCallback, void *userData);
+
+
+
 #ifdef __cplusplus
 };
 #endif
+
+#endif /* UBARRIER_CLIENT_H */
@@ -0,0 +1,294 @@
+/*
+uBarrier multiplexer -- Implementation for servicing many uBarrier contexts from one thread
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#include "uBarrierMux.h"
+#include <errno.h>
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Timer heap
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Does the timer of @a a expire before the one of @a b?
+**/
+static uBarrierBool sTimerBefore(const uBarrierMux *mux, int a, int b)
+{
+	return (int32_t)(mux->m_slots[a].m_deadline - mux->m_slots[b].m_deadline) < 0 ? UBARRIER_TRUE : UBARRIER_FALSE;
+}
+
+
+
+/**
+@brief Put slot @a slot at heap position @a pos
+**/
+static void sHeapPlace(uBarrierMux *mux, int pos, int slot)
+{
+	mux->m_slots[pos].m_heapSlot = slot;
+	mux->m_slots[slot].m_heapIndex = pos;
+}
+
+
+
+/**
+@brief Move the timer at heap position @a pos towards the top while it expires earlier than its parent
+**/
+static int sSiftUp(uBarrierMux *mux, int pos)
+{
+	int slot = mux->m_slots[pos].m_heapSlot;
+	while (pos > 0)
+	{
+		int parent = (pos-1) / 2;
+		int parent_slot = mux->m_slots[parent].m_heapSlot;
+		if (!sTimerBefore(mux, slot, parent_slot))
+			break;
+		sHeapPlace(mux, pos, parent_slot);
+		pos = parent;
+	}
+	sHeapPlace(mux, pos, slot);
+	return pos;
+}
+
+
+
+/**
+@brief Move the timer at heap position @a pos towards the bottom while a child expires earlier
+**/
+static void sSiftDown(uBarrierMux *mux, int pos)
+{
+	int slot = mux->m_slots[pos].m_heapSlot;
+	for (;;)
+	{
+		int child = pos*2 + 1;
+		int child_slot;
+		if (child >= mux->m_heapSize)
+			break;
+		if (child+1 < mux->m_heapSize && sTimerBefore(mux, mux->m_slots[child+1].m_heapSlot, mux->m_slots[child].m_heapSlot))
+			child++;
+		child_slot = mux->m_slots[child].m_heapSlot;
+		if (!sTimerBefore(mux, child_slot, slot))
+			break;
+		sHeapPlace(mux, pos, child_slot);
+		pos = child;
+	}
+	sHeapPlace(mux, pos, slot);
+}
+
+
+
+/**
+@brief Take the timer of @a slot out of the heap
+**/
+static void sHeapRemove(uBarrierMux *mux, int slot)
+{
+	int pos = mux->m_slots[slot].m_heapIndex;
+	int last;
+	if (pos < 0)
+		return;
+	mux->m_slots[slot].m_heapIndex = -1;
+	last = --mux->m_heapSize;
+	if (pos == last)
+		return;
+
+	// Fill the hole with the last timer, which may belong above or below it
+	sHeapPlace(mux, pos, mux->m_slots[last].m_heapSlot);
+	sSiftDown(mux, sSiftUp(mux, pos));
+}
+
+
+
+/**
+@brief Schedule the next timer of @a slot, @a timeout as returned by uBarrierNextTimeout
+**/
+static void sSetTimer(uBarrierMux *mux, int slot, int timeout, uint32_t now)
+{
+	uBarrierMuxSlot *entry = &mux->m_slots[slot];
+	if (timeout < 0)
+	{
+		sHeapRemove(mux, slot);
+		return;
+	}
+	entry->m_deadline = now + (uint32_t)timeout;
+	if (entry->m_heapIndex < 0)
+	{
+		sHeapPlace(mux, mux->m_heapSize++, slot);
+		sSiftUp(mux, entry->m_heapIndex);
+	}
+	else
+		sSiftDown(mux, sSiftUp(mux, entry->m_heapIndex));
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Interface
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Initialize a multiplexer
+**/
+void uBarrierMuxInit(uBarrierMux *mux, uBarrierMuxSlot *slots, struct pollfd *pollFds, int capacity, uBarrierGetTimeFunc getTimeFunc)
+{
+	int i;
+	mux->m_slots		= slots;
+	mux->m_pollFds		= pollFds;
+	mux->m_capacity		= capacity;
+	mux->m_heapSize		= 0;
+	mux->m_run			= 0;
+	mux->m_getTimeFunc	= getTimeFunc;
+	for (i = 0; i < capacity; i++)
+	{
+		slots[i].m_context		= 0L;
+		slots[i].m_heapIndex	= -1;
+		slots[i].m_servicedRun	= 0;
+	}
+}
+
+
+
+/**
+@brief Add a context
+**/
+uBarrierBool uBarrierMuxAdd(uBarrierMux *mux, uBarrierContext *context)
+{
+	int i;
+	for (i = 0; i < mux->m_capacity; i++)
+	{
+		if (mux->m_slots[i].m_context == 0L)
+		{
+			// Due right away, the first poll connects
+			mux->m_slots[i].m_context = context;
+			sSetTimer(mux, i, 0, mux->m_getTimeFunc());
+			return UBARRIER_TRUE;
+		}
+	}
+	return UBARRIER_FALSE;
+}
+
+
+
+/**
+@brief Remove a context
+**/
+void uBarrierMuxRemove(uBarrierMux *mux, uBarrierContext *context)
+{
+	int i;
+	for (i = 0; i < mux->m_capacity; i++)
+	{
+		if (mux->m_slots[i].m_context == context)
+		{
+			sHeapRemove(mux, i);
+			mux->m_slots[i].m_context = 0L;
+		}
+	}
+}
+
+
+
+/**
+@brief Wait for data or timers and service the contexts that need it
+**/
+int uBarrierMuxRun(uBarrierMux *mux, int maxWait)
+{
+	int num_fds = 0, num_serviced = 0, num_expired;
+	int timeout = maxWait;
+	uint32_t now;
+	int i;
+
+	// Collect the descriptors of connected contexts, they change on every reconnect
+	for (i = 0; i < mux->m_capacity; i++)
+	{
+		int fd;
+		if (mux->m_slots[i].m_context == 0L)
+			continue;
+		fd = uBarrierGetFd(mux->m_slots[i].m_context);
+		if (fd < 0)
+			continue;
+		mux->m_pollFds[num_fds].fd		= fd;
+		mux->m_pollFds[num_fds].events	= POLLIN;
+		mux->m_pollFds[num_fds].revents	= 0;
+		mux->m_slots[num_fds].m_pollSlot = i;
+		num_fds++;
+	}
+
+	// Sleep no longer than until the earliest timer
+	if (mux->m_heapSize > 0)
+	{
+		int32_t left = (int32_t)(mux->m_slots[mux->m_slots[0].m_heapSlot].m_deadline - mux->m_getTimeFunc());
+		if (left < 0)
+			left = 0;
+		if (timeout < 0 || left < timeout)
+			timeout = (int)left;
+	}
+	if (poll(mux->m_pollFds, (nfds_t)num_fds, timeout) < 0)
+		return errno == EINTR ? 0 : -1;
+
+	// Service the readable contexts, an error or hang up is for uBarrierPoll to find out
+	now = mux->m_getTimeFunc();
+	mux->m_run++;
+	for (i = 0; i < num_fds; i++)
+	{
+		int slot = mux->m_slots[i].m_pollSlot;
+		uBarrierContext *context = mux->m_slots[slot].m_context;
+		if ((mux->m_pollFds[i].revents & (POLLIN | POLLERR | POLLHUP)) == 0 || context == 0L)
+			continue;
+		uBarrierPoll(context);
+		mux->m_slots[slot].m_servicedRun = mux->m_run;
+		if (mux->m_slots[slot].m_context == context)
+			sSetTimer(mux, slot, uBarrierNextTimeout(context), now);
+		num_serviced++;
+	}
+
+	// Take the expired timers off the heap first, so a context that is due again right away waits for the next run
+	now = mux->m_getTimeFunc();
+	num_expired = 0;
+	while (mux->m_heapSize > 0 && (int32_t)(mux->m_slots[mux->m_slots[0].m_heapSlot].m_deadline - now) <= 0)
+	{
+		int slot = mux->m_slots[0].m_heapSlot;
+		sHeapRemove(mux, slot);
+		mux->m_slots[num_expired++].m_pollSlot = slot;
+	}
+
+	// Service the contexts whose timer expired, a context polled for data above gets its timer back instead
+	for (i = 0; i < num_expired; i++)
+	{
+		int slot = mux->m_slots[i].m_pollSlot;
+		uBarrierContext *context = mux->m_slots[slot].m_context;
+		if (context == 0L)
+			continue;
+		if (mux->m_slots[slot].m_servicedRun == mux->m_run)
+		{
+			sSetTimer(mux, slot, 0, now);
+			continue;
+		}
+		uBarrierPoll(context);
+		if (mux->m_slots[slot].m_context == context)
+			sSetTimer(mux, slot, uBarrierNextTimeout(context), now);
+		num_serviced++;
+	}
+	return num_serviced;
+}
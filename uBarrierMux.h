@@ -0,0 +1,140 @@
+/*
+uBarrier multiplexer -- Interface for servicing many uBarrier contexts from one thread
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#ifndef UBARRIER_MUX_H
+#define UBARRIER_MUX_H
+
+#include "uBarrier.h"
+#include <poll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Types
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Per context state of a multiplexer, storage supplied by the caller
+**/
+typedef struct
+{
+	uBarrierContext*				m_context;										/* Serviced context, NULL for a free slot */
+	uint32_t						m_deadline;										/* Time the context's next timer expires */
+	int								m_heapIndex;									/* Position in the timer heap, -1 without a timer */
+	int								m_heapSlot;										/* Slot at heap position of this slot's index */
+	int								m_pollSlot;										/* Slot at poll descriptor of this slot's index, then slot of an expired timer */
+	uint32_t						m_servicedRun;									/* Last run of uBarrierMuxRun that polled the context */
+} uBarrierMuxSlot;
+
+
+
+/**
+@brief Multiplexer context
+
+Services many contexts from one thread. Each context is polled only when its descriptor is readable or its
+next timer (idle timeout, key repeat, reconnect) expires. Timers of all contexts share one binary heap
+ordered by deadline, so finding the next timer is O(1) and rescheduling a context is O(log n).
+
+The contexts must supply m_getFdFunc and a non-blocking receive function, they are driven by uBarrierPoll
+and never sleep. Sends still block the thread, so they should be rare and small, as they are in Barrier.
+**/
+typedef struct
+{
+	uBarrierMuxSlot*				m_slots;										/* Slots, m_capacity entries */
+	struct pollfd*					m_pollFds;										/* Poll descriptors, m_capacity entries */
+	int								m_capacity;										/* Number of slots */
+	int								m_heapSize;										/* Number of contexts with a timer */
+	uint32_t						m_run;											/* Number of calls to uBarrierMuxRun */
+	uBarrierGetTimeFunc				m_getTimeFunc;									/* Get current time function, the one of the contexts */
+} uBarrierMux;
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Interface
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Initialize a multiplexer
+
+@param mux			Multiplexer to initialize
+@param slots		Storage for @a capacity slots
+@param pollFds		Storage for @a capacity poll descriptors
+@param capacity		Maximum number of contexts
+@param getTimeFunc	Get current time function, must use the clock of the contexts
+**/
+extern void		uBarrierMuxInit(uBarrierMux *mux, uBarrierMuxSlot *slots, struct pollfd *pollFds, int capacity, uBarrierGetTimeFunc getTimeFunc);
+
+
+
+/**
+@brief Add a context
+
+The context must be initialized and configured. It is polled on the next uBarrierMuxRun, which connects it.
+
+@param mux		Multiplexer to add to
+@param context	Context to service
+@returns		UBARRIER_TRUE if the context was added, UBARRIER_FALSE if all slots are in use
+**/
+extern uBarrierBool	uBarrierMuxAdd(uBarrierMux *mux, uBarrierContext *context);
+
+
+
+/**
+@brief Remove a context
+
+The context keeps its connection, closing it is up to the caller.
+
+@param mux		Multiplexer to remove from
+@param context	Context to stop servicing
+**/
+extern void		uBarrierMuxRemove(uBarrierMux *mux, uBarrierContext *context);
+
+
+
+/**
+@brief Wait for data or timers and service the contexts that need it
+
+Waits until a descriptor is readable, the earliest timer expires or @a maxWait passes, then calls
+uBarrierPoll for each readable context and each context whose timer expired.
+
+@param mux		Multiplexer to run
+@param maxWait	Longest time to wait in milliseconds, -1 to wait for data or timers only
+@returns		Number of contexts serviced, -1 if waiting failed (see errno)
+**/
+extern int		uBarrierMuxRun(uBarrierMux *mux, int maxWait);
+
+
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* UBARRIER_MUX_H */
@@ -0,0 +1,373 @@
+/*
+uBarrier protocol -- Wire format of the Barrier messages uBarrier reads and writes
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#ifndef UBARRIER_PROTOCOL_H
+#define UBARRIER_PROTOCOL_H
+
+/*
+	Internal to uBarrier.c, not part of the library interface.
+
+	Every message is described once in UBARRIER_PROTOCOL_MESSAGES, and the per message types, lengths,
+	decoders and encoders below are generated from that table. Adding a message or a protocol version
+	is one more table entry, nobody writes offsets by hand.
+*/
+#include "uBarrier.h"
+#include <stddef.h>
+#include <string.h>
+
+
+
+/**
+@brief Inline for static helpers, C compilers that predate C99 spell it differently
+**/
+#if !defined(UBARRIER_INLINE)
+	#if defined(_MSC_VER) && !defined(__cplusplus)
+		#define UBARRIER_INLINE		__inline
+	#else
+		#define UBARRIER_INLINE		inline
+	#endif
+#endif
+
+
+
+/**
+@brief Byte swap, a single instruction on the compilers that have a builtin for it
+**/
+#if !defined(UBARRIER_BSWAP16)
+	#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+		#define UBARRIER_BSWAP16(value)		__builtin_bswap16(value)
+		#define UBARRIER_BSWAP32(value)		__builtin_bswap32(value)
+	#elif defined(_MSC_VER)
+		#include <stdlib.h>
+		#define UBARRIER_BSWAP16(value)		_byteswap_ushort(value)
+		#define UBARRIER_BSWAP32(value)		_byteswap_ulong(value)
+	#else
+		#define UBARRIER_BSWAP16(value)		((uint16_t)(((value) >> 8) | ((value) << 8)))
+		#define UBARRIER_BSWAP32(value)		((((value) >> 24) & 0xff) | (((value) >> 8) & 0xff00) | (((value) & 0xff00) << 8) | ((value) << 24))
+	#endif
+#endif
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Message schema
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Messages with fields
+
+MESSAGE(name, id) starts a message, FIELD(name, type, width, field) adds a field of @a width bytes that decodes
+to @a type, END(name) closes the message. Fields are big-endian and packed, like Barrier's "%1i", "%2i" and
+"%4i". Only the fixed part of a message is described, strings ("%s") and lists ("%4I") are a length field here
+and the data behind it is read by the handler.
+**/
+#define UBARRIER_PROTOCOL_MESSAGES(MESSAGE, FIELD, END)																\
+	/*	kMsgHello			= "Barrier%2i%2i" */																		\
+	MESSAGE(HELLO,		"Barrier")																						\
+		FIELD(HELLO,		uint16_t,	2,	major)																		\
+		FIELD(HELLO,		uint16_t,	2,	minor)																		\
+	END(HELLO)																											\
+	/*	kMsgHelloBack		= "Barrier%2i%2i%s" */																		\
+	MESSAGE(HELLO_BACK,	"Barrier")																						\
+		FIELD(HELLO_BACK,	uint16_t,	2,	major)																		\
+		FIELD(HELLO_BACK,	uint16_t,	2,	minor)																		\
+		FIELD(HELLO_BACK,	uint32_t,	4,	nameLength)																	\
+	END(HELLO_BACK)																										\
+	/*	kMsgCEnter 			= "CINN%2i%2i%4i%2i" */																		\
+	MESSAGE(CINN,		"CINN")																							\
+		FIELD(CINN,			int16_t,	2,	x)																			\
+		FIELD(CINN,			int16_t,	2,	y)																			\
+		FIELD(CINN,			uint32_t,	4,	sequence)																	\
+		FIELD(CINN,			uint16_t,	2,	mask)																		\
+	END(CINN)																											\
+	/*	kMsgDMouseDown		= "DMDN%1i" */																				\
+	MESSAGE(DMDN,		"DMDN")																							\
+		FIELD(DMDN,			uint8_t,	1,	button)																		\
+	END(DMDN)																											\
+	/*	kMsgDMouseUp		= "DMUP%1i" */																				\
+	MESSAGE(DMUP,		"DMUP")																							\
+		FIELD(DMUP,			uint8_t,	1,	button)																		\
+	END(DMUP)																											\
+	/*	kMsgDMouseMove		= "DMMV%2i%2i" */																			\
+	MESSAGE(DMMV,		"DMMV")																							\
+		FIELD(DMMV,			int16_t,	2,	x)																			\
+		FIELD(DMMV,			int16_t,	2,	y)																			\
+	END(DMMV)																											\
+	/*	kMsgDMouseRelMove	= "DMRM%2i%2i" */																			\
+	MESSAGE(DMRM,		"DMRM")																							\
+		FIELD(DMRM,			int16_t,	2,	x)																			\
+		FIELD(DMRM,			int16_t,	2,	y)																			\
+	END(DMRM)																											\
+	/*	kMsgDMouseWheel		= "DMWM%2i%2i" */																			\
+	MESSAGE(DMWM,		"DMWM")																							\
+		FIELD(DMWM,			int16_t,	2,	x)																			\
+		FIELD(DMWM,			int16_t,	2,	y)																			\
+	END(DMWM)																											\
+	/*	kMsgDKeyDown		= "DKDN%2i%2i%2i" */																		\
+	MESSAGE(DKDN,		"DKDN")																							\
+		FIELD(DKDN,			uint16_t,	2,	id)																			\
+		FIELD(DKDN,			uint16_t,	2,	mask)																		\
+		FIELD(DKDN,			uint16_t,	2,	button)																		\
+	END(DKDN)																											\
+	/*	kMsgDKeyRepeat		= "DKRP%2i%2i%2i%2i" */																		\
+	MESSAGE(DKRP,		"DKRP")																							\
+		FIELD(DKRP,			uint16_t,	2,	id)																			\
+		FIELD(DKRP,			uint16_t,	2,	mask)																		\
+		FIELD(DKRP,			uint16_t,	2,	count)																		\
+		FIELD(DKRP,			uint16_t,	2,	button)																		\
+	END(DKRP)																											\
+	/*	kMsgDKeyUp			= "DKUP%2i%2i%2i" */																		\
+	MESSAGE(DKUP,		"DKUP")																							\
+		FIELD(DKUP,			uint16_t,	2,	id)																			\
+		FIELD(DKUP,			uint16_t,	2,	mask)																		\
+		FIELD(DKUP,			uint16_t,	2,	button)																		\
+	END(DKUP)																											\
+	/*	kMsgDGameButtons	= "DGBT%1i%2i" */																			\
+	MESSAGE(DGBT,		"DGBT")																							\
+		FIELD(DGBT,			uint8_t,	1,	joystick)																	\
+		FIELD(DGBT,			uint16_t,	2,	buttons)																	\
+	END(DGBT)																											\
+	/*	kMsgDGameSticks		= "DGST%1i%1i%1i%1i%1i" */																	\
+	MESSAGE(DGST,		"DGST")																							\
+		FIELD(DGST,			uint8_t,	1,	joystick)																	\
+		FIELD(DGST,			int8_t,		1,	x1)																			\
+		FIELD(DGST,			int8_t,		1,	y1)																			\
+		FIELD(DGST,			int8_t,		1,	x2)																			\
+		FIELD(DGST,			int8_t,		1,	y2)																			\
+	END(DGST)																											\
+	/*	kMsgDSetOptions		= "DSOP%4I" */																				\
+	MESSAGE(DSOP,		"DSOP")																							\
+		FIELD(DSOP,			uint32_t,	4,	count)																		\
+	END(DSOP)																											\
+	/*	kMsgDClipboard		= "DCLP%1i%4i%1i%s"	(1.6) */																\
+	MESSAGE(DCLP,		"DCLP")																							\
+		FIELD(DCLP,			uint8_t,	1,	id)																			\
+		FIELD(DCLP,			uint32_t,	4,	sequence)																	\
+		FIELD(DCLP,			uint8_t,	1,	mark)																		\
+		FIELD(DCLP,			uint32_t,	4,	size)																		\
+	END(DCLP)																											\
+	/*	kMsgDClipboard1_0	= "DCLP%1i%4i%s" */																			\
+	MESSAGE(DCLP_1_0,	"DCLP")																							\
+		FIELD(DCLP_1_0,		uint8_t,	1,	id)																			\
+		FIELD(DCLP_1_0,		uint32_t,	4,	sequence)																	\
+		FIELD(DCLP_1_0,		uint32_t,	4,	size)																		\
+	END(DCLP_1_0)																										\
+	/*	kMsgDInfo			= "DINF%2i%2i%2i%2i%2i%2i%2i" */															\
+	MESSAGE(DINF,		"DINF")																							\
+		FIELD(DINF,			int16_t,	2,	x)																			\
+		FIELD(DINF,			int16_t,	2,	y)																			\
+		FIELD(DINF,			uint16_t,	2,	width)																		\
+		FIELD(DINF,			uint16_t,	2,	height)																		\
+		FIELD(DINF,			uint16_t,	2,	warp)																		\
+		FIELD(DINF,			int16_t,	2,	mouseX)																		\
+		FIELD(DINF,			int16_t,	2,	mouseY)																		\
+	END(DINF)																											\
+	/*	kMsgEIncompatible	= "EICV%2i%2i" */																			\
+	MESSAGE(EICV,		"EICV")																							\
+		FIELD(EICV,			uint16_t,	2,	major)																		\
+		FIELD(EICV,			uint16_t,	2,	minor)																		\
+	END(EICV)
+
+
+
+/**
+@brief Messages that are only their ID
+
+SIGNAL(name, id)
+**/
+#define UBARRIER_PROTOCOL_SIGNALS(SIGNAL)																				\
+	SIGNAL(QINF,	"QINF")		/* kMsgQInfo			*/																\
+	SIGNAL(CIAK,	"CIAK")		/* kMsgCInfoAck			*/																\
+	SIGNAL(CROP,	"CROP")		/* kMsgCResetOptions	*/																\
+	SIGNAL(COUT,	"COUT")		/* kMsgCLeave			*/																\
+	SIGNAL(CALV,	"CALV")		/* kMsgCKeepAlive		*/																\
+	SIGNAL(CNOP,	"CNOP")		/* kMsgCNoop			*/																\
+	SIGNAL(CBYE,	"CBYE")		/* kMsgCClose			*/																\
+	SIGNAL(EUNK,	"EUNK")		/* kMsgEUnknown			*/																\
+	SIGNAL(EBSY,	"EBSY")		/* kMsgEBusy			*/																\
+	SIGNAL(EBAD,	"EBAD")		/* kMsgEBad				*/
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Field access
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Read a big-endian field, the width in bytes is part of the name so the generators can paste it
+**/
+static UBARRIER_INLINE uint8_t sWireRead1(const uint8_t *field)
+{
+	return *field;
+}
+
+static UBARRIER_INLINE uint16_t sWireRead2(const uint8_t *field)
+{
+	uint16_t value;
+	memcpy(&value, field, sizeof(value));
+#ifdef UBARRIER_LITTLE_ENDIAN
+	value = UBARRIER_BSWAP16(value);
+#endif
+	return value;
+}
+
+static UBARRIER_INLINE uint32_t sWireRead4(const uint8_t *field)
+{
+	uint32_t value;
+	memcpy(&value, field, sizeof(value));
+#ifdef UBARRIER_LITTLE_ENDIAN
+	value = UBARRIER_BSWAP32(value);
+#endif
+	return value;
+}
+
+
+
+/**
+@brief Write a big-endian field
+**/
+static UBARRIER_INLINE void sWireWrite1(uint8_t *field, uint8_t value)
+{
+	*field = value;
+}
+
+static UBARRIER_INLINE void sWireWrite2(uint8_t *field, uint16_t value)
+{
+#ifdef UBARRIER_LITTLE_ENDIAN
+	value = UBARRIER_BSWAP16(value);
+#endif
+	memcpy(field, &value, sizeof(value));
+}
+
+static UBARRIER_INLINE void sWireWrite4(uint8_t *field, uint32_t value)
+{
+#ifdef UBARRIER_LITTLE_ENDIAN
+	value = UBARRIER_BSWAP32(value);
+#endif
+	memcpy(field, &value, sizeof(value));
+}
+
+
+
+//---------------------------------------------------------------------------------------------------------------------
+//	Generated codecs
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Wire layout, only used for the field offsets
+
+Byte arrays have no alignment, so offsetof() is the offset on the wire. sizeof() isn't used, some ABIs
+round structures up.
+**/
+#define sLAYOUT_MESSAGE(name, id)					typedef struct { uint8_t m_messageId[sizeof(id)-1];
+#define sLAYOUT_FIELD(name, type, width, field)		uint8_t m_##field[width];
+#define sLAYOUT_END(name)							} sWire##name;
+UBARRIER_PROTOCOL_MESSAGES(sLAYOUT_MESSAGE, sLAYOUT_FIELD, sLAYOUT_END)
+#undef sLAYOUT_MESSAGE
+#undef sLAYOUT_FIELD
+#undef sLAYOUT_END
+
+
+
+/**
+@brief Offset of a field from the start of a packet, which begins with the 4 byte length prefix
+**/
+#define UBARRIER_WIRE_OFFSET(name, field)			(4 + offsetof(sWire##name, m_##field))
+
+
+
+/**
+@brief Length of the fixed part of each message, message ID included, length prefix excluded
+
+UBARRIER_WIRE_LENGTH_<name>, a packet at least this long can be handed to its decoder.
+**/
+#define sLENGTH_MESSAGE(name, id)					UBARRIER_WIRE_LENGTH_##name = sizeof(id)-1
+#define sLENGTH_FIELD(name, type, width, field)		+ width
+#define sLENGTH_END(name)							,
+#define sLENGTH_SIGNAL(name, id)					UBARRIER_WIRE_LENGTH_##name = sizeof(id)-1,
+enum
+{
+	UBARRIER_PROTOCOL_MESSAGES(sLENGTH_MESSAGE, sLENGTH_FIELD, sLENGTH_END)
+	UBARRIER_PROTOCOL_SIGNALS(sLENGTH_SIGNAL)
+};
+#undef sLENGTH_MESSAGE
+#undef sLENGTH_FIELD
+#undef sLENGTH_END
+#undef sLENGTH_SIGNAL
+
+
+
+/**
+@brief Decoded message, sMessage<name>
+**/
+#define sMESSAGE_MESSAGE(name, id)					typedef struct {
+#define sMESSAGE_FIELD(name, type, width, field)	type m_##field;
+#define sMESSAGE_END(name)							} sMessage##name;
+UBARRIER_PROTOCOL_MESSAGES(sMESSAGE_MESSAGE, sMESSAGE_FIELD, sMESSAGE_END)
+#undef sMESSAGE_MESSAGE
+#undef sMESSAGE_FIELD
+#undef sMESSAGE_END
+
+
+
+/**
+@brief Decoder, sDecode<name>(packet, decoded)
+
+@a packet starts with the length prefix, like the packets handed to the message handlers, and must have been
+checked against UBARRIER_WIRE_LENGTH_<name>. Every field is a load from a constant offset.
+**/
+#define sDECODE_MESSAGE(name, id)					static UBARRIER_INLINE void sDecode##name(const uint8_t *packet, sMessage##name *decoded) {
+#define sDECODE_FIELD(name, type, width, field)		decoded->m_##field = (type)sWireRead##width(packet + UBARRIER_WIRE_OFFSET(name, field));
+#define sDECODE_END(name)							}
+UBARRIER_PROTOCOL_MESSAGES(sDECODE_MESSAGE, sDECODE_FIELD, sDECODE_END)
+#undef sDECODE_MESSAGE
+#undef sDECODE_FIELD
+#undef sDECODE_END
+
+
+
+/**
+@brief Encoder, sEncode<name>(body, message) for messages with fields and sEncode<name>(body) for signals
+
+Writes the message ID and the fields to @a body, which is where the message goes after its length prefix, and
+returns the end of the fixed part. Strings and lists are appended behind it by the caller.
+**/
+#define sENCODE_MESSAGE(name, id)					static UBARRIER_INLINE uint8_t *sEncode##name(uint8_t *body, const sMessage##name *message) { memcpy(body, id, sizeof(id)-1);
+#define sENCODE_FIELD(name, type, width, field)		sWireWrite##width(body + offsetof(sWire##name, m_##field), message->m_##field);
+#define sENCODE_END(name)							return body + UBARRIER_WIRE_LENGTH_##name; }
+#define sENCODE_SIGNAL(name, id)					static UBARRIER_INLINE uint8_t *sEncode##name(uint8_t *body) { memcpy(body, id, sizeof(id)-1); return body + UBARRIER_WIRE_LENGTH_##name; }
+UBARRIER_PROTOCOL_MESSAGES(sENCODE_MESSAGE, sENCODE_FIELD, sENCODE_END)
+UBARRIER_PROTOCOL_SIGNALS(sENCODE_SIGNAL)
+#undef sENCODE_MESSAGE
+#undef sENCODE_FIELD
+#undef sENCODE_END
+#undef sENCODE_SIGNAL
+
+
+
+#endif